@@ -14,18 +14,36 @@
 #include "cmdargs/cmdargs.hpp"
 
 #include "../common/utils.hpp"
-#include "../common/fnv1a.hpp"
 #include "../common/average.hpp"
 #include "../common/string_buffer.hpp"
+#include "../common/protocol.hpp"
+#include "../common/command_registry.hpp"
+#include "../common/fnv1a.hpp"
+#include "../common/compression.hpp"
+#include "../common/shm_ring.hpp"
 
 #include <boost/asio.hpp>
 
 namespace ba = boost::asio;
 namespace bs = boost::system;
 using tcp = boost::asio::ip::tcp;
+using local = boost::asio::local::stream_protocol;
 
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <queue>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 /**********************************************************************************************************************/
 
@@ -37,20 +55,38 @@ struct client final {
          ba::io_context &ioctx
         ,const std::string &ip
         ,std::uint16_t port
+        ,const std::string &unix_path
         ,buffers_pool &str_pool
         ,const std::string &fname
         ,std::size_t ping_ms
+        ,bool binary
+        ,bool ack
+        ,bool compress
+        ,bool shm
     )
         :m_socket{ioctx}
         ,m_queue{}
         ,m_on_write{false}
+        ,m_generation{}
         ,m_ip{ip}
         ,m_port{port}
+        ,m_unix_path{unix_path}
         ,m_str_pool{str_pool}
         ,m_state_fname{fname}
         ,m_ping_ms{ping_ms}
         ,m_ping_timer{ioctx}
         ,m_timeout_timer{ioctx}
+        ,m_reconnect_timer{ioctx}
+        ,m_binary{binary}
+        ,m_read_protocol{protocol::text}
+        ,m_ack{ack}
+        ,m_ack_avg{}
+        ,m_next_id{}
+        ,m_inflight{}
+        ,m_compress{compress}
+        ,m_shm{shm}
+        ,m_inflater{}
+        ,m_plain{}
     {}
 
     ~client() {
@@ -68,8 +104,11 @@ struct client final {
         }
     }
     void stop() {
-        m_socket.shutdown(tcp::socket::shutdown_send);
-        m_socket.close();
+        bs::error_code ec;
+        m_socket.shutdown(ba::generic::stream_protocol::socket::shutdown_send, ec);
+        m_socket.close(ec);
+        // the write in flight completes with the error, and must not continue the chain over the new connection
+        ++m_generation;
         m_on_write = false;
     }
     void stop_ping() {
@@ -87,12 +126,71 @@ struct client final {
         );
     }
 
+    // requests the full state again and stops the changes over the connection.
+    // used when the shared memory ring's reader was lapped and lost the changes
+    void resync() {
+        send(m_binary
+            ? make_binary_frame(m_str_pool, binary_cmd::subs, std::string_view{"\0", 1})
+            : make_buffer(m_str_pool, "SUBS \n")
+        );
+        send(make_usub_all());
+    }
+
+    // the line in the form "key val\n" as read from the terminal
+    void send_data(shared_buffer line) {
+        const auto id = m_next_id++;
+        if ( m_ack ) {
+            m_inflight.emplace(id, ms_time());
+        }
+
+        if ( !m_binary ) {
+            if ( m_ack ) {
+                line->preppend("DACK " + std::to_string(id) + " ");
+            } else {
+                line->preppend("DATA ");
+            }
+            send(std::move(line));
+
+            return;
+        }
+
+        auto view = line->view();
+        if ( !view.empty() && view.back() == '\n' ) {
+            view.remove_suffix(1);
+        }
+        const auto pos = view.find(' ');
+        if ( pos == std::string_view::npos ) {
+            std::cerr << "wrong data line: " << view << std::endl;
+
+            return;
+        }
+
+        const auto key = view.substr(0, pos);
+        const auto val = view.substr(pos + 1);
+        if ( m_ack ) {
+            char hdr[max_varint_size * 2];
+            auto *p = encode_varint(hdr, id);
+            p = encode_varint(p, key.size());
+            std::string payload{hdr, static_cast<std::size_t>(p - hdr)};
+            payload += key;
+            payload += val;
+            send(make_binary_frame(m_str_pool, binary_cmd::dack, payload));
+        } else {
+            send(make_binary_data(m_str_pool, key, val));
+        }
+    }
+
     std::size_t avg_latency() const { return m_avg.avg(); }
+    // of the DACKs, from sending to receiving the ack
+    std::size_t avg_ack_latency() const { return m_ack_avg.avg(); }
 
 private:
     template<typename CB>
     void start_impl(CB cb) {
-        tcp::endpoint ep{ba::ip::make_address_v4(m_ip), m_port};
+        const auto ep = m_unix_path.empty()
+            ? ba::generic::stream_protocol::endpoint{tcp::endpoint{ba::ip::make_address_v4(m_ip), m_port}}
+            : ba::generic::stream_protocol::endpoint{local::endpoint{m_unix_path}}
+        ;
         m_socket.async_connect(
              ep
             ,[this, cb=std::move(cb)]
@@ -107,21 +205,42 @@ private:
             return;
         }
 
+        if ( m_binary ) {
+            // the frames can be sent right after the request
+            send(make_buffer(m_str_pool, "PROT bin\n"));
+        }
+        if ( m_compress ) {
+            send(m_binary
+                ? make_binary_frame(m_str_pool, binary_cmd::comp, "zlib")
+                : make_buffer(m_str_pool, "COMP zlib\n")
+            );
+        }
+        if ( m_shm ) {
+            // the state is synced over the connection, and the changes are read from the ring
+            send(make_usub_all());
+        }
+
         start_ping();
         restart_timeout_timer();
 
         start_read(make_buffer(m_str_pool));
     }
+    shared_buffer make_usub_all() {
+        return m_binary
+            ? make_binary_frame(m_str_pool, binary_cmd::usub, std::string_view{})
+            : make_buffer(m_str_pool, "USUB \n")
+        ;
+    }
     void start_read(shared_buffer buf) {
         auto *ptr = buf.get();
-        ba::async_read_until(
-             m_socket
-            ,ba::dynamic_buffer(ptr->string())
-            ,'\n'
-            ,[this, buf=std::move(buf)]
+        auto cb = [this, buf=std::move(buf)]
              (const bs::error_code &ec, std::size_t rd) mutable
-             { on_readed(std::move(buf), ec, rd); }
-        );
+             { on_readed(std::move(buf), ec, rd); };
+        if ( m_read_protocol == protocol::binary ) {
+            ba::async_read_until(m_socket, ptr->dynamic_buffer(), frame_match{}, std::move(cb));
+        } else {
+            ba::async_read_until(m_socket, ptr->dynamic_buffer(), '\n', std::move(cb));
+        }
     }
     void on_readed(shared_buffer buf, const bs::error_code &ec, std::size_t rd) {
         if ( ec ) {
@@ -130,37 +249,275 @@ private:
             return;
         }
 
-        auto str = make_buffer(m_str_pool, buf->data(), buf->data() + rd);
-        buf->erase(0, rd);
+        auto str = make_slice(m_str_pool, buf, 0, rd);
+        buf->consume(rd);
 
-        //std::cout << "readed: " << str->string();
-        constexpr auto ping_cmd = fnv1a("PING");
-        constexpr auto data_cmd = fnv1a("DATA");
-        constexpr auto stop_cmd = fnv1a("STOP");
-        const auto cmd = std::string_view{str->data(), 4};
-        switch ( auto hash = fnv1a(cmd); hash ) {
-            case ping_cmd: { handle_ping(std::move(str)); break; }
-            case data_cmd: { handle_data(std::move(str)); break; }
-            case stop_cmd: { handle_stop(std::move(str)); break; }
-            default: {
-                std::cerr << "wrong command received: " << cmd << std::endl;
+        if ( !dispatch(std::move(str)) ) {
+            return;
+        }
+
+        if ( m_inflater ) {
+            // the rest is compressed
+            return on_compressed(std::move(buf));
+        }
+
+        start_read(std::move(buf));
+    }
+    // the compressed bytes are inflated, and the complete messages are dispatched
+    void on_compressed(shared_buffer raw) {
+        if ( !m_inflater->decompress(raw->view(), *m_plain) ) {
+            std::cerr << "decompression error" << std::endl;
 
+            return;
+        }
+        raw->clear();
+
+        for ( ;; ) {
+            const auto view = m_plain->view();
+            std::size_t size = 0;
+            if ( m_read_protocol == protocol::binary ) {
+                const auto [end, matched] = frame_match{}(view.data(), view.data() + view.size());
+                size = matched ? static_cast<std::size_t>(end - view.data()) : 0u;
+            } else {
+                const auto pos = view.find('\n');
+                size = (pos != std::string_view::npos) ? pos + 1 : 0u;
+            }
+            if ( !size ) {
+                break;
+            }
+
+            auto str = make_slice(m_str_pool, m_plain, 0, size);
+            m_plain->consume(size);
+            if ( !dispatch(std::move(str)) ) {
                 return;
             }
         }
 
-        start_read(std::move(buf));
+        static constexpr std::size_t read_size = 4096u;
+        auto *ptr = raw.get();
+        m_socket.async_read_some(
+             ba::mutable_buffer{ptr->prepare(read_size), read_size}
+            ,[this, raw=std::move(raw)]
+             (const bs::error_code &ec, std::size_t rd) mutable
+             {
+                if ( ec ) {
+                    std::cerr << "read error: " << ec.message() << std::endl;
+
+                    return;
+                }
+
+                raw->commit(rd);
+                on_compressed(std::move(raw));
+             }
+        );
+    }
+    // returns false if the message is wrong, or the connection is closed by it
+    bool dispatch(shared_buffer str) {
+        if ( m_read_protocol == protocol::binary ) {
+            return on_frame(std::move(str));
+        }
+
+        //std::cout << "readed: " << str->view();
+        static constexpr command<bool(client::*)(shared_buffer)> commands[] = {
+             {"PING", &client::handle_ping}
+            ,{"DATA", &client::handle_data}
+            ,{"STOP", &client::handle_stop}
+            ,{"BUSY", &client::handle_busy}
+            ,{"PROT", &client::handle_prot}
+            ,{"DELE", &client::handle_dele}
+            ,{"ACKS", &client::handle_acks}
+            ,{"COMP", &client::handle_comp}
+        };
+        static constexpr command_registry registry{commands};
+
+        const auto handler = (str->size() > command_name_size)
+            ? registry.find(str->data())
+            : nullptr
+        ;
+        if ( !handler ) {
+            std::cerr << "wrong line received: " << str->view() << std::flush;
+
+            return false;
+        }
+
+        return (this->*handler)(std::move(str));
+    }
+    bool on_frame(shared_buffer str) {
+        binary_frame frame;
+        if ( !parse_frame(str->view(), frame) ) {
+            std::cerr << "wrong frame received" << std::endl;
+
+            return false;
+        }
+
+        switch ( frame.cmd ) {
+            case binary_cmd::ping: { handle_ping(std::move(str)); break; }
+            case binary_cmd::data: {
+                std::string_view key, val;
+                if ( !parse_data_payload(frame.payload, key, val) ) {
+                    std::cerr << "wrong DATA frame received" << std::endl;
+
+                    return false;
+                }
+                std::cout << "handle_data: DATA " << key << " " << val << std::endl;
+                break;
+            }
+            case binary_cmd::stop: {
+                std::uint64_t ms = 0;
+                if ( !parse_varints_payload(frame.payload, ms) ) {
+                    std::cerr << "wrong STOP frame received" << std::endl;
+
+                    return false;
+                }
+                on_stop(ms);
+
+                return false;
+            }
+            case binary_cmd::comp: { on_comp(frame.payload); break; }
+            case binary_cmd::dele: { std::cout << "handle_dele: DELE " << frame.payload << std::endl; break; }
+            case binary_cmd::acks: {
+                for ( auto payload = frame.payload; !payload.empty(); ) {
+                    std::uint64_t id;
+                    const auto len = decode_varint(payload.begin(), payload.end(), id);
+                    if ( len == 0 || len >= payload.size() ) {
+                        std::cerr << "wrong ACKS frame received" << std::endl;
+
+                        return false;
+                    }
+                    on_ack(id, payload[len] != 0);
+                    payload.remove_prefix(len + 1);
+                }
+                break;
+            }
+            default: {
+                std::cerr << "wrong frame command received: " << static_cast<unsigned>(frame.cmd) << std::endl;
+
+                return false;
+            }
+        }
+
+        return true;
     }
 
-    void handle_ping(shared_buffer) {
+    // the text commands' handlers return false if the connection is closed
+    bool handle_ping(shared_buffer) {
         restart_timeout_timer();
+
+        return true;
     }
-    void handle_data(shared_buffer val) {
-        std::cout << "handle_data: " << val->string() << std::flush;
+    bool handle_data(shared_buffer val) {
+        std::cout << "handle_data: " << val->view() << std::flush;
+
+        return true;
+    }
+    bool handle_dele(shared_buffer key) {
+        std::cout << "handle_dele: " << key->view() << std::flush;
+
+        return true;
+    }
+    // "ACKS id:changed id:changed...\n"
+    bool handle_acks(shared_buffer str) {
+        auto view = str->view().substr(4);
+        while ( view.size() > 3 && view.front() == ' ' ) {
+            std::uint64_t id;
+            const auto res = std::from_chars(view.data() + 1, view.data() + view.size(), id);
+            if ( res.ec != std::errc{} || res.ptr + 2 > view.data() + view.size() || *res.ptr != ':' ) {
+                break;
+            }
+            on_ack(id, res.ptr[1] == '1');
+            view.remove_prefix(static_cast<std::size_t>(res.ptr + 2 - view.data()));
+        }
+
+        return true;
+    }
+    void on_ack(std::uint64_t id, bool changed) {
+        auto it = m_inflight.find(id);
+        if ( it == m_inflight.end() ) {
+            std::cerr << "unexpected ack: " << id << std::endl;
+
+            return;
+        }
+
+        const auto latency = ms_time() - it->second;
+        m_inflight.erase(it);
+        m_ack_avg.update(latency);
+        std::cout << "handle_acks: id=" << id << ", changed=" << changed << ", latency=" << latency
+                  << " ms, avg=" << m_ack_avg.avg() << " ms" << std::endl;
     }
-    void handle_stop(shared_buffer) {
-        std::cout << "handle_stop: STOP received!" << std::endl;
+    bool handle_comp(shared_buffer str) {
+        auto method = str->view().substr(5);
+        if ( !method.empty() && method.back() == '\n' ) {
+            method.remove_suffix(1);
+        }
+        on_comp(method);
+
+        return true;
+    }
+    void on_comp(std::string_view method) {
+        std::cout << "handle_comp: " << method << std::endl;
+        if ( method == "zlib" ) {
+            m_inflater = std::make_unique<inflate_stream>();
+            m_plain = make_buffer(m_str_pool);
+        }
+    }
+    // "STOP ms\n" - the server is reset, and will close the connection
+    bool handle_stop(shared_buffer str) {
+        const auto view = str->view();
+        std::size_t ms = 0;
+        std::from_chars(view.data() + 5, view.data() + view.size(), ms);
+        on_stop(ms);
+
+        return false;
+    }
+    void on_stop(std::size_t ms) {
+        std::cout << "handle_stop: STOP received, reconnect after " << ms << " ms" << std::endl;
+        reconnect(ms);
+    }
+    // "BUSY ms\n" - the server rejected the connection, and will close it
+    bool handle_busy(shared_buffer str) {
+        const auto view = str->view();
+        std::size_t ms = 0;
+        std::from_chars(view.data() + 5, view.data() + view.size(), ms);
+        std::cout << "handle_busy: the server is busy, retry after " << ms << " ms" << std::endl;
+        reconnect(ms);
+
+        return false;
+    }
+
+    // the connection is closed and is opened again after `ms` MS, the state is synced again by the server.
+    // the failed attempts are repeated each ping interval
+    void reconnect(std::size_t ms) {
+        stop_ping();
         stop();
+        m_reconnect_timer.expires_after(std::chrono::milliseconds{ms});
+        m_reconnect_timer.async_wait(
+            [this](const bs::error_code &ec) {
+                if ( ec ) {
+                    return;
+                }
+
+                m_queue = {};
+                m_read_protocol = protocol::text;
+                m_inflater.reset();
+                start_impl(
+                    [this](const bs::error_code &ec) {
+                        if ( ec ) {
+                            std::cout << "reconnection error: " << ec.message() << std::endl;
+
+                            return reconnect(m_ping_ms);
+                        }
+                        std::cout << "successfully reconnected!" << std::endl;
+                    }
+                );
+            }
+        );
+    }
+    bool handle_prot(shared_buffer str) {
+        // everything after the reply is binary
+        std::cout << "handle_prot: " << str->view() << std::flush;
+        m_read_protocol = protocol::binary;
+
+        return true;
     }
 
     void push_to_queue(shared_buffer str) {
@@ -179,14 +536,18 @@ private:
         auto *ptr = str.get();
         ba::async_write(
              m_socket
-            ,ba::dynamic_buffer(ptr->string())
-            ,[this, str=std::move(str)]
+            ,ptr->buffer()
+            ,[this, str=std::move(str), generation=m_generation]
              (const bs::error_code &ec, std::size_t wr) mutable
-             { on_sent(std::move(str), ec, wr); }
+             { on_sent(std::move(str), generation, ec, wr); }
         );
     }
-    void on_sent(shared_buffer str, const bs::error_code &ec, std::size_t) {
+    void on_sent(shared_buffer str, std::uint64_t generation, const bs::error_code &ec, std::size_t) {
         //std::cout << "on_sent: " << str << ", addr=" << (const void *)str.data() << std::endl;
+        if ( generation != m_generation ) {
+            // the connection was closed, the queue belongs to the next one
+            return;
+        }
         if ( ec ) {
             std::cerr  << "send error: " << ec.message() << std::endl;
         }
@@ -214,10 +575,19 @@ private:
         }
 
         auto time = ms_time();
+        if ( m_binary ) {
+            char buf[max_varint_size];
+            const auto *end = encode_varint(buf, time);
+            send(make_binary_frame(m_str_pool, binary_cmd::ping, std::string_view{buf, std::size_t(end - buf)}));
+
+            return start_ping();
+        }
+
         auto timestr = std::to_string(time);
 
         static const char *ping_str = "PING ";
-        auto str = make_buffer(m_str_pool, ping_str, ping_str + 5);
+        auto str = make_sized_buffer(m_str_pool, 5 + timestr.size() + 1);
+        str->append(std::string_view{ping_str, 5});
         str->append(timestr);
         str->append('\n');
 
@@ -235,17 +605,40 @@ private:
     }
 
 private:
-    tcp::socket m_socket;
+    // TCP or AF_UNIX
+    ba::generic::stream_protocol::socket m_socket;
     std::queue<shared_buffer> m_queue;
     bool m_on_write;
+    // incremented on each close, the writes of the closed connection are not continued
+    std::uint64_t m_generation;
     std::string m_ip;
     std::uint16_t m_port;
+    // used instead of the IP and PORT if not empty
+    std::string m_unix_path;
     buffers_pool &m_str_pool;
     std::string m_state_fname;
     std::size_t m_ping_ms;
     ba::steady_timer m_ping_timer;
     ba::steady_timer m_timeout_timer;
+    ba::steady_timer m_reconnect_timer;
     average<10> m_avg;
+    // the binary protocol is requested
+    bool m_binary;
+    protocol m_read_protocol;
+    // the DACK is sent instead of DATA, and the apply latency is measured
+    bool m_ack;
+    average<10> m_ack_avg;
+    std::uint64_t m_next_id;
+    // id -> ms-time it was sent
+    std::unordered_map<std::uint64_t, std::uint64_t> m_inflight;
+    // the compression is requested
+    bool m_compress;
+    // the changes are read from the shared memory ring instead of the connection
+    bool m_shm;
+    // not null when the server's messages are compressed
+    std::unique_ptr<inflate_stream> m_inflater;
+    // the inflated bytes not dispatched yet
+    shared_buffer m_plain;
 };
 
 /**********************************************************************************************************************/
@@ -279,7 +672,7 @@ private:
         auto *str = buf.get();
         ba::async_read_until(
              m_stdin
-            ,ba::dynamic_buffer(str->string())
+            ,str->dynamic_buffer()
             ,'\n'
             ,[this, buf=std::move(buf), cb=std::move(cb)]
              (const bs::error_code &ec, std::size_t rd) mutable
@@ -291,8 +684,8 @@ private:
         if ( ec ) {
             cb(ec, shared_buffer{});
         } else {
-            auto str = make_buffer(m_str_pool, buf->data(), buf->data() + rd);
-            buf->erase(0, rd);
+            auto str = make_slice(m_str_pool, buf, 0, rd);
+            buf->consume(rd);
 
             cb(ec, std::move(str));
 
@@ -308,13 +701,487 @@ private:
 
 /**********************************************************************************************************************/
 
+// reads the broadcasts the server publishes to the shared memory ring, on its own thread,
+// without any syscall while the ring is not idle.
+// the ring carries the binary frames. the state published before the start, or lost when the reader
+// was lapped, is requested from the server over the connection.
+
+struct shm_subscriber {
+    shm_subscriber(const shm_subscriber &) = delete;
+    shm_subscriber& operator= (const shm_subscriber &) = delete;
+
+    explicit shm_subscriber(const std::string &name)
+        :m_reader{name}
+        ,m_stop{false}
+        ,m_thread{}
+    {}
+    ~shm_subscriber()
+    { stop(); }
+
+    // OnLappedCB's signature: void()
+    // called on the reader's thread
+    template<typename OnLappedCB>
+    void start(OnLappedCB on_lapped_cb) {
+        m_thread = std::thread{[this, on_lapped_cb=std::move(on_lapped_cb)]() mutable { run(on_lapped_cb); }};
+    }
+    void stop() {
+        m_stop = true;
+        if ( m_thread.joinable() ) {
+            m_thread.join();
+        }
+    }
+
+private:
+    template<typename OnLappedCB>
+    void run(OnLappedCB &on_lapped_cb) {
+        static constexpr std::size_t chunk_size = 64u * 1024u;
+        std::string pending;
+        std::unique_ptr<char[]> chunk{new char[chunk_size]};
+        while ( !m_stop.load(std::memory_order_relaxed) ) {
+            const auto res = m_reader.read(chunk.get(), chunk_size);
+            if ( res.lapped ) {
+                std::cerr << "shm ring: the reader was lapped " << m_reader.lapped() << " times, resync" << std::endl;
+                pending.clear();
+                on_lapped_cb();
+
+                continue;
+            }
+            if ( !res.size ) {
+                m_reader.wait(std::chrono::milliseconds{100});
+
+                continue;
+            }
+
+            pending.append(chunk.get(), res.size);
+            const char *beg = pending.data();
+            const char *end = beg + pending.size();
+            for ( ;; ) {
+                const auto [pos, matched] = frame_match{}(beg, end);
+                if ( !matched ) {
+                    break;
+                }
+                on_frame(std::string_view{beg, static_cast<std::size_t>(pos - beg)});
+                beg = pos;
+            }
+            pending.erase(0, static_cast<std::size_t>(beg - pending.data()));
+        }
+    }
+    static void on_frame(std::string_view str) {
+        binary_frame frame;
+        if ( !parse_frame(str, frame) ) {
+            std::cerr << "shm ring: wrong frame received" << std::endl;
+
+            return;
+        }
+
+        switch ( frame.cmd ) {
+            case binary_cmd::data: {
+                std::string_view key, val;
+                if ( parse_data_payload(frame.payload, key, val) ) {
+                    std::cout << "shm ring: DATA " << key << " " << val << std::endl;
+                }
+                break;
+            }
+            case binary_cmd::dele: { std::cout << "shm ring: DELE " << frame.payload << std::endl; break; }
+            case binary_cmd::stop: { std::cout << "shm ring: STOP" << std::endl; break; }
+            default: break;
+        }
+    }
+
+private:
+    shm_ring_reader m_reader;
+    std::atomic_bool m_stop;
+    std::thread m_thread;
+};
+
+/**********************************************************************************************************************/
+
+// measures the time from sending the DATA by one connection till its broadcast is received by another one.
+// the updates are sent one at a time, each carries its send time as the value, so the queueing is not measured.
+// the first tenth of the updates warms the server and the connections up and is not accounted.
+// the reader can be connected to another server, e.g. to the replica at the end of the relays chain,
+// to measure the latency of the hops.
+
+void run_latency_bench(const tcp::endpoint &writer_ep, const tcp::endpoint &reader_ep, std::size_t updates) {
+    using clock = std::chrono::steady_clock;
+
+    ba::io_context ioctx;
+    tcp::socket writer{ioctx};
+    tcp::socket reader{ioctx};
+    writer.connect(writer_ep);
+    reader.connect(reader_ep);
+    writer.set_option(tcp::no_delay{true});
+    reader.set_option(tcp::no_delay{true});
+    // the reader must be subscribed before the first update
+    ba::write(reader, ba::buffer(std::string_view{"SUBS \n"}));
+    ba::write(reader, ba::buffer(std::string_view{"PING 0\n"}));
+
+    std::string buf;
+    auto read_line = [&reader, &buf]() {
+        buf.erase(0, buf.find('\n') + 1);
+        ba::read_until(reader, ba::dynamic_buffer(buf), '\n');
+
+        return std::string_view{buf.data(), buf.find('\n')};
+    };
+    buf = "\n";
+    while ( read_line() != "PING 0" )
+    {}
+
+    static constexpr std::string_view prefix = "DATA latency_bench ";
+    const auto warmup = updates / 10u;
+    std::vector<std::uint64_t> samples;
+    samples.reserve(updates);
+    for ( std::size_t idx = 0; idx < warmup + updates; ++idx ) {
+        const auto sent = static_cast<std::uint64_t>(clock::now().time_since_epoch().count());
+        const auto line = std::string{prefix} + std::to_string(sent) + "\n";
+        ba::write(writer, ba::buffer(line));
+
+        for ( ;; ) {
+            const auto view = read_line();
+            if ( view.substr(0, prefix.size()) != prefix ) {
+                continue;
+            }
+            std::uint64_t ts;
+            std::from_chars(view.data() + prefix.size(), view.data() + view.size(), ts);
+            if ( ts == sent ) {
+                break;
+            }
+        }
+
+        const auto now = static_cast<std::uint64_t>(clock::now().time_since_epoch().count());
+        if ( idx >= warmup ) {
+            samples.push_back(now - sent);
+        }
+    }
+
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&samples](double p) {
+        const auto idx = static_cast<std::size_t>(p * static_cast<double>(samples.size() - 1));
+
+        return std::chrono::duration_cast<std::chrono::microseconds>(clock::duration{samples[idx]}).count();
+    };
+    std::cout << "DATA-to-broadcast latency of " << samples.size() << " updates, us: "
+              << "p50=" << percentile(0.5)
+              << ", p99=" << percentile(0.99)
+              << ", p99.9=" << percentile(0.999)
+              << ", max=" << percentile(1.0)
+              << std::endl;
+}
+
+/**********************************************************************************************************************/
+// the in-process micro-benchmarks of the server's building blocks, selected by --micro_bench.
+// each one prints its results and exits.
+
+using bench_clock = std::chrono::steady_clock;
+
+// the millions of the operations per second
+inline double mops(std::size_t ops, bench_clock::duration elapsed) {
+    return static_cast<double>(ops) / std::chrono::duration<double, std::micro>(elapsed).count();
+}
+
+// pool: the memory_pool's acquire/release against the heap, 8 blocks per iteration, by `threads` threads at once.
+// each round starts the new threads, so the rounds after the first one run on the thread indices
+// given back by the previous round's threads.
+void run_pool_bench(std::size_t threads) {
+    static constexpr std::size_t iterations = 200000u;
+    static constexpr std::size_t blocks = 8u;
+    static constexpr std::size_t block_size = 256u;
+    static constexpr std::size_t rounds = 3u;
+
+    auto run = [threads](auto acquire, auto release) {
+        const auto start = bench_clock::now();
+        std::vector<std::thread> workers;
+        for ( std::size_t idx = 0; idx < threads; ++idx ) {
+            workers.emplace_back([&acquire, &release]() {
+                void *ptrs[blocks];
+                for ( std::size_t it = 0; it < iterations; ++it ) {
+                    for ( auto &p: ptrs ) { p = acquire(); }
+                    for ( auto *p: ptrs ) { release(p); }
+                }
+            });
+        }
+        for ( auto &it: workers ) {
+            it.join();
+        }
+
+        return mops(threads * iterations * blocks, bench_clock::now() - start);
+    };
+
+    memory_pool pool{block_size, 1024u};
+    for ( std::size_t round = 0; round < rounds; ++round ) {
+        const auto heap = run(
+             []() { return ::operator new(block_size); }
+            ,[](void *p) { ::operator delete(p); }
+        );
+        const auto pooled = run(
+             [&pool]() { return pool.acquire(); }
+            ,[&pool](void *p) { pool.release(p); }
+        );
+        std::cout << "pool, " << threads << " threads, round " << round
+                  << ": heap=" << heap << " Mops/s, memory_pool=" << pooled << " Mops/s" << std::endl;
+    }
+}
+
+// prealloc: the first-burst latency of a fresh memory_pool of 512-byte blocks with each of the prealloc modes,
+// the first `capacity` acquires timed one by one. run it first in the process to see the cold heap.
+void run_prealloc_bench() {
+    static constexpr std::size_t block_size = 512u;
+    static constexpr std::size_t capacity = 10240u;
+
+    const std::pair<const char *, prealloc_mode> modes[] = {
+         {"none", prealloc_mode::none}
+        ,{"slab", prealloc_mode::slab}
+        ,{"hugepages", prealloc_mode::hugepages}
+    };
+    for ( const auto &[name, mode]: modes ) {
+        auto start = bench_clock::now();
+        memory_pool pool{block_size, capacity, mode};
+        const auto ctor = bench_clock::now() - start;
+
+        std::vector<void *> ptrs(capacity);
+        std::vector<bench_clock::duration> times(capacity);
+        start = bench_clock::now();
+        for ( std::size_t idx = 0; idx < capacity; ++idx ) {
+            const auto t = bench_clock::now();
+            ptrs[idx] = pool.acquire();
+            times[idx] = bench_clock::now() - t;
+        }
+        const auto total = bench_clock::now() - start;
+        for ( auto *p: ptrs ) {
+            pool.release(p);
+        }
+
+        std::sort(times.begin(), times.end());
+        auto ns = [](bench_clock::duration d)
+        { return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count(); };
+        std::cout << "prealloc=" << name
+                  << ": total=" << ns(total) / 1000 << " us"
+                  << ", p99=" << ns(times[capacity * 99u / 100u]) << " ns"
+                  << ", max=" << ns(times.back()) << " ns"
+                  << ", ctor=" << ns(ctor) / 1000 << " us"
+                  << (mode == prealloc_mode::hugepages && !pool.hugepages() ? " (THP fallback)" : "")
+                  << std::endl;
+    }
+}
+
+// intrusive: the get+release cycle of a pooled object holding a std::string,
+// with the virtual deleter of intrusive_base against the compile-time policy of intrusive_static_base.
+struct bench_virtual_object: intrusive_base<bench_virtual_object> {
+    std::string str;
+};
+struct bench_static_object: intrusive_static_base<bench_static_object, object_pool_policy<bench_static_object>> {
+    std::string str;
+};
+
+void run_intrusive_bench() {
+    static constexpr std::size_t cycles = 5000000u;
+
+    auto run = [](auto &pool) {
+        const auto start = bench_clock::now();
+        for ( std::size_t idx = 0; idx < cycles; ++idx ) {
+            auto p = pool.get();
+            p->str.assign("key");
+        }
+
+        return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count() / cycles;
+    };
+
+    object_pool<bench_virtual_object> virt{1024u};
+    object_pool<bench_static_object> stat{1024u};
+    const auto virt_ns = run(virt);
+    const auto stat_ns = run(stat);
+    std::cout << "intrusive_base:        sizeof=" << sizeof(bench_virtual_object)
+              << ", get+release=" << virt_ns << " ns" << std::endl;
+    std::cout << "intrusive_static_base: sizeof=" << sizeof(bench_static_object)
+              << ", get+release=" << stat_ns << " ns" << std::endl;
+}
+
+// parse: the cost of splitting a stream of DATA messages with short keys into the keys and values,
+// the text lines against the binary frames, and the bytes each encoding takes on the wire.
+void run_parse_bench() {
+    static constexpr std::size_t messages = 200000u;
+    static constexpr std::size_t rounds = 5u;
+
+    buffers_pool pool{16u};
+    std::string text, binary;
+    for ( std::size_t idx = 0; idx < messages; ++idx ) {
+        const auto key = "key" + std::to_string(idx % 1000u);
+        const auto val = "value" + std::to_string(idx);
+        text.append(make_text_data(pool, key, val)->view());
+        binary.append(make_binary_data(pool, key, val)->view());
+    }
+
+    auto run = [](auto parse_one, const std::string &stream) {
+        double best = std::numeric_limits<double>::max();
+        for ( std::size_t round = 0; round < rounds; ++round ) {
+            std::size_t parsed = 0, sum = 0;
+            const auto start = bench_clock::now();
+            for ( const char *beg = stream.data(), *end = beg + stream.size(); beg != end; ++parsed ) {
+                std::string_view key, val;
+                beg = parse_one(beg, end, key, val);
+                sum += key.size() + val.size();
+            }
+            const auto ns = std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+            if ( parsed != messages || !sum ) {
+                throw std::runtime_error("the parse bench stream is malformed");
+            }
+            best = std::min(best, ns / messages);
+        }
+
+        return best;
+    };
+
+    const auto text_ns = run(
+        [](const char *beg, const char *end, std::string_view &key, std::string_view &val) {
+            const auto *nl = static_cast<const char *>(std::memchr(beg, '\n', static_cast<std::size_t>(end - beg)));
+            const std::string_view line{beg, static_cast<std::size_t>(nl - beg)};
+            if ( line.size() > command_name_size && line[command_name_size] == ' ' ) {
+                const auto args = line.substr(command_name_size + 1);
+                const auto pos = args.find(' ');
+                key = args.substr(0, pos);
+                val = args.substr(pos + 1);
+            }
+
+            return nl + 1;
+        }
+        ,text
+    );
+    const auto binary_ns = run(
+        [](const char *beg, const char *end, std::string_view &key, std::string_view &val) {
+            const auto *next = frame_match{}(beg, end).first;
+            binary_frame frame;
+            if ( parse_frame({beg, static_cast<std::size_t>(next - beg)}, frame) ) {
+                parse_data_payload(frame.payload, key, val);
+            }
+
+            return next;
+        }
+        ,binary
+    );
+
+    std::cout << "text:   " << text_ns << " ns/msg, "
+              << static_cast<double>(text.size()) / messages << " B/msg" << std::endl;
+    std::cout << "binary: " << binary_ns << " ns/msg, "
+              << static_cast<double>(binary.size()) / messages << " B/msg" << std::endl;
+}
+
+// dispatch: finding the handler of the text line by its command name, the fnv1a hash of the name and
+// a switch over the hashes of the known names against the command_registry's perfect hash.
+// the lines are a random mix of the server's commands, mostly DATA, and some unknown ones.
+using bench_handler = std::size_t(*)(std::string_view);
+
+template<std::size_t I>
+std::size_t bench_handle(std::string_view line) { return I + line.size(); }
+
+static constexpr command<bench_handler> bench_commands[] = {
+     {"PING", bench_handle<1>}
+    ,{"DATA", bench_handle<2>}
+    ,{"SUBS", bench_handle<3>}
+    ,{"USUB", bench_handle<4>}
+    ,{"BTCH", bench_handle<5>}
+    ,{"PROT", bench_handle<6>}
+    ,{"DELE", bench_handle<7>}
+    ,{"DACK", bench_handle<8>}
+    ,{"COMP", bench_handle<9>}
+};
+static constexpr command_registry bench_registry{bench_commands};
+
+void run_dispatch_bench() {
+    static constexpr std::size_t lines_n = 1000000u;
+    static constexpr std::size_t rounds = 5u;
+    static constexpr std::string_view names[] = {
+        "DATA", "DATA", "DATA", "DATA", "DACK", "DACK", "PING", "SUBS", "USUB", "DELE", "BTCH", "PROT", "COMP", "XXXX"
+    };
+
+    std::minstd_rand rnd{1u};
+    std::string stream;
+    for ( std::size_t idx = 0; idx < lines_n; ++idx ) {
+        stream.append(names[rnd() % std::size(names)]).append(" key").append(std::to_string(idx % 100u)).append(" val\n");
+    }
+    std::vector<std::string_view> lines;
+    lines.reserve(lines_n);
+    for ( std::size_t pos = 0; pos < stream.size(); ) {
+        const auto nl = stream.find('\n', pos);
+        lines.emplace_back(stream.data() + pos, nl + 1 - pos);
+        pos = nl + 1;
+    }
+
+    auto run = [&lines](auto find) {
+        double best = std::numeric_limits<double>::max();
+        std::size_t sum = 0;
+        for ( std::size_t round = 0; round < rounds; ++round ) {
+            const auto start = bench_clock::now();
+            for ( const auto &it: lines ) {
+                if ( auto handler = find(it); handler ) {
+                    sum += handler(it);
+                }
+            }
+            const auto ns = std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+            best = std::min(best, ns / static_cast<double>(lines.size()));
+        }
+
+        return std::make_pair(best, sum);
+    };
+
+    const auto [switch_ns, switch_sum] = run([](std::string_view line) -> bench_handler {
+        switch ( fnv1a(line.substr(0, command_name_size)) ) {
+            case fnv1a("PING"): return bench_handle<1>;
+            case fnv1a("DATA"): return bench_handle<2>;
+            case fnv1a("SUBS"): return bench_handle<3>;
+            case fnv1a("USUB"): return bench_handle<4>;
+            case fnv1a("BTCH"): return bench_handle<5>;
+            case fnv1a("PROT"): return bench_handle<6>;
+            case fnv1a("DELE"): return bench_handle<7>;
+            case fnv1a("DACK"): return bench_handle<8>;
+            case fnv1a("COMP"): return bench_handle<9>;
+            default: return nullptr;
+        }
+    });
+    const auto [registry_ns, registry_sum] = run([](std::string_view line)
+    { return bench_registry.find(line.data()); });
+    if ( switch_sum != registry_sum ) {
+        throw std::runtime_error("the dispatch bench's lookups disagree");
+    }
+
+    std::cout << "fnv1a + switch: " << switch_ns << " ns/line" << std::endl;
+    std::cout << "registry:       " << registry_ns << " ns/line" << std::endl;
+}
+
+/**********************************************************************************************************************/
+
 struct: cmdargs::kwords_group {
-    CMDARGS_OPTION_ADD(ip, std::string, "server IP", and_(port));
-    CMDARGS_OPTION_ADD(port, std::uint16_t, "server PORT", and_(ip));
+    CMDARGS_OPTION_ADD(ip, std::string, "server IP, required if `unix_path` is not specified"
+        ,optional, default_<std::string>(""));
+    CMDARGS_OPTION_ADD(port, std::uint16_t, "server PORT, required if `unix_path` is not specified"
+        ,optional, default_<std::uint16_t>(0u));
+    CMDARGS_OPTION_ADD(unix_path, std::string, "connect to the server's AF_UNIX socket instead of the IP and PORT"
+        ,optional, default_<std::string>(""));
+    CMDARGS_OPTION_ADD(shm_ring, std::string
+        ,"read the changes from the server's shared memory ring of this name instead of the connection"
+        ,optional, default_<std::string>(""));
     CMDARGS_OPTION_ADD(fname, std::string, "the state file name (not used if not specified)"
         ,optional, default_<std::string>("tablestate.txt"));
     CMDARGS_OPTION_ADD(ping, std::size_t, "ping interval in MS"
         ,optional, default_<std::size_t>(500));
+    CMDARGS_OPTION_ADD(binary, bool, "use the binary protocol"
+        ,optional, default_<bool>(false));
+    CMDARGS_OPTION_ADD(ack, bool, "request the acknowledgement of each update and measure its latency"
+        ,optional, default_<bool>(false));
+    CMDARGS_OPTION_ADD(compress, bool, "request the compression of the messages sent by the server"
+        ,optional, default_<bool>(false));
+    CMDARGS_OPTION_ADD(latency_bench, std::size_t
+        ,"measure the DATA-to-broadcast latency of this number of the updates over two connections, "
+         "print the percentiles and exit, or 0 to run interactively"
+        ,optional, default_<std::size_t>(0u));
+    CMDARGS_OPTION_ADD(bench_reader, std::string
+        ,"the `ip:port` of the server the latency bench's reader connects to, e.g. the replica, "
+         "or empty to read from the same server"
+        ,optional, default_<std::string>(""));
+    CMDARGS_OPTION_ADD(micro_bench, std::string
+        ,"run the in-process micro-benchmark and exit: `pool`, `prealloc`, `intrusive`, `parse`, `dispatch`, or empty to not run"
+        ,optional, default_<std::string>(""));
+    CMDARGS_OPTION_ADD(bench_threads, std::size_t, "the number of the threads the micro-benchmark runs on"
+        ,optional, default_<std::size_t>(1u));
 
     CMDARGS_OPTION_ADD_HELP();
     CMDARGS_OPTION_ADD_VERSION("0.0.1");
@@ -335,13 +1202,66 @@ int main(int argc, char **argv) try {
     }
     const auto ip    = args[kwords.ip];
     const auto port  = args[kwords.port];
+    const auto upath = args[kwords.unix_path];
+    const auto ring  = args[kwords.shm_ring];
     const auto fname = args[kwords.fname];
     const auto ping  = args[kwords.ping];
+    const auto binary= args[kwords.binary];
+    const auto ack   = args[kwords.ack];
+    const auto comp  = args[kwords.compress];
+    const auto bench = args[kwords.latency_bench];
+    const auto bench_reader = args[kwords.bench_reader];
+    const auto micro_bench  = args[kwords.micro_bench];
+    const auto bench_threads= args[kwords.bench_threads];
+
+    if ( !micro_bench.empty() ) {
+        if ( micro_bench == "pool" ) {
+            run_pool_bench(bench_threads);
+        } else if ( micro_bench == "prealloc" ) {
+            run_prealloc_bench();
+        } else if ( micro_bench == "intrusive" ) {
+            run_intrusive_bench();
+        } else if ( micro_bench == "parse" ) {
+            run_parse_bench();
+        } else if ( micro_bench == "dispatch" ) {
+            run_dispatch_bench();
+        } else {
+            std::cerr << "command line error: wrong micro_bench: " << micro_bench << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        return EXIT_SUCCESS;
+    }
+
+    // the latency bench connects by TCP only
+    if ( (ip.empty() || !port) && (upath.empty() || bench) ) {
+        std::cerr << "command line error: the ip and port must be specified" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if ( bench ) {
+        const tcp::endpoint writer_ep{ba::ip::make_address(ip), port};
+        auto reader_ep = writer_ep;
+        if ( !bench_reader.empty() ) {
+            const auto sep = bench_reader.rfind(':');
+            if ( sep == std::string::npos ) {
+                std::cerr << "command line error: wrong bench_reader: " << bench_reader << std::endl;
+                return EXIT_FAILURE;
+            }
+            reader_ep = tcp::endpoint{
+                 ba::ip::make_address(bench_reader.substr(0, sep))
+                ,static_cast<std::uint16_t>(std::stoul(bench_reader.substr(sep + 1)))
+            };
+        }
+        run_latency_bench(writer_ep, reader_ep, bench);
+
+        return EXIT_SUCCESS;
+    }
 
     // io_context + client
     ba::io_context ioctx;
     buffers_pool str_pool{1024};
-    client cli{ioctx, ip, port, str_pool, fname, ping};
+    client cli{ioctx, ip, port, upath, str_pool, fname, ping, binary, ack, comp, !ring.empty()};
     cli.start(
         [](const bs::error_code &ec) {
             if ( !ec ) {
@@ -352,6 +1272,12 @@ int main(int argc, char **argv) try {
         }
     );
 
+    std::unique_ptr<shm_subscriber> shm;
+    if ( !ring.empty() ) {
+        shm = std::make_unique<shm_subscriber>(ring);
+        shm->start([&ioctx, &cli]{ ba::post(ioctx, [&cli]{ cli.resync(); }); });
+    }
+
     // for reading `stdin` asynchronously
     term_reader term{ioctx, str_pool};
     term.start(
@@ -360,14 +1286,13 @@ int main(int argc, char **argv) try {
                 std::cout << "term: read error: " << ec.message() << std::endl;
                 cli.stop_ping();
             } else {
-                if ( str->string() == "q\n" || str->string() == "exit\n" ) {
+                if ( str->view() == "q\n" || str->view() == "exit\n" ) {
                     cli.stop();
 
                     return;
                 }
                 //std::cout << "term: str=" << *str;
-                str->preppend("DATA ");
-                cli.send(std::move(str));
+                cli.send_data(std::move(str));
             }
         }
     );
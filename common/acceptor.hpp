@@ -18,22 +18,64 @@
 
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <type_traits>
+#include <utility>
+
+#include <unistd.h>
 
 /**********************************************************************************************************************/
 
-struct acceptor {
-    acceptor(const acceptor &) = delete;
-    acceptor& operator= (const acceptor &) = delete;
-    acceptor(acceptor &&) = delete;
-    acceptor& operator= (acceptor &&) = delete;
+// the listener of the stream sockets of the `Protocol`, TCP or AF_UNIX.
+// the TCP sockets are accepted with TCP_NODELAY set.
+// the AF_UNIX socket's file left by the previous run is removed before binding,
+// and the own one is removed when the listener is stopped or destroyed, but not when it's released.
+// several accepts are kept outstanding, and each accepted socket is handed off to its own strand,
+// so the accept loop only re-arms the accept and never waits for the connection's setup.
+// the listening socket can be handed off to another process by the hot restart, see release() and adopt().
+// the accept failed for the lack of the descriptors or the memory is reported and re-armed after a delay,
+// the other errors end the accept.
+
+template<typename Protocol>
+struct basic_acceptor {
+    using socket_type = typename Protocol::socket;
+    using endpoint_type = typename Protocol::endpoint;
+
+    static constexpr std::chrono::milliseconds accept_retry_delay{100};
 
-    acceptor(ba::io_context &ioctx, const std::string &ip, std::uint16_t port)
-        :m_ioctx{ioctx}
+    basic_acceptor(const basic_acceptor &) = delete;
+    basic_acceptor& operator= (const basic_acceptor &) = delete;
+    basic_acceptor(basic_acceptor &&) = delete;
+    basic_acceptor& operator= (basic_acceptor &&) = delete;
+
+    basic_acceptor(ba::io_context &ioctx, endpoint_type endpoint, std::size_t pending_accepts = 1u)
+        :basic_acceptor{ioctx, ioctx, std::move(endpoint), pending_accepts}
+    {}
+    // the accept loop runs on `ioctx`, and the accepted sockets are bound to `sockets_ioctx`
+    basic_acceptor(
+         ba::io_context &ioctx
+        ,ba::io_context &sockets_ioctx
+        ,endpoint_type endpoint
+        ,std::size_t pending_accepts = 1u)
+        :m_sockets_ioctx{sockets_ioctx}
         ,m_acc{ba::make_strand(ioctx)}
-        ,m_endpoint{ba::ip::make_address(ip), port}
+        ,m_endpoint{std::move(endpoint)}
+        ,m_pending_accepts{std::max<std::size_t>(pending_accepts, 1u)}
+        ,m_adopted{-1}
+        ,m_owns_path{false}
+        ,m_retry_timer{m_acc.get_executor()}
+        ,m_retry_waits{}
     {}
+    ~basic_acceptor() {
+        remove_path();
+    }
 
-    // OnAcceptedCB's signature: void(tcp::socket)
+    // OnAcceptedCB's signature: void(socket_type)
+    // called on the accepted socket's strand, the callbacks are copied for each outstanding accept
     // ErrorCB's signature: void(error_handler_info)
     template<typename OnAcceptedCB, typename ErrorCB>
     void start(OnAcceptedCB on_accepted_cb, ErrorCB error_cb) {
@@ -45,66 +87,191 @@ struct acceptor {
         );
     }
 
-    auto stop() {
-        return ba::post(
-             m_acc.get_executor()
-            ,ba::use_future([this]() {
-                bs::error_code ec;
-                m_acc.close(ec);
-            })
+    // CompletionToken's signature: void()
+    template<typename CompletionToken>
+    auto stop(CompletionToken &&token) {
+        return ba::async_initiate<CompletionToken, void()>(
+             [this](auto handler) {
+                ba::post(
+                     m_acc.get_executor()
+                    ,[this, handler=std::move(handler)]
+                     () mutable
+                     {
+                        bs::error_code ec;
+                        m_acc.close(ec);
+                        m_retry_timer.cancel(ec);
+                        remove_path();
+                        complete_handler(m_acc.get_executor(), std::move(handler));
+                     }
+                );
+             }
+            ,token
         );
     }
-    auto is_open() {
-        return ba::post(
-             m_acc.get_executor()
-            ,ba::use_future([this](){
-                return m_acc.is_open();
-            })
+    // stops the accept loop and closes the listening socket, but completes with the duplicate of its descriptor,
+    // or -1 if it's not open, so the connections not accepted yet stay in the backlog of the duplicate.
+    // CompletionToken's signature: void(int)
+    template<typename CompletionToken>
+    auto release(CompletionToken &&token) {
+        return ba::async_initiate<CompletionToken, void(int)>(
+             [this](auto handler) {
+                ba::post(
+                     m_acc.get_executor()
+                    ,[this, handler=std::move(handler)]
+                     () mutable
+                     {
+                        const int fd = m_acc.is_open() ? ::dup(m_acc.native_handle()) : -1;
+                        bs::error_code ec;
+                        m_acc.close(ec);
+                        m_retry_timer.cancel(ec);
+                        // the file is used by the process the listener is released to
+                        m_owns_path = false;
+                        complete_handler(m_acc.get_executor(), std::move(handler), fd);
+                     }
+                );
+             }
+            ,token
+        );
+    }
+    // must be called before start(): the listening socket released by another process is taken over
+    // by the next start() instead of binding the endpoint
+    void adopt(int fd) noexcept { m_adopted = fd; }
+
+    // CompletionToken's signature: void(bool)
+    template<typename CompletionToken>
+    auto is_open(CompletionToken &&token) {
+        return ba::async_initiate<CompletionToken, void(bool)>(
+             [this](auto handler) {
+                ba::post(
+                     m_acc.get_executor()
+                    ,[this, handler=std::move(handler)]
+                     () mutable
+                     { complete_handler(m_acc.get_executor(), std::move(handler), m_acc.is_open()); }
+                );
+             }
+            ,token
         );
     }
 
 private:
     template<typename OnAcceptedCB, typename ErrorCB>
     void start_impl(OnAcceptedCB on_accepted_cb, ErrorCB error_cb) {
-        m_acc.open(m_endpoint.protocol());
-        m_acc.set_option(tcp::acceptor::reuse_address{true});
-        m_acc.bind(m_endpoint);
-        m_acc.listen();
+        if ( m_adopted != -1 ) {
+            m_acc.assign(m_endpoint.protocol(), std::exchange(m_adopted, -1));
+        } else {
+            m_acc.open(m_endpoint.protocol());
+            if constexpr ( is_local ) {
+                ::unlink(m_endpoint.path().c_str());
+            } else {
+                m_acc.set_option(typename Protocol::acceptor::reuse_address{true});
+            }
+            m_acc.bind(m_endpoint);
+            m_acc.listen();
+        }
+        m_owns_path = is_local;
 
+        for ( std::size_t idx = 1; idx < m_pending_accepts; ++idx ) {
+            start_accept(on_accepted_cb, error_cb);
+        }
         start_accept(std::move(on_accepted_cb), std::move(error_cb));
     }
+    static bool is_retryable(const bs::error_code &ec) noexcept {
+        return ec == bs::errc::too_many_files_open
+            || ec == bs::errc::too_many_files_open_in_system
+            || ec == bs::errc::no_buffer_space
+            || ec == bs::errc::not_enough_memory
+        ;
+    }
+    // all the accepts failed meanwhile wait for the same expiration
+    template<typename OnAcceptedCB, typename ErrorCB>
+    void retry_accept(OnAcceptedCB on_accepted_cb, ErrorCB error_cb) {
+        if ( m_retry_waits++ == 0 ) {
+            m_retry_timer.expires_after(accept_retry_delay);
+        }
+        m_retry_timer.async_wait(
+            [this, on_accepted_cb=std::move(on_accepted_cb), error_cb=std::move(error_cb)]
+            (const bs::error_code &ec) mutable
+            {
+                --m_retry_waits;
+                if ( !ec && m_acc.is_open() ) {
+                    start_accept(std::move(on_accepted_cb), std::move(error_cb));
+                }
+            }
+        );
+    }
+
+    void remove_path() noexcept {
+        if constexpr ( is_local ) {
+            if ( std::exchange(m_owns_path, false) ) {
+                ::unlink(m_endpoint.path().c_str());
+            }
+        }
+    }
+
     template<typename OnAcceptedCB, typename ErrorCB>
     void start_accept(OnAcceptedCB on_accepted_cb, ErrorCB error_cb) {
         m_acc.async_accept(
-             ba::make_strand(m_ioctx)
+             ba::make_strand(m_sockets_ioctx)
             ,[this, on_accepted_cb=std::move(on_accepted_cb), error_cb=std::move(error_cb)]
-             (const bs::error_code &ec, tcp::socket sock) mutable
+             (const bs::error_code &ec, socket_type sock) mutable
              { on_accepted(std::move(on_accepted_cb), std::move(error_cb), ec, std::move(sock)); }
         );
     }
     template<typename OnAcceptedCB, typename ErrorCB>
-    void on_accepted(OnAcceptedCB on_accepted_cb, ErrorCB error_cb, const bs::error_code &ec, tcp::socket sock) {
+    void on_accepted(OnAcceptedCB on_accepted_cb, ErrorCB error_cb, const bs::error_code &ec, socket_type sock) {
         if ( ec ) {
             if ( ec == ba::error::operation_aborted ) {
                 return;
             }
+            // the client has gone before it was accepted, which is usual for the connection storms
+            if ( ec == ba::error::connection_aborted ) {
+                return start_accept(std::move(on_accepted_cb), std::move(error_cb));
+            }
 
             CALL_ERROR_HANDLER(error_cb, MAKE_ERROR_INFO("acceptor", ec));
+            if ( is_retryable(ec) ) {
+                retry_accept(std::move(on_accepted_cb), std::move(error_cb));
+            }
 
             return;
         }
 
-        on_accepted_cb(std::move(sock));
+        auto executor = sock.get_executor();
+        ba::post(
+             executor
+            ,[on_accepted_cb, sock=std::move(sock)]
+             () mutable
+             {
+                if constexpr ( !is_local ) {
+                    bs::error_code ec;
+                    sock.set_option(tcp::no_delay{true}, ec);
+                }
+                on_accepted_cb(std::move(sock));
+             }
+        );
 
         start_accept(std::move(on_accepted_cb), std::move(error_cb));
     }
 
 private:
-    ba::io_context &m_ioctx;
-    tcp::acceptor m_acc;
-    const tcp::endpoint m_endpoint;
+    static constexpr bool is_local = std::is_same_v<Protocol, ba::local::stream_protocol>;
+
+    ba::io_context &m_sockets_ioctx;
+    typename Protocol::acceptor m_acc;
+    const endpoint_type m_endpoint;
+    const std::size_t m_pending_accepts;
+    // the descriptor taken over by the next start(), -1 if none
+    int m_adopted;
+    // the AF_UNIX socket's file is listened on by this acceptor
+    bool m_owns_path;
+    // re-arms the accepts failed for the lack of the resources
+    ba::steady_timer m_retry_timer;
+    std::size_t m_retry_waits;
 };
 
+using acceptor = basic_acceptor<tcp>;
+using local_acceptor = basic_acceptor<ba::local::stream_protocol>;
+
 /**********************************************************************************************************************/
 
 #endif // __shared_state_server__acceptor_hpp__included
@@ -0,0 +1,217 @@
+
+// ----------------------------------------------------------------------------
+//                              Apache License
+//                        Version 2.0, January 2004
+//                     http://www.apache.org/licenses/
+//
+// This file is part of shared-state-server(https://github.com/niXman/shared-state-server) project.
+//
+// This was a test task for implementing multithreaded Shared-State server using asio.
+//
+// Copyright (c) 2023 niXman (github dot nixman dog pm.me). All rights reserved.
+// ----------------------------------------------------------------------------
+
+#ifndef __shared_state_server__admission_hpp__included
+#define __shared_state_server__admission_hpp__included
+
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+/**********************************************************************************************************************/
+
+// the limits of the load the server accepts, any of them is disabled by 0:
+// - the number of the connections, the excess connections are rejected;
+// - the number of the new connections per second, the excess connections are rejected;
+// - the number of the concurrent syncs, the excess syncs wait for the free slot in FIFO order.
+// the rejected connections are told when to retry, so the server keeps serving the existing sessions
+// instead of the reconnect storms.
+// all the functions may be called from any thread.
+
+struct admission_control final {
+    // the sync's slot, released when the last copy of the permit is destroyed.
+    // the permit is empty if the syncs are not limited
+    using sync_permit = std::shared_ptr<void>;
+
+    admission_control(const admission_control &) = delete;
+    admission_control& operator= (const admission_control &) = delete;
+    admission_control(admission_control &&) = delete;
+    admission_control& operator= (admission_control &&) = delete;
+
+    admission_control(
+         metrics &mtr
+        ,std::size_t max_connections
+        ,std::size_t max_accept_rate
+        ,std::size_t max_syncs
+        ,std::size_t retry_after)
+        :m_metrics{mtr}
+        ,m_max_connections{max_connections}
+        ,m_max_accept_rate{max_accept_rate}
+        ,m_max_syncs{max_syncs}
+        ,m_retry_after{retry_after}
+        ,m_admitting{}
+        ,m_window{}
+        ,m_window_accepted{}
+        ,m_mutex{}
+        ,m_syncs{}
+        ,m_waiters{}
+        ,m_waiting{}
+    {}
+
+    // called for each accepted connection before its session is created.
+    // returns 0 if the connection is admitted, otherwise the time in MS after which the client should retry.
+    // the admitted connection holds the reserved slot until `admitted()` is called after its session is created
+    // and counted by the metrics, so the connections admitted concurrently can't exceed the limit together.
+    std::size_t admit() noexcept {
+        if ( m_max_connections ) {
+            // pairs with the release in `admitted()`, so the connection not reserved anymore is counted already
+            const auto reserved = m_admitting.fetch_add(1u, std::memory_order_acq_rel) + 1u;
+            if ( m_metrics.get(counter::connections_opened, counter::connections_closed) + reserved > m_max_connections ) {
+                m_admitting.fetch_sub(1u, std::memory_order_relaxed);
+
+                return reject();
+            }
+        }
+
+        if ( m_max_accept_rate ) {
+            using namespace std::chrono;
+            const auto now = static_cast<std::uint64_t>(
+                duration_cast<seconds>(steady_clock::now().time_since_epoch()).count());
+            auto window = m_window.load(std::memory_order_relaxed);
+            if ( window != now && m_window.compare_exchange_strong(window, now, std::memory_order_relaxed) ) {
+                m_window_accepted.store(0u, std::memory_order_relaxed);
+            }
+            if ( m_window_accepted.fetch_add(1u, std::memory_order_relaxed) >= m_max_accept_rate ) {
+                if ( m_max_connections ) {
+                    m_admitting.fetch_sub(1u, std::memory_order_relaxed);
+                }
+
+                return reject();
+            }
+        }
+
+        return 0u;
+    }
+    // must be called once for each connection admitted by `admit()`, after its session is created
+    void admitted() noexcept {
+        if ( m_max_connections ) {
+            m_admitting.fetch_sub(1u, std::memory_order_release);
+        }
+    }
+
+    // returns true and the permit in `permit` if the sync can be started now.
+    // the syncs waiting for the slot are not overtaken
+    bool try_acquire_sync(sync_permit &permit) {
+        if ( !m_max_syncs ) {
+            return true;
+        }
+
+        std::lock_guard<std::mutex> lock{m_mutex};
+        if ( !m_waiters.empty() || m_syncs == m_max_syncs ) {
+            return false;
+        }
+
+        ++m_syncs;
+        permit = make_permit();
+
+        return true;
+    }
+
+    // CB's signature: void(sync_permit)
+    // called once, from any thread, when the slot is free.
+    template<typename CB>
+    void wait_sync(CB cb) {
+        sync_permit permit;
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            if ( m_max_syncs && (!m_waiters.empty() || m_syncs == m_max_syncs) ) {
+                m_waiters.push_back(std::move(cb));
+                m_waiting.store(m_waiters.size(), std::memory_order_relaxed);
+
+                return;
+            }
+            if ( m_max_syncs ) {
+                ++m_syncs;
+                permit = make_permit();
+            }
+        }
+
+        cb(std::move(permit));
+    }
+
+    // the window in MS the reconnects of all the current connections should be spread over
+    // to not exceed the accept rate, but not shorter than `min_window`
+    std::size_t reconnect_window(std::size_t min_window) const noexcept {
+        if ( !m_max_accept_rate ) {
+            return min_window;
+        }
+
+        const auto connections = m_metrics.get(counter::connections_opened, counter::connections_closed);
+
+        return std::max<std::size_t>(min_window, connections * 1000u / m_max_accept_rate);
+    }
+
+    // the number of the syncs waiting for the slot
+    std::size_t waiting_syncs() const noexcept { return m_waiting.load(std::memory_order_relaxed); }
+
+private:
+    std::size_t reject() noexcept {
+        m_metrics.add(counter::connections_rejected);
+
+        return m_retry_after;
+    }
+
+    sync_permit make_permit() {
+        return sync_permit{this, [](void *p){ static_cast<admission_control *>(p)->release_sync(); }};
+    }
+
+    // the released slot is passed to the first waiter, if any
+    void release_sync() {
+        std::function<void(sync_permit)> waiter;
+        sync_permit permit;
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            if ( m_waiters.empty() ) {
+                --m_syncs;
+
+                return;
+            }
+
+            waiter = std::move(m_waiters.front());
+            m_waiters.pop_front();
+            m_waiting.store(m_waiters.size(), std::memory_order_relaxed);
+            permit = make_permit();
+        }
+
+        waiter(std::move(permit));
+    }
+
+private:
+    metrics &m_metrics;
+    const std::size_t m_max_connections;
+    const std::size_t m_max_accept_rate;
+    const std::size_t m_max_syncs;
+    const std::size_t m_retry_after;
+    // the connections admitted, but not counted by the metrics yet
+    std::atomic_size_t m_admitting;
+    // the second the connections are counted for the rate limit
+    std::atomic_uint64_t m_window;
+    std::atomic_size_t m_window_accepted;
+    std::mutex m_mutex;
+    std::size_t m_syncs;
+    std::deque<std::function<void(sync_permit)>> m_waiters;
+    // the copy of the waiters' number, read without the lock
+    std::atomic_size_t m_waiting;
+};
+
+/**********************************************************************************************************************/
+
+#endif // __shared_state_server__admission_hpp__included
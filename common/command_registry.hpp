@@ -0,0 +1,117 @@
+
+// ----------------------------------------------------------------------------
+//                              Apache License
+//                        Version 2.0, January 2004
+//                     http://www.apache.org/licenses/
+//
+// This file is part of shared-state-server(https://github.com/niXman/shared-state-server) project.
+//
+// This was a test task for implementing multithreaded Shared-State server using asio.
+//
+// Copyright (c) 2023 niXman (github dot nixman dog pm.me). All rights reserved.
+// ----------------------------------------------------------------------------
+
+#ifndef __shared_state_server__command_registry_hpp__included
+#define __shared_state_server__command_registry_hpp__included
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/**********************************************************************************************************************/
+
+static constexpr std::size_t command_name_size = 4u;
+
+// the command's name packed into the integer in the memory order of the little-endian platforms,
+// so when called for the received chars, the compiler folds it into a single 4-byte load
+constexpr std::uint32_t command_code(const char *p) noexcept {
+    return (std::uint32_t)(std::uint8_t)p[0]
+        | ((std::uint32_t)(std::uint8_t)p[1] << 8)
+        | ((std::uint32_t)(std::uint8_t)p[2] << 16)
+        | ((std::uint32_t)(std::uint8_t)p[3] << 24);
+}
+
+template<typename Handler>
+struct command {
+    std::string_view name;
+    Handler handler;
+};
+
+/**********************************************************************************************************************/
+
+// the perfect hash table of the 4-char commands built at compile time.
+// the multiplier is searched so that each command gets its own slot,
+// so the lookup is a multiplication, a shift, and one load-and-compare of the slot's code.
+// the registry which can't be built fails the compilation.
+
+template<typename Handler, std::size_t N>
+struct command_registry {
+    constexpr explicit command_registry(const command<Handler> (&cmds)[N])
+        :m_mult{}
+        ,m_slots{}
+    {
+        for ( std::size_t idx = 0; idx < N; ++idx ) {
+            if ( cmds[idx].name.size() != command_name_size ) {
+                throw "the command's name must be 4 chars long";
+            }
+        }
+
+        for ( std::uint32_t mult = 0x9e3779b1u, left = 1u << 16; left; mult += 2u, --left ) {
+            slot slots[size]{};
+            bool collision = false;
+            for ( std::size_t idx = 0; idx < N && !collision; ++idx ) {
+                const auto code = command_code(cmds[idx].name.data());
+                auto &sl = slots[slot_index(code, mult)];
+                // the pointers are not compared in the constant expression, which the sanitizers reject
+                collision = sl.used;
+                sl = slot{code, cmds[idx].handler, true};
+            }
+            if ( !collision ) {
+                m_mult = mult;
+                for ( std::size_t idx = 0; idx < size; ++idx ) {
+                    m_slots[idx] = slots[idx];
+                }
+
+                return;
+            }
+        }
+
+        throw "can't build the perfect hash for the commands";
+    }
+
+    // `p` must point to at least 4 chars.
+    // returns the null handler if the command is not registered
+    constexpr Handler find(const char *p) const noexcept {
+        const auto code = command_code(p);
+        const auto &sl = m_slots[slot_index(code, m_mult)];
+
+        return sl.code == code ? sl.handler : Handler{};
+    }
+
+private:
+    struct slot {
+        std::uint32_t code;
+        Handler handler;
+        bool used;
+    };
+
+    // the number of the slots is the power of two, at least twice as much as the commands
+    static constexpr std::size_t bits = [] {
+        std::size_t res = 1;
+        for ( ; (std::size_t{1} << res) < N * 2; ++res )
+        {}
+        return res;
+    }();
+    static constexpr std::size_t size = std::size_t{1} << bits;
+
+    static constexpr std::size_t slot_index(std::uint32_t code, std::uint32_t mult) noexcept
+    { return static_cast<std::uint32_t>(code * mult) >> (32u - bits); }
+
+private:
+    std::uint32_t m_mult;
+    slot m_slots[size];
+};
+
+/**********************************************************************************************************************/
+
+#endif // __shared_state_server__command_registry_hpp__included
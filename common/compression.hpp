@@ -0,0 +1,105 @@
+
+// ----------------------------------------------------------------------------
+//                              Apache License
+//                        Version 2.0, January 2004
+//                     http://www.apache.org/licenses/
+//
+// This file is part of shared-state-server(https://github.com/niXman/shared-state-server) project.
+//
+// This was a test task for implementing multithreaded Shared-State server using asio.
+//
+// Copyright (c) 2023 niXman (github dot nixman dog pm.me). All rights reserved.
+// ----------------------------------------------------------------------------
+
+#ifndef __shared_state_server__compression_hpp__included
+#define __shared_state_server__compression_hpp__included
+
+#include "string_buffer.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string_view>
+
+#include <zlib.h>
+
+/**********************************************************************************************************************/
+
+// the server-to-client direction can be compressed with the raw deflate stream (RFC 1951).
+// each write is flushed with Z_SYNC_FLUSH, so it can be inflated as soon as it's received,
+// and the stream keeps the history between the writes for the better ratio.
+// the stream is never finished, so there are no header and trailer.
+
+static constexpr int deflate_window_bits = -15;
+
+struct deflate_stream {
+    deflate_stream(const deflate_stream &) = delete;
+    deflate_stream& operator= (const deflate_stream &) = delete;
+
+    explicit deflate_stream(int level)
+        :m_zs{}
+    {
+        if ( ::deflateInit2(&m_zs, level, Z_DEFLATED, deflate_window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK ) {
+            throw std::runtime_error{"deflateInit2() error"};
+        }
+    }
+    ~deflate_stream()
+    { ::deflateEnd(&m_zs); }
+
+    // appends the compressed bytes to `out`.
+    // the bytes are flushed if `flush`, otherwise some of them may be kept till the next call
+    void compress(std::string_view in, string_buffer &out, bool flush) {
+        m_zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+        m_zs.avail_in = static_cast<uInt>(in.size());
+        do {
+            const auto avail = std::max<std::size_t>(out.capacity() - out.size(), 64u);
+            m_zs.next_out = reinterpret_cast<Bytef *>(out.prepare(avail));
+            m_zs.avail_out = static_cast<uInt>(avail);
+            ::deflate(&m_zs, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+            out.commit(avail - m_zs.avail_out);
+        } while ( m_zs.avail_out == 0 );
+    }
+
+private:
+    z_stream m_zs;
+};
+
+struct inflate_stream {
+    inflate_stream(const inflate_stream &) = delete;
+    inflate_stream& operator= (const inflate_stream &) = delete;
+
+    inflate_stream()
+        :m_zs{}
+    {
+        if ( ::inflateInit2(&m_zs, deflate_window_bits) != Z_OK ) {
+            throw std::runtime_error{"inflateInit2() error"};
+        }
+    }
+    ~inflate_stream()
+    { ::inflateEnd(&m_zs); }
+
+    // appends the inflated bytes to `out`.
+    // returns false if the stream is corrupted
+    bool decompress(std::string_view in, string_buffer &out) {
+        m_zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+        m_zs.avail_in = static_cast<uInt>(in.size());
+        do {
+            const auto avail = std::max<std::size_t>(in.size() * 4u, 4096u);
+            m_zs.next_out = reinterpret_cast<Bytef *>(out.prepare(avail));
+            m_zs.avail_out = static_cast<uInt>(avail);
+            const auto res = ::inflate(&m_zs, Z_SYNC_FLUSH);
+            if ( res != Z_OK && res != Z_BUF_ERROR ) {
+                return false;
+            }
+            out.commit(avail - m_zs.avail_out);
+        } while ( m_zs.avail_out == 0 );
+
+        return true;
+    }
+
+private:
+    z_stream m_zs;
+};
+
+/**********************************************************************************************************************/
+
+#endif // __shared_state_server__compression_hpp__included
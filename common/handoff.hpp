@@ -0,0 +1,492 @@
+
+// ----------------------------------------------------------------------------
+//                              Apache License
+//                        Version 2.0, January 2004
+//                     http://www.apache.org/licenses/
+//
+// This file is part of shared-state-server(https://github.com/niXman/shared-state-server) project.
+//
+// This was a test task for implementing multithreaded Shared-State server using asio.
+//
+// Copyright (c) 2023 niXman (github dot nixman dog pm.me). All rights reserved.
+// ----------------------------------------------------------------------------
+
+#ifndef __shared_state_server__handoff_hpp__included
+#define __shared_state_server__handoff_hpp__included
+
+#include "utils.hpp"
+#include "protocol.hpp"
+#include "session.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/strand.hpp>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**********************************************************************************************************************/
+
+// the hot restart: the new process connects to the old one over the AF_UNIX socket and takes over
+// the listening sockets, the state and the live connections, so the clients see a pause instead of
+// the reconnect and the resync. the old process stops accepting, pauses the sessions, takes the snapshot
+// of the state when its last changes are broadcasted, and detaches the sessions when their queued
+// messages are written, see session::detach(). then it sends everything, and exits when the new process
+// confirms it took over. if the new process has gone before, the old one takes its listeners back
+// and keeps serving, the detached sessions are told to reconnect.
+// the descriptors are passed with SCM_RIGHTS, one per frame, attached to the frame's first byte.
+// the frames have the binary protocol's framing, but the commands of their own:
+//   LSTN: varint(listener kind), the listening socket's descriptor is attached
+//   STAT: varint(seq) varint(epoch) varint(horizon) frames, see state_storage::snapshot()
+//   REPL: varint(since) varint(epoch), the replica's resume point, see replica_client::stop()
+//   RING: the shared memory ring's name, its descriptor is attached, the position is kept by the ring itself
+//   SESS: varint(read protocol) varint(write protocol) varint(replica) varint(readed) varint(batched)
+//         varint(number of prefixes) (varint(size of prefix) prefix)... unread bytes,
+//         the connection's descriptor is attached
+//   DONE: empty, the last frame
+//   ACKN: empty, sent back by the new process when it took over everything, see confirm_handoff()
+// the channel is blocking: the old process has nothing else to serve at that point,
+// and the new one doesn't serve anything until it took over.
+
+enum class handoff_cmd: std::uint8_t {
+     lstn = 1
+    ,stat
+    ,repl
+    ,sess
+    ,done
+    ,ring
+    ,ackn
+};
+
+enum class handoff_listener: std::uint8_t {
+     tcp
+    ,local
+    ,metrics
+};
+
+// everything the old process hands off, the descriptors are -1 if not handed off
+struct handoff_state {
+    int tcp_fd = -1;
+    int local_fd = -1;
+    int metrics_fd = -1;
+    std::string frames;
+    std::uint64_t seq = 0u;
+    std::uint64_t epoch = 0u;
+    std::uint64_t horizon = 0u;
+    // the replica's resume point, if the old process is a replica
+    bool replica = false;
+    std::uint64_t repl_since = 0u;
+    std::uint64_t repl_epoch = 0u;
+    // the shared memory ring, if the old process publishes to it
+    int ring_fd = -1;
+    std::string ring_name;
+    std::vector<detached_session> sessions;
+    // the new process's connection to the old one, the takeover is confirmed over it
+    int channel_fd = -1;
+};
+
+/**********************************************************************************************************************/
+
+namespace details {
+
+inline std::runtime_error handoff_error(const char *what) {
+    return std::runtime_error{std::string{"handoff: "} + what + " error: " + std::strerror(errno)};
+}
+
+inline void append_varint(std::string &out, std::uint64_t v) {
+    char buf[max_varint_size];
+    out.append(buf, static_cast<std::size_t>(encode_varint(buf, v) - buf));
+}
+
+inline bool take_varint(std::string_view &in, std::uint64_t &v) noexcept {
+    const auto len = decode_varint(in.begin(), in.end(), v);
+    if ( len == 0 || len > max_varint_size ) {
+        return false;
+    }
+    in.remove_prefix(len);
+
+    return true;
+}
+
+} // ns details
+
+// the framing over the connected AF_UNIX socket, doesn't own the socket.
+// the received descriptors not taken are closed by the destructor
+struct handoff_channel {
+    // the max number of the descriptors received at once
+    static constexpr std::size_t max_fds = 16u;
+
+    handoff_channel(const handoff_channel &) = delete;
+    handoff_channel& operator= (const handoff_channel &) = delete;
+
+    explicit handoff_channel(int fd)
+        :m_fd{fd}
+        ,m_rbuf{}
+        ,m_fds{}
+    {
+        const int flags = ::fcntl(m_fd, F_GETFL);
+        if ( flags == -1 || ::fcntl(m_fd, F_SETFL, flags & ~O_NONBLOCK) == -1 ) {
+            throw details::handoff_error("fcntl");
+        }
+    }
+    ~handoff_channel() {
+        for ( auto fd: m_fds ) {
+            ::close(fd);
+        }
+    }
+
+    // the descriptor is sent if it's not -1
+    void send(handoff_cmd cmd, std::string_view payload, int fd = -1) {
+        std::string frame;
+        details::append_varint(frame, 1u + payload.size());
+        frame.push_back(static_cast<char>(cmd));
+        frame.append(payload);
+
+        std::string_view rest{frame};
+        while ( !rest.empty() ) {
+            iovec iov{const_cast<char *>(rest.data()), rest.size()};
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            if ( fd != -1 ) {
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+                auto *cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+                std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+            }
+
+            const auto wr = ::sendmsg(m_fd, &msg, MSG_NOSIGNAL);
+            if ( wr == -1 ) {
+                if ( errno == EINTR ) { continue; }
+
+                throw details::handoff_error("sendmsg");
+            }
+            // the descriptor is attached to the first chunk only
+            fd = -1;
+            rest.remove_prefix(static_cast<std::size_t>(wr));
+        }
+    }
+
+    // returns false if the peer has closed the connection between the frames
+    bool recv(handoff_cmd &cmd, std::string &payload) {
+        for ( ;; ) {
+            const auto [end, matched] = frame_match{}(m_rbuf.cbegin(), m_rbuf.cend());
+            if ( matched ) {
+                const auto size = static_cast<std::size_t>(end - m_rbuf.cbegin());
+                binary_frame frame;
+                if ( !parse_frame(std::string_view{m_rbuf}.substr(0, size), frame) ) {
+                    throw std::runtime_error{"handoff: wrong frame received"};
+                }
+                cmd = static_cast<handoff_cmd>(frame.cmd);
+                payload.assign(frame.payload);
+                m_rbuf.erase(0, size);
+
+                return true;
+            }
+
+            if ( read_some() == 0 ) {
+                if ( !m_rbuf.empty() ) {
+                    throw std::runtime_error{"handoff: the connection is closed in the middle of the frame"};
+                }
+
+                return false;
+            }
+        }
+    }
+
+    // the descriptor attached to the latest received frame carrying one, in the order they were sent
+    int take_fd() {
+        if ( m_fds.empty() ) {
+            throw std::runtime_error{"handoff: no descriptor received"};
+        }
+
+        const int fd = m_fds.front();
+        m_fds.pop_front();
+
+        return fd;
+    }
+
+private:
+    std::size_t read_some() {
+        char buf[64u * 1024u];
+        iovec iov{buf, sizeof(buf)};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * max_fds)];
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t rd;
+        do {
+            rd = ::recvmsg(m_fd, &msg, MSG_CMSG_CLOEXEC);
+        } while ( rd == -1 && errno == EINTR );
+        if ( rd == -1 ) {
+            throw details::handoff_error("recvmsg");
+        }
+
+        for ( auto *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg) ) {
+            if ( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS ) {
+                const auto n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for ( std::size_t idx = 0; idx < n; ++idx ) {
+                    int fd;
+                    std::memcpy(&fd, CMSG_DATA(cmsg) + idx * sizeof(int), sizeof(int));
+                    m_fds.push_back(fd);
+                }
+            }
+        }
+        if ( msg.msg_flags & MSG_CTRUNC ) {
+            throw std::runtime_error{"handoff: too many descriptors received at once"};
+        }
+
+        m_rbuf.append(buf, static_cast<std::size_t>(rd));
+
+        return static_cast<std::size_t>(rd);
+    }
+
+private:
+    const int m_fd;
+    std::string m_rbuf;
+    std::deque<int> m_fds;
+};
+
+/**********************************************************************************************************************/
+
+// sends the state over the connected AF_UNIX socket and waits for the new process to confirm it took over.
+// returns false if the new process has gone before. the sent descriptors are kept, so they can be taken back,
+// and must be closed by close_handoff() after the confirmation
+inline bool send_handoff(int fd, const handoff_state &state) {
+    handoff_channel channel{fd};
+    auto send_listener = [&channel](handoff_listener kind, int fd) {
+        if ( fd != -1 ) {
+            std::string payload;
+            details::append_varint(payload, static_cast<std::uint64_t>(kind));
+            channel.send(handoff_cmd::lstn, payload, fd);
+        }
+    };
+    send_listener(handoff_listener::tcp, state.tcp_fd);
+    send_listener(handoff_listener::local, state.local_fd);
+    send_listener(handoff_listener::metrics, state.metrics_fd);
+
+    std::string payload;
+    details::append_varint(payload, state.seq);
+    details::append_varint(payload, state.epoch);
+    details::append_varint(payload, state.horizon);
+    payload.append(state.frames);
+    channel.send(handoff_cmd::stat, payload);
+
+    if ( state.replica ) {
+        payload.clear();
+        details::append_varint(payload, state.repl_since);
+        details::append_varint(payload, state.repl_epoch);
+        channel.send(handoff_cmd::repl, payload);
+    }
+
+    if ( state.ring_fd != -1 ) {
+        channel.send(handoff_cmd::ring, state.ring_name, state.ring_fd);
+    }
+
+    for ( const auto &it: state.sessions ) {
+        payload.clear();
+        details::append_varint(payload, static_cast<std::uint64_t>(it.read_protocol));
+        details::append_varint(payload, static_cast<std::uint64_t>(it.write_protocol));
+        details::append_varint(payload, it.replica);
+        details::append_varint(payload, it.readed);
+        details::append_varint(payload, it.batched);
+        details::append_varint(payload, it.prefixes.size());
+        for ( const auto &prefix: it.prefixes ) {
+            details::append_varint(payload, prefix.size());
+            payload.append(prefix);
+        }
+        payload.append(it.unread);
+        channel.send(handoff_cmd::sess, payload, it.fd);
+    }
+
+    channel.send(handoff_cmd::done, std::string_view{});
+
+    handoff_cmd cmd;
+    std::string ack;
+
+    return channel.recv(cmd, ack) && cmd == handoff_cmd::ackn;
+}
+
+// closes the descriptors of the state, the ones handed off are kept open by the new process
+inline void close_handoff(handoff_state &state) {
+    for ( int *fd: {&state.tcp_fd, &state.local_fd, &state.metrics_fd, &state.ring_fd, &state.channel_fd} ) {
+        if ( *fd != -1 ) {
+            ::close(std::exchange(*fd, -1));
+        }
+    }
+    for ( auto &it: state.sessions ) {
+        if ( it.fd != -1 ) {
+            ::close(std::exchange(it.fd, -1));
+        }
+    }
+}
+
+// connects to the old process listening on `path` and receives its state.
+// returns false if there is no process to take over from.
+// the old process keeps serving until confirm_handoff() is called, and takes everything back
+// if the new one exits before it
+inline bool receive_handoff(const std::string &path, handoff_state &state) {
+    sockaddr_un addr{};
+    if ( path.size() >= sizeof(addr.sun_path) ) {
+        throw std::invalid_argument{"the handoff path is too long: " + path};
+    }
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ( fd == -1 ) {
+        throw details::handoff_error("socket");
+    }
+    if ( ::connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == -1 ) {
+        const auto err = details::handoff_error("connect");
+        const bool absent = (errno == ENOENT || errno == ECONNREFUSED);
+        ::close(fd);
+        if ( absent ) {
+            return false;
+        }
+
+        throw err;
+    }
+
+    struct closer {
+        ~closer() { if ( fd != -1 ) ::close(fd); }
+        int fd;
+    } fd_closer{fd};
+
+    handoff_channel channel{fd};
+    auto wrong = [](){ return std::runtime_error{"handoff: wrong frame received"}; };
+    handoff_cmd cmd;
+    std::string payload;
+    while ( channel.recv(cmd, payload) ) {
+        std::string_view in{payload};
+        switch ( cmd ) {
+            case handoff_cmd::lstn: {
+                std::uint64_t kind;
+                if ( !parse_varints_payload(in, kind) ) { throw wrong(); }
+                const int lfd = channel.take_fd();
+                switch ( static_cast<handoff_listener>(kind) ) {
+                    case handoff_listener::tcp: state.tcp_fd = lfd; break;
+                    case handoff_listener::local: state.local_fd = lfd; break;
+                    case handoff_listener::metrics: state.metrics_fd = lfd; break;
+                    default: ::close(lfd); throw wrong();
+                }
+                break;
+            }
+            case handoff_cmd::stat: {
+                if ( !details::take_varint(in, state.seq)
+                    || !details::take_varint(in, state.epoch)
+                    || !details::take_varint(in, state.horizon) )
+                { throw wrong(); }
+                state.frames.assign(in);
+                break;
+            }
+            case handoff_cmd::repl: {
+                if ( !parse_varints_payload(in, state.repl_since, state.repl_epoch) ) { throw wrong(); }
+                state.replica = true;
+                break;
+            }
+            case handoff_cmd::ring: {
+                state.ring_fd = channel.take_fd();
+                state.ring_name.assign(in);
+                break;
+            }
+            case handoff_cmd::sess: {
+                detached_session ses;
+                ses.fd = channel.take_fd();
+                std::uint64_t read_proto, write_proto, replica, readed, batched, prefixes;
+                const bool ok = details::take_varint(in, read_proto)
+                    && details::take_varint(in, write_proto)
+                    && details::take_varint(in, replica)
+                    && details::take_varint(in, readed)
+                    && details::take_varint(in, batched)
+                    && details::take_varint(in, prefixes)
+                ;
+                for ( std::uint64_t idx = 0; ok && idx < prefixes; ++idx ) {
+                    std::uint64_t size;
+                    if ( !details::take_varint(in, size) || in.size() < size ) {
+                        ::close(ses.fd);
+                        throw wrong();
+                    }
+                    ses.prefixes.emplace_back(in.substr(0, size));
+                    in.remove_prefix(size);
+                }
+                if ( !ok ) {
+                    ::close(ses.fd);
+                    throw wrong();
+                }
+                ses.read_protocol = static_cast<protocol>(read_proto);
+                ses.write_protocol = static_cast<protocol>(write_proto);
+                ses.replica = (replica != 0u);
+                ses.readed = readed;
+                ses.batched = (batched != 0u);
+                ses.unread.assign(in);
+                state.sessions.push_back(std::move(ses));
+                break;
+            }
+            case handoff_cmd::done: {
+                state.channel_fd = std::exchange(fd_closer.fd, -1);
+
+                return true;
+            }
+            default: throw wrong();
+        }
+    }
+
+    throw std::runtime_error{"handoff: the old process has gone before it was done"};
+}
+
+// tells the old process the new one took over, so it exits
+inline void confirm_handoff(handoff_state &state) {
+    if ( state.channel_fd == -1 ) {
+        return;
+    }
+
+    struct closer {
+        ~closer() { ::close(fd); }
+        int fd;
+    } const fd_closer{std::exchange(state.channel_fd, -1)};
+
+    handoff_channel channel{fd_closer.fd};
+    channel.send(handoff_cmd::ackn, std::string_view{});
+}
+
+// the stream socket of the connection handed off, bound to its own strand
+inline stream_socket make_handoff_socket(ba::io_context &ioctx, int fd) {
+    sockaddr_storage addr{};
+    socklen_t len = sizeof(addr);
+    if ( ::getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len) == -1 ) {
+        const auto err = details::handoff_error("getsockname");
+        ::close(fd);
+
+        throw err;
+    }
+
+    const int family = addr.ss_family;
+    stream_socket sock{ba::make_strand(ioctx)};
+    sock.assign(ba::generic::stream_protocol{family, family == AF_UNIX ? 0 : IPPROTO_TCP}, fd);
+
+    return sock;
+}
+
+/**********************************************************************************************************************/
+
+#endif // __shared_state_server__handoff_hpp__included
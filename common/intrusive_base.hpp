@@ -15,6 +15,7 @@
 #define __shared_state_server__intrusive_base_hpp__included
 
 #include <atomic>
+#include <type_traits>
 #include <utility>
 #include <cstdint>
 
@@ -46,14 +47,14 @@ private:
     Deleter m_del;
 };
 
-struct intrusive_base_base {
+struct intrusive_counter {
     template<typename>
     friend struct intrusive_ptr;
 
-    intrusive_base_base() noexcept
+    intrusive_counter() noexcept
         :m_counter{1u}
     {}
-    intrusive_base_base(const intrusive_base_base &) noexcept
+    intrusive_counter(const intrusive_counter &) noexcept
         :m_counter{1u}
     {}
 
@@ -66,15 +67,28 @@ struct intrusive_base_base {
     std::uint32_t intrusive_use_count() const noexcept
     { return m_counter.load(); }
 
-    virtual void intrusive_call_deleter(void *) = 0;
-
 protected:
-    virtual ~intrusive_base_base() noexcept = default;
+    ~intrusive_counter() noexcept = default;
 
 private:
     std::atomic_uint_least32_t m_counter;
 };
 
+struct intrusive_base_base: intrusive_counter {
+    template<typename>
+    friend struct intrusive_ptr;
+
+    virtual void intrusive_call_deleter(void *) = 0;
+
+protected:
+    virtual ~intrusive_base_base() noexcept = default;
+};
+
+struct intrusive_static_tag {};
+
+template<typename T>
+constexpr bool is_intrusive_static_v = std::is_base_of_v<intrusive_static_tag, T>;
+
 } // ns details
 
 /**********************************************************************************************************************/
@@ -114,4 +128,35 @@ private:
 
 /**********************************************************************************************************************/
 
+// the variant of intrusive_base with the compile-time deleter policy:
+// no virtual functions and no per-object deleter storage.
+// the Policy is a base class which provides `void intrusive_release(Derived *)`,
+// called when the last reference is released.
+
+template<typename Derived, typename Policy>
+struct intrusive_static_base: details::intrusive_counter, details::intrusive_static_tag, Policy {
+    template<typename>
+    friend struct intrusive_ptr;
+
+    intrusive_static_base() noexcept
+        :intrusive_counter{}
+        ,Policy{}
+    {}
+    intrusive_static_base(const intrusive_static_base &) noexcept
+        :intrusive_counter{}
+        ,Policy{}
+    {}
+
+protected:
+    ~intrusive_static_base() noexcept = default;
+};
+
+// the policy which `delete`s the object
+template<typename T>
+struct delete_policy {
+    void intrusive_release(T *p) const noexcept { delete p; }
+};
+
+/**********************************************************************************************************************/
+
 #endif // __shared_state_server__intrusive_base_hpp__included
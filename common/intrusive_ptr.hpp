@@ -47,16 +47,22 @@ public:
     intrusive_ptr() noexcept
         :m_ptr{nullptr}
     {}
+    // for the types with the compile-time deleter policy - adopts the object,
+    // otherwise - the object will be `delete`d
     intrusive_ptr(T *ptr) noexcept
         :m_ptr{ptr}
     {
-        static_cast<intrusive_base<T> *>(m_ptr)
-            ->intrusive_set_deleter(details::default_delete<T>{});
+        if constexpr ( !details::is_intrusive_static_v<T> ) {
+            static_cast<intrusive_base<T> *>(m_ptr)
+                ->intrusive_set_deleter(details::default_delete<T>{});
+        }
     }
     template<typename Deleter>
     intrusive_ptr(T *ptr, Deleter del) noexcept
         :m_ptr{ptr}
     {
+        static_assert(!details::is_intrusive_static_v<T>, "the deleter is specified by the policy");
+
         static_cast<intrusive_base<T> *>(m_ptr)
             ->intrusive_set_deleter(
                 details::user_delete<T, Deleter>{std::move(del)});
@@ -65,13 +71,14 @@ public:
     intrusive_ptr(const intrusive_ptr &r) noexcept
         :m_ptr{r.m_ptr}
     {
-        static_cast<details::intrusive_base_base *>(m_ptr)
-            ->intrusive_increment_ref();
+        if ( m_ptr ) {
+            static_cast<details::intrusive_counter *>(m_ptr)
+                ->intrusive_increment_ref();
+        }
     }
     intrusive_ptr& operator= (const intrusive_ptr &r) noexcept {
-        m_ptr = r.m_ptr;
-        static_cast<details::intrusive_base_base *>(m_ptr)
-            ->intrusive_increment_ref();
+        intrusive_ptr tmp{r};
+        std::swap(m_ptr, tmp.m_ptr);
 
         return *this;
     }
@@ -79,16 +86,23 @@ public:
         :m_ptr{std::exchange(r.m_ptr, nullptr)}
     {}
     intrusive_ptr& operator= (intrusive_ptr &&r) noexcept {
-        if ( this != std::addressof(r) )
-            m_ptr = std::exchange(r.m_ptr, nullptr);
+        if ( this != std::addressof(r) ) {
+            intrusive_ptr tmp{std::move(r)};
+            std::swap(m_ptr, tmp.m_ptr);
+        }
 
         return *this;
     }
 
     ~intrusive_ptr() noexcept {
-        auto *base = static_cast<details::intrusive_base_base *>(m_ptr);
+        auto *base = static_cast<details::intrusive_counter *>(m_ptr);
         if ( base && 0 == base->intrusive_decrement_ref() ) {
-            base->intrusive_call_deleter(m_ptr);
+            if constexpr ( details::is_intrusive_static_v<T> ) {
+                m_ptr->intrusive_release(m_ptr);
+            } else {
+                static_cast<details::intrusive_base_base *>(m_ptr)
+                    ->intrusive_call_deleter(m_ptr);
+            }
         }
     }
 
@@ -102,7 +116,7 @@ public:
     deref_t       operator*  ()         noexcept { return *m_ptr; }
 
     auto use_count() const noexcept {
-        return static_cast<details::intrusive_base_base *>(m_ptr)
+        return static_cast<const details::intrusive_counter *>(m_ptr)
             ->intrusive_use_count();
     }
     auto unique() const noexcept { return use_count() == 1u; }
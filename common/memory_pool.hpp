@@ -0,0 +1,346 @@
+
+// ----------------------------------------------------------------------------
+//                              Apache License
+//                        Version 2.0, January 2004
+//                     http://www.apache.org/licenses/
+//
+// This file is part of shared-state-server(https://github.com/niXman/shared-state-server) project.
+//
+// This was a test task for implementing multithreaded Shared-State server using asio.
+//
+// Copyright (c) 2023 niXman (github dot nixman dog pm.me). All rights reserved.
+// ----------------------------------------------------------------------------
+
+#ifndef __shared_state_server__memory_pool_hpp__included
+#define __shared_state_server__memory_pool_hpp__included
+
+#include "thread_index.hpp"
+
+#include <boost/lockfree/stack.hpp>
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include <sys/mman.h>
+
+/**********************************************************************************************************************/
+
+enum class prealloc_mode {
+     none      // the blocks are allocated from the heap on demand
+    ,slab      // `capacity` blocks are allocated up front in one contiguous prefaulted slab
+    ,hugepages // the same, but the slab is backed by the huge pages if possible
+};
+
+/**********************************************************************************************************************/
+
+constexpr std::size_t align_up(std::size_t v, std::size_t align) noexcept
+{ return (v + align - 1u) & ~(align - 1u); }
+
+// the anonymous mapping prefaulted at allocation,
+// backed by the huge pages if requested and possible, otherwise by the transparent huge pages if enabled
+struct slab_memory {
+    void *ptr;
+    std::size_t size;
+    bool hugepages;
+};
+
+inline slab_memory slab_allocate(std::size_t size, bool hugepages) {
+    static constexpr std::size_t page_size = 4096u;
+    static constexpr std::size_t huge_page_size = 2u * 1024u * 1024u;
+
+    slab_memory res{MAP_FAILED, 0u, false};
+    if ( hugepages ) {
+        res.size = align_up(size, huge_page_size);
+        res.ptr = ::mmap(nullptr, res.size, PROT_READ|PROT_WRITE
+            ,MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE|MAP_HUGETLB, -1, 0);
+        res.hugepages = (res.ptr != MAP_FAILED);
+    }
+    if ( res.ptr == MAP_FAILED ) {
+        res.size = align_up(size, hugepages ? huge_page_size : page_size);
+        res.ptr = ::mmap(nullptr, res.size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if ( res.ptr == MAP_FAILED ) {
+            throw std::bad_alloc{};
+        }
+        if ( hugepages ) {
+            ::madvise(res.ptr, res.size, MADV_HUGEPAGE);
+        }
+        // prefault the pages to not pay for it on the first burst
+        for ( std::size_t off = 0; off < res.size; off += page_size ) {
+            static_cast<volatile char *>(res.ptr)[off] = 0;
+        }
+    }
+
+    return res;
+}
+
+inline void slab_free(const slab_memory &slab) noexcept {
+    if ( slab.ptr ) {
+        ::munmap(slab.ptr, slab.size);
+    }
+}
+
+/**********************************************************************************************************************/
+
+// the pool of the raw memory blocks of the same size.
+// the free blocks are cached in the per-thread magazines (bounded stacks of pointers),
+// so the most of acquire/release calls don't touch any shared state.
+// only the full or empty magazines are exchanged with the global lock-free depot.
+// the threads with index above `max_threads` bypass the caches and use the heap directly.
+// when preallocated, the slab blocks are pushed to the depot at construction, and the heap
+// is used only after they are exhausted.
+
+struct memory_pool final {
+    static constexpr std::size_t magazine_size = 32u;
+    static constexpr std::size_t max_threads = reused_thread_indices;
+
+    memory_pool(const memory_pool &) = delete;
+    memory_pool& operator= (const memory_pool &) = delete;
+    memory_pool(memory_pool &&) = delete;
+    memory_pool& operator= (memory_pool &&) = delete;
+
+    memory_pool(std::size_t block_size, std::size_t capacity, prealloc_mode mode = prealloc_mode::none)
+        :m_block_size{align_up(block_size, alignof(std::max_align_t))}
+        ,m_size{}
+        ,m_in_use{}
+        ,m_caches{}
+        ,m_depot_size{}
+        ,m_full{capacity / magazine_size + 1u}
+        ,m_empty{capacity / magazine_size + max_threads}
+        ,m_slab{}
+    {
+        if ( mode != prealloc_mode::none && capacity ) {
+            preallocate(capacity, mode == prealloc_mode::hugepages);
+        }
+    }
+    ~memory_pool() {
+        assert(in_use() == 0);
+
+        for ( auto &it: m_caches ) {
+            free_magazine(it.loaded);
+            free_magazine(it.previous);
+        }
+        m_full.consume_all([this](magazine *m){ free_magazine(m); });
+        m_empty.consume_all([this](magazine *m){ free_magazine(m); });
+
+        slab_free(m_slab);
+    }
+
+    void* acquire() {
+        auto *cache = this_thread_cache();
+        if ( !cache ) {
+            m_in_use.value.fetch_add(1, std::memory_order_relaxed);
+            return allocate();
+        }
+
+        cache->add_in_use(1);
+        if ( cache->loaded->count == 0 ) {
+            if ( cache->previous->count == magazine_size ) {
+                std::swap(cache->loaded, cache->previous);
+            } else {
+                magazine *full;
+                if ( !m_full.pop(full) ) {
+                    return allocate();
+                }
+                m_depot_size.value.fetch_sub(1u, std::memory_order_relaxed);
+
+                push_empty(cache->previous);
+                cache->previous = cache->loaded;
+                cache->loaded = full;
+            }
+        }
+
+        return cache->loaded->items[--cache->loaded->count];
+    }
+
+    void release(void *p) {
+        auto *cache = this_thread_cache();
+        if ( !cache ) {
+            deallocate(p);
+            m_in_use.value.fetch_sub(1, std::memory_order_relaxed);
+
+            return;
+        }
+
+        if ( cache->loaded->count == magazine_size ) {
+            if ( cache->previous->count == 0 ) {
+                std::swap(cache->loaded, cache->previous);
+            } else {
+                push_full(cache->previous);
+                cache->previous = cache->loaded;
+                cache->loaded = pop_empty();
+            }
+        }
+
+        cache->loaded->items[cache->loaded->count++] = p;
+        cache->add_in_use(-1);
+    }
+
+    // frees the heap blocks of the full magazines in the depot until no more than `keep` blocks are left there.
+    // the per-thread caches and the slab blocks are not touched.
+    void trim(std::size_t keep = 0) {
+        const auto keep_magazines = keep / magazine_size;
+        auto depot_size = m_depot_size.value.load(std::memory_order_relaxed);
+        // the magazines left holding the slab blocks are pushed back only after the loop,
+        // otherwise the LIFO depot would give them back to the next iteration instead of the heap ones
+        std::vector<magazine *> slab_only;
+        magazine *m;
+        for ( ; depot_size > keep_magazines && m_full.pop(m); --depot_size ) {
+            m_depot_size.value.fetch_sub(1u, std::memory_order_relaxed);
+
+            std::size_t count = 0;
+            for ( std::size_t idx = 0; idx < m->count; ++idx ) {
+                if ( in_slab(m->items[idx]) ) {
+                    m->items[count++] = m->items[idx];
+                } else {
+                    deallocate(m->items[idx]);
+                }
+            }
+            m->count = count;
+
+            if ( count ) {
+                slab_only.push_back(m);
+            } else {
+                push_empty(m);
+            }
+        }
+        for ( auto *it: slab_only ) {
+            push_full(it);
+        }
+    }
+
+    std::size_t block_size() const noexcept { return m_block_size; }
+    // true if the slab is backed by the huge pages
+    bool hugepages() const noexcept { return m_slab.hugepages; }
+    // the number of the blocks allocated from the heap
+    std::size_t size() const noexcept { return m_size.value.load(std::memory_order_relaxed); }
+    // the number of the blocks acquired and not released
+    std::size_t in_use() const noexcept {
+        std::int64_t res = m_in_use.value.load(std::memory_order_relaxed);
+        for ( const auto &it: m_caches ) {
+            res += it.in_use.load(std::memory_order_relaxed);
+        }
+
+        return static_cast<std::size_t>(res);
+    }
+
+private:
+    struct magazine {
+        std::size_t count;
+        void *items[magazine_size];
+    };
+
+    // accessed only by the owning thread, except `in_use` which is read by `in_use()`
+    struct alignas(cache_line_size) thread_cache {
+        magazine *loaded;
+        magazine *previous;
+        std::atomic_int64_t in_use;
+
+        void add_in_use(std::int64_t v) noexcept
+        { in_use.store(in_use.load(std::memory_order_relaxed) + v, std::memory_order_relaxed); }
+    };
+
+    template<typename V>
+    struct alignas(cache_line_size) padded {
+        V value;
+    };
+
+    void preallocate(std::size_t capacity, bool hugepages) {
+        m_slab = slab_allocate(capacity * m_block_size, hugepages);
+
+        auto *block = static_cast<char *>(m_slab.ptr);
+        for ( std::size_t left = capacity; left; ) {
+            auto *m = pop_empty();
+            for ( ; left && m->count < magazine_size; --left, block += m_block_size ) {
+                m->items[m->count++] = block;
+            }
+            push_full(m);
+        }
+        m_size.value.fetch_add(capacity, std::memory_order_relaxed);
+    }
+    bool in_slab(const void *p) const noexcept {
+        const auto *b = static_cast<const char *>(m_slab.ptr);
+        const auto *c = static_cast<const char *>(p);
+        return m_slab.ptr && c >= b && c < b + m_slab.size;
+    }
+
+    thread_cache* this_thread_cache() {
+        const auto idx = this_thread_index();
+        if ( idx >= max_threads ) {
+            return nullptr;
+        }
+
+        auto *cache = std::addressof(m_caches[idx]);
+        if ( !cache->loaded ) {
+            cache->loaded = pop_empty();
+            cache->previous = pop_empty();
+        }
+
+        return cache;
+    }
+
+    void* allocate() {
+        m_size.value.fetch_add(1u, std::memory_order_relaxed);
+
+        return ::operator new(m_block_size);
+    }
+    void deallocate(void *p) {
+        if ( in_slab(p) ) {
+            return;
+        }
+
+        m_size.value.fetch_sub(1u, std::memory_order_relaxed);
+
+        ::operator delete(p);
+    }
+
+    magazine* pop_empty() {
+        magazine *m;
+        if ( m_empty.pop(m) ) {
+            return m;
+        }
+
+        m = new magazine;
+        m->count = 0;
+
+        return m;
+    }
+    void push_full(magazine *m) {
+        m_depot_size.value.fetch_add(1u, std::memory_order_relaxed);
+        while ( !m_full.push(m) )
+        {}
+    }
+    void push_empty(magazine *m) {
+        while ( !m_empty.push(m) )
+        {}
+    }
+    void free_magazine(magazine *m) {
+        if ( !m ) { return; }
+
+        for ( std::size_t idx = 0; idx < m->count; ++idx ) {
+            deallocate(m->items[idx]);
+        }
+
+        delete m;
+    }
+
+private:
+    const std::size_t m_block_size;
+    padded<std::atomic_size_t> m_size;
+    // used only by the threads without the cache
+    padded<std::atomic_int64_t> m_in_use;
+    thread_cache m_caches[max_threads];
+    // the number of the full magazines in the depot
+    padded<std::atomic_size_t> m_depot_size;
+    boost::lockfree::stack<magazine *> m_full;
+    boost::lockfree::stack<magazine *> m_empty;
+    slab_memory m_slab;
+};
+
+/**********************************************************************************************************************/
+
+#endif // __shared_state_server__memory_pool_hpp__included
@@ -0,0 +1,214 @@
+
+// ----------------------------------------------------------------------------
+//                              Apache License
+//                        Version 2.0, January 2004
+//                     http://www.apache.org/licenses/
+//
+// This file is part of shared-state-server(https://github.com/niXman/shared-state-server) project.
+//
+// This was a test task for implementing multithreaded Shared-State server using asio.
+//
+// Copyright (c) 2023 niXman (github dot nixman dog pm.me). All rights reserved.
+// ----------------------------------------------------------------------------
+
+#ifndef __shared_state_server__metrics_hpp__included
+#define __shared_state_server__metrics_hpp__included
+
+#include "utils.hpp"
+#include "thread_index.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/**********************************************************************************************************************/
+
+enum class counter: std::size_t {
+     connections_opened
+    ,connections_closed
+    ,connections_rejected // the connections rejected by the admission control
+    ,updates           // the DATA/DACK requests which changed the state
+    ,deletes           // the DELE requests which deleted the key
+    ,broadcasts        // the messages broadcasted to the subscribers
+    ,deliveries        // the broadcasted messages queued to the sessions, one per recipient
+    ,bytes_in
+    ,bytes_out
+    ,writes_queued     // the messages queued to the sessions' write queues
+    ,writes_done       // the messages left the sessions' write queues, sent or not
+    ,stops             // the sessions told by STOP to reconnect on the reset
+    ,counters_n
+};
+
+// the per-thread counters, each is written only by its own thread with the relaxed load and store,
+// so the increment is as cheap as the non-atomic one and never bounces the cache lines between the threads.
+// the threads with index above `max_threads` share the atomic counters.
+// reading sums all the threads' counters without any locking, so the value may be slightly behind.
+
+struct metrics final {
+    static constexpr std::size_t max_threads = reused_thread_indices;
+    static constexpr std::size_t counters_n = static_cast<std::size_t>(counter::counters_n);
+
+    metrics(const metrics &) = delete;
+    metrics& operator= (const metrics &) = delete;
+    metrics(metrics &&) = delete;
+    metrics& operator= (metrics &&) = delete;
+
+    metrics()
+        :m_threads{}
+        ,m_shared{}
+    {}
+
+    void add(counter c, std::uint64_t v = 1u) noexcept {
+        const auto idx = this_thread_index();
+        const auto cnt = static_cast<std::size_t>(c);
+        if ( idx < max_threads ) {
+            auto &value = m_threads[idx].values[cnt];
+            value.store(value.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+        } else {
+            m_shared.values[cnt].fetch_add(v, std::memory_order_relaxed);
+        }
+    }
+
+    std::uint64_t get(counter c) const noexcept {
+        const auto cnt = static_cast<std::size_t>(c);
+        std::uint64_t res = m_shared.values[cnt].load(std::memory_order_relaxed);
+        for ( const auto &it: m_threads ) {
+            res += it.values[cnt].load(std::memory_order_relaxed);
+        }
+
+        return res;
+    }
+
+    // the difference of two counters, used for the gauges like the number of the active connections
+    std::uint64_t get(counter added, counter removed) const noexcept {
+        const auto a = get(added);
+        const auto r = get(removed);
+
+        return a > r ? a - r : 0u;
+    }
+
+private:
+    struct alignas(cache_line_size) thread_counters {
+        std::atomic_uint64_t values[counters_n];
+    };
+
+    thread_counters m_threads[max_threads];
+    thread_counters m_shared;
+};
+
+/**********************************************************************************************************************/
+
+// appends the metric in the Prometheus text exposition format
+inline void append_metric(
+     std::string &out
+    ,const char *name
+    ,const char *type
+    ,const char *help
+    ,std::uint64_t value)
+{
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+    out.append(name).append(" ").append(std::to_string(value)).append("\n");
+}
+
+// the same, but with one sample per the label's value.
+// Samples is the range of the pairs of the label's value and the sample's value
+template<typename Samples>
+void append_metric(
+     std::string &out
+    ,const char *name
+    ,const char *type
+    ,const char *help
+    ,const char *label
+    ,const Samples &samples)
+{
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+    for ( const auto &it: samples ) {
+        out.append(name).append("{").append(label).append("=\"").append(it.first).append("\"} ")
+            .append(std::to_string(it.second)).append("\n");
+    }
+}
+
+/**********************************************************************************************************************/
+
+// the minimal HTTP/1.0 responder: reads the request's head, ignoring the method and the path,
+// replies with the body produced by `render_cb` and closes the connection.
+// runs on the socket's strand, the body can be produced asynchronously on any other.
+
+struct metrics_connection {
+    // the request's head above this is treated as an error
+    static constexpr std::size_t max_request_size = 4096u;
+
+    // RenderCB's signature: void(ReplyCB)
+    // ReplyCB's signature: void(std::string body), may be called from any thread
+    template<typename RenderCB>
+    static void start(tcp::socket sock, RenderCB render_cb) {
+        auto self = std::make_shared<metrics_connection>(std::move(sock));
+        auto *ptr = self.get();
+        ba::async_read_until(
+             ptr->m_sock
+            ,ba::dynamic_buffer(ptr->m_request, max_request_size)
+            ,"\r\n\r\n"
+            ,[self=std::move(self), render_cb=std::move(render_cb)]
+             (const bs::error_code &ec, std::size_t) mutable
+             {
+                if ( ec ) {
+                    return;
+                }
+
+                render_cb(
+                    [self=std::move(self)]
+                    (std::string body) mutable
+                    {
+                        auto *ptr = self.get();
+                        ba::post(
+                             ptr->m_sock.get_executor()
+                            ,[self=std::move(self), body=std::move(body)]
+                             () mutable
+                             { self->reply(std::move(self), body); }
+                        );
+                    }
+                );
+             }
+        );
+    }
+
+    explicit metrics_connection(tcp::socket sock)
+        :m_sock{std::move(sock)}
+        ,m_request{}
+        ,m_response{}
+    {}
+
+private:
+    void reply(std::shared_ptr<metrics_connection> self, const std::string &body) {
+        m_response
+            .append("HTTP/1.0 200 OK\r\n")
+            .append("Content-Type: text/plain; version=0.0.4\r\n")
+            .append("Content-Length: ").append(std::to_string(body.size())).append("\r\n")
+            .append("Connection: close\r\n\r\n")
+            .append(body)
+        ;
+        ba::async_write(
+             m_sock
+            ,ba::buffer(m_response)
+            ,[self=std::move(self)]
+             (const bs::error_code &, std::size_t)
+             {
+                bs::error_code ec;
+                self->m_sock.shutdown(tcp::socket::shutdown_both, ec);
+             }
+        );
+    }
+
+private:
+    tcp::socket m_sock;
+    std::string m_request;
+    std::string m_response;
+};
+
+/**********************************************************************************************************************/
+
+#endif // __shared_state_server__metrics_hpp__included
@@ -15,10 +15,9 @@
 #define __shared_state_server__object_pool_hpp__included
 
 #include "intrusive_ptr.hpp"
+#include "memory_pool.hpp"
 
-#include <boost/lockfree/stack.hpp>
-
-#include <atomic>
+#include <new>
 
 /**********************************************************************************************************************/
 
@@ -26,91 +25,74 @@ template<typename T>
 struct object_pool final {
     object_pool(const object_pool &) = delete;
     object_pool& operator= (const object_pool &) = delete;
-    object_pool(object_pool &&) = default;
-    object_pool& operator= (object_pool &&) = default;
+    object_pool(object_pool &&) = delete;
+    object_pool& operator= (object_pool &&) = delete;
 
-    object_pool(std::size_t capacity)
-        :m_size{}
-        ,m_in_use{}
-        ,m_stack{capacity}
+    object_pool(std::size_t capacity, prealloc_mode mode = prealloc_mode::none)
+        :m_mem{sizeof(T), capacity, mode}
     {}
-    ~object_pool()
-    { assert(m_in_use == 0); }
 
     template<typename ...Args>
-    auto get(Args && ...args)
-    { return get_impl(std::forward<Args>(args)...); }
+    auto get(Args && ...args) {
+        if constexpr ( details::is_intrusive_static_v<T> ) {
+            void *mem = m_mem.acquire();
+            T *p = ::new(mem) T(std::forward<Args>(args)...);
+            p->intrusive_set_pool(this);
+
+            return intrusive_ptr<T>{p};
+        } else {
+            return get_del(
+                 [this](T *p){ release(p); }
+                ,std::forward<Args>(args)...
+            );
+        }
+    }
 
+    // the deleter takes the ownership of the object and must eventually call `release()` for it.
     template<typename Deleter, typename ...Args>
-    auto get_del(Deleter del, Args && ...args)
-    { return get_impl_del(std::move(del), std::forward<Args>(args)...); }
-
-    std::size_t size() const noexcept { return m_size.load(); }
-    std::size_t in_use() const noexcept { return m_in_use.load(); }
-
-private:
-    template<typename ...Args>
-    auto get_impl(Args && ...args) {
-        auto deleter = [this](T *p) {
-            p->~T();
-
-            while ( !m_stack.push(p) )
-            {}
-
-            --m_in_use;
-        };
+    auto get_del(Deleter del, Args && ...args) {
+        void *mem = m_mem.acquire();
+        T *p = ::new(mem) T(std::forward<Args>(args)...);
 
-        if ( !m_stack.empty() ) {
-            T *p;
-            while ( !m_stack.pop(p) )
-            {}
-
-            T *np = ::new(static_cast<void *>(p)) T(std::forward<Args>(args)...);
-            ++m_in_use;
-
-            return intrusive_ptr<T>{np, std::move(deleter)};
-        }
-
-        T *p = ::new T(std::forward<Args>(args)...);
-        ++m_size;
-        ++m_in_use;
+        return intrusive_ptr<T>{p, std::move(del)};
+    }
 
-        return intrusive_ptr<T>{p, std::move(deleter)};
+    // destroys the object and returns its memory to the pool
+    void release(T *p) {
+        p->~T();
+        m_mem.release(p);
     }
 
-    template<typename Deleter, typename ...Args>
-    auto get_impl_del(Deleter del, Args && ...args) {
-        auto deleter = [this, del=std::move(del)](T *p) {
-            del(p);
+    void trim(std::size_t keep = 0) { m_mem.trim(keep); }
+    bool hugepages() const noexcept { return m_mem.hugepages(); }
 
-            while ( !m_stack.push(p) )
-            {}
+    std::size_t size() const noexcept { return m_mem.size(); }
+    std::size_t in_use() const noexcept { return m_mem.in_use(); }
 
-            --m_in_use;
-        };
+private:
+    memory_pool m_mem;
+};
 
-        if ( !m_stack.empty() ) {
-            T *p;
-            while ( !m_stack.pop(p) )
-            {}
+/**********************************************************************************************************************/
 
-            T *np = ::new(static_cast<void *>(p)) T(std::forward<Args>(args)...);
-            ++m_in_use;
+// the compile-time deleter policy for intrusive_static_base:
+// the object returns itself to the pool it was taken from.
 
-            return intrusive_ptr<T>{np, std::move(deleter)};
-        }
+template<typename T>
+struct object_pool_policy {
+    template<typename>
+    friend struct object_pool;
 
-        T *p = ::new T(std::forward<Args>(args)...);
-        ++m_size;
-        ++m_in_use;
+    object_pool_policy() noexcept
+        :m_pool{nullptr}
+    {}
 
-        return intrusive_ptr<T>{p, std::move(deleter)};
-    }
+    void intrusive_release(T *p) noexcept { m_pool->release(p); }
 
 private:
-    std::atomic_uint32_t m_size;
-    std::atomic_uint32_t m_in_use;
-    boost::lockfree::stack<T *> m_stack;
+    void intrusive_set_pool(object_pool<T> *pool) noexcept { m_pool = pool; }
+
+    object_pool<T> *m_pool;
 };
 
 /**********************************************************************************************************************/
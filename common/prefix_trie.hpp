@@ -0,0 +1,192 @@
+
+// ----------------------------------------------------------------------------
+//                              Apache License
+//                        Version 2.0, January 2004
+//                     http://www.apache.org/licenses/
+//
+// This file is part of shared-state-server(https://github.com/niXman/shared-state-server) project.
+//
+// This was a test task for implementing multithreaded Shared-State server using asio.
+//
+// Copyright (c) 2023 niXman (github dot nixman dog pm.me). All rights reserved.
+// ----------------------------------------------------------------------------
+
+#ifndef __shared_state_server__prefix_trie_hpp__included
+#define __shared_state_server__prefix_trie_hpp__included
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**********************************************************************************************************************/
+
+// path-compressed (radix) trie which maps a key prefixes to the sets of values.
+// T is expected to be a cheap copyable handle, like a raw pointer.
+// NOT thread-safe, should be used from one strand only.
+
+template<typename T>
+struct prefix_trie {
+    prefix_trie(const prefix_trie &) = delete;
+    prefix_trie& operator= (const prefix_trie &) = delete;
+
+    prefix_trie()
+        :m_root{}
+        ,m_size{}
+    {}
+
+    // returns false if the value already exists for the prefix
+    bool insert(std::string_view prefix, T v) {
+        auto *n = find_or_create(std::addressof(m_root), prefix);
+        if ( std::find(n->values.begin(), n->values.end(), v) != n->values.end() ) {
+            return false;
+        }
+
+        n->values.push_back(std::move(v));
+        ++m_size;
+
+        return true;
+    }
+
+    // returns false if the value does not exist for the prefix
+    bool erase(std::string_view prefix, const T &v) {
+        return erase_impl(std::addressof(m_root), prefix, v);
+    }
+
+    // calls `cb(const T &)` for each value whose prefix is a prefix of the key.
+    // the values of the shortest prefixes are visited first.
+    template<typename CB>
+    void for_each_match(std::string_view key, CB &&cb) const {
+        const node *n = std::addressof(m_root);
+        for ( ;; ) {
+            for ( const auto &it: n->values ) {
+                cb(it);
+            }
+            if ( key.empty() ) {
+                break;
+            }
+
+            const node *child = n->find_child(key.front());
+            if ( !child || key.compare(0, child->edge.size(), child->edge) != 0 ) {
+                break;
+            }
+
+            key.remove_prefix(child->edge.size());
+            n = child;
+        }
+    }
+
+    // the total number of the (prefix, value) pairs
+    std::size_t size() const noexcept { return m_size; }
+    bool empty() const noexcept { return m_size == 0; }
+
+private:
+    struct node {
+        std::string edge;
+        std::vector<std::unique_ptr<node>> children;
+        std::vector<T> values;
+
+        node* find_child(char ch) const noexcept {
+            for ( const auto &it: children ) {
+                if ( it->edge.front() == ch ) {
+                    return it.get();
+                }
+            }
+
+            return nullptr;
+        }
+        std::size_t child_index(char ch) const noexcept {
+            for ( std::size_t idx = 0; idx < children.size(); ++idx ) {
+                if ( children[idx]->edge.front() == ch ) {
+                    return idx;
+                }
+            }
+
+            return children.size();
+        }
+    };
+
+    static std::size_t common_length(std::string_view l, std::string_view r) noexcept {
+        const auto it = std::mismatch(l.begin(), l.end(), r.begin(), r.end()).first;
+        return static_cast<std::size_t>(it - l.begin());
+    }
+
+    static node* find_or_create(node *n, std::string_view prefix) {
+        while ( !prefix.empty() ) {
+            const auto idx = n->child_index(prefix.front());
+            if ( idx == n->children.size() ) {
+                auto child = std::make_unique<node>();
+                child->edge = std::string{prefix};
+                n->children.push_back(std::move(child));
+
+                return n->children.back().get();
+            }
+
+            auto &child = n->children[idx];
+            const auto len = common_length(child->edge, prefix);
+            if ( len < child->edge.size() ) {
+                // split the edge
+                auto mid = std::make_unique<node>();
+                mid->edge = child->edge.substr(0, len);
+                child->edge.erase(0, len);
+                mid->children.push_back(std::move(child));
+                child = std::move(mid);
+            }
+
+            n = child.get();
+            prefix.remove_prefix(len);
+        }
+
+        return n;
+    }
+
+    bool erase_impl(node *n, std::string_view prefix, const T &v) {
+        if ( prefix.empty() ) {
+            auto it = std::find(n->values.begin(), n->values.end(), v);
+            if ( it == n->values.end() ) {
+                return false;
+            }
+
+            *it = std::move(n->values.back());
+            n->values.pop_back();
+            --m_size;
+
+            return true;
+        }
+
+        const auto idx = n->child_index(prefix.front());
+        if ( idx == n->children.size() ) {
+            return false;
+        }
+
+        auto &child = n->children[idx];
+        if ( prefix.compare(0, child->edge.size(), child->edge) != 0 ) {
+            return false;
+        }
+        if ( !erase_impl(child.get(), prefix.substr(child->edge.size()), v) ) {
+            return false;
+        }
+
+        // prune or merge the child if it is not needed anymore
+        if ( child->values.empty() ) {
+            if ( child->children.empty() ) {
+                n->children.erase(n->children.begin() + idx);
+            } else if ( child->children.size() == 1 ) {
+                auto grandchild = std::move(child->children.front());
+                grandchild->edge.insert(0, child->edge);
+                child = std::move(grandchild);
+            }
+        }
+
+        return true;
+    }
+
+private:
+    node m_root;
+    std::size_t m_size;
+};
+
+/**********************************************************************************************************************/
+
+#endif // __shared_state_server__prefix_trie_hpp__included
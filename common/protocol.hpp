@@ -0,0 +1,389 @@
+
+// ----------------------------------------------------------------------------
+//                              Apache License
+//                        Version 2.0, January 2004
+//                     http://www.apache.org/licenses/
+//
+// This file is part of shared-state-server(https://github.com/niXman/shared-state-server) project.
+//
+// This was a test task for implementing multithreaded Shared-State server using asio.
+//
+// Copyright (c) 2023 niXman (github dot nixman dog pm.me). All rights reserved.
+// ----------------------------------------------------------------------------
+
+#ifndef __shared_state_server__protocol_hpp__included
+#define __shared_state_server__protocol_hpp__included
+
+#include "string_buffer.hpp"
+
+#include <boost/asio/read_until.hpp>
+
+#include <charconv>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+/**********************************************************************************************************************/
+
+// the connection starts with the text protocol, and can be switched to the binary one
+// by "PROT bin\n" sent as the first line. the server replies with "PROT bin\n" in the text,
+// and everything sent after the reply is binary. the client can send the binary frames
+// right after the request.
+
+enum class protocol: std::uint8_t {
+     text
+    ,binary
+};
+
+// the binary frame: varint(size of body) body
+// body: cmd(1 byte) payload
+//   PING: arbitrary, echoed back. the client sends varint(ms-time)
+//   DATA: varint(size of key) key val
+//   STOP: varint(reconnect delay in ms)
+//   SUBS: varint(size of prefix) prefix [varint(since)]
+//   USUB: prefix
+//   BTCH: one byte, 0 or 1
+//   DELE: key
+//   DACK: varint(request id) varint(size of key) key val
+//   ACKS: (varint(request id) changed(1 byte, 0 or 1))...
+//   COMP: the compression method, "zlib" or "none"
+//   REPL: the replica's request: varint(since) varint(epoch)
+//         the primary's reply: varint(since) varint(seq) varint(epoch) varint(hops)
+//   RSEQ: varint(seq) varint(ms-time), precedes each DATA/DELE sent to the replica
+//   SYND: varint(seq), the seq of the primary's REPL reply, follows the last message of the replica's sync
+// the varint is LEB128: 7 bits per byte, the least significant group first,
+// the high bit is set on all the bytes except the last one.
+
+enum class binary_cmd: std::uint8_t {
+     ping = 1
+    ,data
+    ,stop
+    ,subs
+    ,usub
+    ,btch
+    ,dele
+    ,dack
+    ,acks
+    ,comp
+    ,repl
+    ,rseq
+    ,synd
+};
+
+static constexpr std::size_t max_varint_size = 10u;
+
+constexpr std::size_t varint_size(std::uint64_t v) noexcept {
+    std::size_t n = 1;
+    for ( ; v >= 0x80u; v >>= 7u ) {
+        ++n;
+    }
+
+    return n;
+}
+
+inline char* encode_varint(char *p, std::uint64_t v) noexcept {
+    for ( ; v >= 0x80u; v >>= 7u ) {
+        *p++ = static_cast<char>(static_cast<std::uint8_t>(v) | 0x80u);
+    }
+    *p++ = static_cast<char>(v);
+
+    return p;
+}
+
+// returns the number of the consumed bytes, 0 if the input is incomplete,
+// or `max_varint_size + 1` if the varint is malformed
+template<typename Iter>
+std::size_t decode_varint(Iter beg, Iter end, std::uint64_t &v) noexcept {
+    v = 0;
+    for ( std::size_t n = 0; beg != end; ++beg ) {
+        const auto byte = static_cast<std::uint8_t>(*beg);
+        v |= static_cast<std::uint64_t>(byte & 0x7fu) << (7u * n);
+        if ( ++n > max_varint_size ) {
+            return max_varint_size + 1;
+        }
+        if ( !(byte & 0x80u) ) {
+            return n;
+        }
+    }
+
+    return 0;
+}
+
+// the asio's MatchCondition, matching one complete frame.
+// the malformed size is matched as a frame which `parse_frame()` will reject.
+struct frame_match {
+    template<typename Iter>
+    std::pair<Iter, bool> operator() (Iter beg, Iter end) const noexcept {
+        std::uint64_t size;
+        const auto hdr = decode_varint(beg, end, size);
+        if ( hdr > max_varint_size ) {
+            return {beg + 1, true};
+        }
+        if ( hdr == 0 || static_cast<std::uint64_t>(end - beg) - hdr < size ) {
+            return {beg, false};
+        }
+
+        return {beg + static_cast<std::ptrdiff_t>(hdr + size), true};
+    }
+};
+
+namespace boost::asio {
+template<>
+struct is_match_condition<frame_match>: std::true_type {};
+} // ns boost::asio
+
+struct binary_frame {
+    binary_cmd cmd;
+    std::string_view payload;
+};
+
+// parses the frame matched by frame_match.
+// returns false if malformed
+inline bool parse_frame(std::string_view str, binary_frame &frame) noexcept {
+    std::uint64_t size;
+    const auto hdr = decode_varint(str.begin(), str.end(), size);
+    if ( hdr == 0 || hdr > max_varint_size || size == 0 || str.size() - hdr != size ) {
+        return false;
+    }
+
+    frame.cmd = static_cast<binary_cmd>(str[hdr]);
+    frame.payload = str.substr(hdr + 1);
+
+    return true;
+}
+
+// parses the DATA's payload.
+// returns false if malformed
+inline bool parse_data_payload(std::string_view payload, std::string_view &key, std::string_view &val) noexcept {
+    std::uint64_t size;
+    const auto hdr = decode_varint(payload.begin(), payload.end(), size);
+    if ( hdr == 0 || hdr > max_varint_size || payload.size() - hdr < size ) {
+        return false;
+    }
+
+    key = payload.substr(hdr, size);
+    val = payload.substr(hdr + size);
+
+    return true;
+}
+
+// parses the SUBS's payload, `since` is 0 if not specified.
+// returns false if malformed
+inline bool parse_subs_payload(std::string_view payload, std::string_view &prefix, std::uint64_t &since) noexcept {
+    std::uint64_t size;
+    const auto hdr = decode_varint(payload.begin(), payload.end(), size);
+    if ( hdr == 0 || hdr > max_varint_size || payload.size() - hdr < size ) {
+        return false;
+    }
+
+    prefix = payload.substr(hdr, size);
+    payload.remove_prefix(hdr + size);
+    since = 0;
+    if ( !payload.empty() ) {
+        const auto len = decode_varint(payload.begin(), payload.end(), since);
+        if ( len != payload.size() ) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// converts the DACK frame into the DATA frame in place, returns the request id.
+// returns false if malformed
+inline bool dack_to_data_frame(string_buffer &buf, std::uint64_t &id) {
+    binary_frame frame;
+    if ( !parse_frame(buf.view(), frame) ) {
+        return false;
+    }
+
+    const auto len = decode_varint(frame.payload.begin(), frame.payload.end(), id);
+    if ( len == 0 || len > max_varint_size ) {
+        return false;
+    }
+
+    // the DATA's payload is what follows the id
+    const auto size = 1u + (frame.payload.size() - len);
+    char hdr[max_varint_size + 1];
+    auto *p = encode_varint(hdr, size);
+    *p++ = static_cast<char>(binary_cmd::data);
+
+    buf.consume(static_cast<std::size_t>(frame.payload.data() - buf.data()) + len);
+    buf.preppend(std::string_view{hdr, static_cast<std::size_t>(p - hdr)});
+
+    return true;
+}
+
+// the key-val pair can be represented in the text protocol
+inline bool is_text_representable(std::string_view key, std::string_view val) noexcept {
+    return key.find_first_of(" \n") == std::string_view::npos
+        && val.find('\n') == std::string_view::npos
+    ;
+}
+
+/**********************************************************************************************************************/
+
+inline shared_buffer make_binary_frame(buffers_pool &pool, binary_cmd cmd, std::string_view payload) {
+    const auto size = 1u + payload.size();
+    auto buf = make_sized_buffer(pool, varint_size(size) + size);
+    auto *beg = buf->prepare(varint_size(size) + size);
+    auto *p = encode_varint(beg, size);
+    *p++ = static_cast<char>(cmd);
+    std::memcpy(p, payload.data(), payload.size());
+    buf->commit(static_cast<std::size_t>(p - beg) + payload.size());
+
+    return buf;
+}
+
+inline shared_buffer make_binary_data(buffers_pool &pool, std::string_view key, std::string_view val) {
+    const auto size = 1u + varint_size(key.size()) + key.size() + val.size();
+    auto buf = make_sized_buffer(pool, varint_size(size) + size);
+    auto *beg = buf->prepare(varint_size(size) + size);
+    auto *p = encode_varint(beg, size);
+    *p++ = static_cast<char>(binary_cmd::data);
+    p = encode_varint(p, key.size());
+    std::memcpy(p, key.data(), key.size());
+    std::memcpy(p + key.size(), val.data(), val.size());
+    buf->commit(static_cast<std::size_t>(p - beg) + key.size() + val.size());
+
+    return buf;
+}
+
+inline shared_buffer make_text_data(buffers_pool &pool, std::string_view key, std::string_view val) {
+    auto buf = make_sized_buffer(pool, 5u + key.size() + 1u + val.size() + 1u);
+    buf->append(std::string_view{"DATA "});
+    buf->append(key);
+    buf->append(' ');
+    buf->append(val);
+    buf->append('\n');
+
+    return buf;
+}
+
+inline shared_buffer make_text_dele(buffers_pool &pool, std::string_view key) {
+    auto buf = make_sized_buffer(pool, 5u + key.size() + 1u);
+    buf->append(std::string_view{"DELE "});
+    buf->append(key);
+    buf->append('\n');
+
+    return buf;
+}
+
+// the result of the DACK request
+struct ack_result {
+    std::uint64_t id;
+    bool changed;
+};
+
+// "ACKS id:changed id:changed...\n"
+template<typename Container>
+shared_buffer make_text_acks(buffers_pool &pool, const Container &acks) {
+    auto buf = make_sized_buffer(pool, 4u + acks.size() * (1u + 20u + 2u) + 1u);
+    buf->append(std::string_view{"ACKS"});
+    for ( const auto &it: acks ) {
+        char str[1u + 20u + 2u];
+        str[0] = ' ';
+        auto *p = std::to_chars(str + 1, str + sizeof(str), it.id).ptr;
+        *p++ = ':';
+        *p++ = it.changed ? '1' : '0';
+        buf->append(std::string_view{str, static_cast<std::size_t>(p - str)});
+    }
+    buf->append('\n');
+
+    return buf;
+}
+
+template<typename Container>
+shared_buffer make_binary_acks(buffers_pool &pool, const Container &acks) {
+    std::size_t size = 1u;
+    for ( const auto &it: acks ) {
+        size += varint_size(it.id) + 1u;
+    }
+
+    auto buf = make_sized_buffer(pool, varint_size(size) + size);
+    auto *beg = buf->prepare(varint_size(size) + size);
+    auto *p = encode_varint(beg, size);
+    *p++ = static_cast<char>(binary_cmd::acks);
+    for ( const auto &it: acks ) {
+        p = encode_varint(p, it.id);
+        *p++ = static_cast<char>(it.changed);
+    }
+    buf->commit(static_cast<std::size_t>(p - beg));
+
+    return buf;
+}
+
+// "COMP method\n", or the COMP frame
+inline shared_buffer make_comp_reply(buffers_pool &pool, protocol proto, std::string_view method) {
+    if ( proto == protocol::binary ) {
+        return make_binary_frame(pool, binary_cmd::comp, method);
+    }
+
+    auto buf = make_sized_buffer(pool, 5u + method.size() + 1u);
+    buf->append(std::string_view{"COMP "});
+    buf->append(method);
+    buf->append('\n');
+
+    return buf;
+}
+
+// the frame of the varints only, used for REPL, RSEQ and SYND
+template<typename ...Ints>
+shared_buffer make_binary_varints(buffers_pool &pool, binary_cmd cmd, Ints ...ints) {
+    const auto size = 1u + (varint_size(ints) + ...);
+    auto buf = make_sized_buffer(pool, varint_size(size) + size);
+    auto *beg = buf->prepare(varint_size(size) + size);
+    auto *p = encode_varint(beg, size);
+    *p++ = static_cast<char>(cmd);
+    ((p = encode_varint(p, ints)), ...);
+    buf->commit(static_cast<std::size_t>(p - beg));
+
+    return buf;
+}
+
+// decodes the payload consisting of the varints only.
+// returns false if malformed
+template<typename ...Ints>
+bool parse_varints_payload(std::string_view payload, Ints &...ints) noexcept {
+    auto decode = [&payload](std::uint64_t &v) {
+        const auto len = decode_varint(payload.begin(), payload.end(), v);
+        if ( len == 0 || len > max_varint_size ) {
+            return false;
+        }
+        payload.remove_prefix(len);
+
+        return true;
+    };
+
+    return (decode(ints) && ...) && payload.empty();
+}
+
+/**********************************************************************************************************************/
+
+// the message serialized for both protocols, each one is built once and shared by all the recipients.
+// the encoding can be empty if the message can't be represented in the protocol.
+
+struct message {
+    shared_buffer text;
+    shared_buffer binary;
+    // the sequence number and the ms-time of the change for DATA and DELE, 0 for the rest
+    std::uint64_t seq = 0u;
+    std::uint64_t time = 0u;
+
+    const shared_buffer& get(protocol proto) const noexcept
+    { return proto == protocol::binary ? binary : text; }
+};
+
+// "STOP ms\n", tells the client to reconnect not earlier than after `ms` milliseconds
+inline message make_stop(buffers_pool &pool, std::uint64_t reconnect_ms) {
+    message msg;
+    msg.text = make_buffer(pool, "STOP " + std::to_string(reconnect_ms) + "\n");
+    msg.binary = make_binary_varints(pool, binary_cmd::stop, reconnect_ms);
+
+    return msg;
+}
+
+/**********************************************************************************************************************/
+
+#endif // __shared_state_server__protocol_hpp__included
@@ -0,0 +1,431 @@
+
+// ----------------------------------------------------------------------------
+//                              Apache License
+//                        Version 2.0, January 2004
+//                     http://www.apache.org/licenses/
+//
+// This file is part of shared-state-server(https://github.com/niXman/shared-state-server) project.
+//
+// This was a test task for implementing multithreaded Shared-State server using asio.
+//
+// Copyright (c) 2023 niXman (github dot nixman dog pm.me). All rights reserved.
+// ----------------------------------------------------------------------------
+
+#ifndef __shared_state_server__replica_hpp__included
+#define __shared_state_server__replica_hpp__included
+
+#include "utils.hpp"
+#include "string_buffer.hpp"
+#include "protocol.hpp"
+#include "state_storage.hpp"
+#include "session_manager.hpp"
+#include "admission.hpp"
+
+#include <boost/asio/steady_timer.hpp>
+
+#include <atomic>
+#include <charconv>
+#include <functional>
+#include <string>
+#include <string_view>
+
+/**********************************************************************************************************************/
+
+// follows the primary server: connects to it, switches to the binary protocol and sends REPL
+// with the point to resume from. the primary replies with REPL telling whether it's the delta
+// or the full sync, subscribes the replica to all the keys, and sends the sync and then the stream
+// of the changes, each preceded by RSEQ with its stamp. the changes are applied to the storage
+// in the order of their stamps and are broadcasted to the replica's own subscribers.
+// if the primary subscribes all the connections, it may start the full sync before REPL is received,
+// those messages have no RSEQ and are skipped.
+// the sync goes in the order of the keys and is interleaved with the stream, so the point to resume from
+// is advanced only after SYND telling the sync is over, before it the reconnect would skip the keys not synced yet.
+// on the full sync the replica drops its state and tells its clients to reconnect, so they resync.
+// on any error the replica reconnects after `reconnect_delay` MS, or after the time told by BUSY.
+// the upstream can be the primary or another replica, which serves REPL the same way,
+// so the replicas form the relays tree spreading the fan-out over the processes.
+// the stamps are kept as the primary made them, so the replica at any depth tracks the primary's
+// sequence and the lag is measured from the primary, and the epoch is the upstream's own,
+// so the upstream's resync resyncs its whole subtree.
+// on the hot restart the replica is stopped and its resume point is handed off with the state,
+// so the new process continues with the delta sync.
+
+struct replica_client {
+    // the max size of the received frame
+    static constexpr std::size_t max_frame_size = 1024u*1024u*64u;
+
+    replica_client(const replica_client &) = delete;
+    replica_client& operator= (const replica_client &) = delete;
+    replica_client(replica_client &&) = delete;
+    replica_client& operator= (replica_client &&) = delete;
+
+    replica_client(
+         ba::io_context &ioctx
+        ,std::string host
+        ,std::string port
+        ,state_storage &state
+        ,session_manager &smgr
+        ,admission_control &admission
+        ,buffers_pool &pool
+        ,std::size_t reconnect_delay
+        ,std::size_t reset_window)
+        :m_sock{ba::make_strand(ioctx)}
+        ,m_resolver{m_sock.get_executor()}
+        ,m_timer{m_sock.get_executor()}
+        ,m_host{std::move(host)}
+        ,m_port{std::move(port)}
+        ,m_state{state}
+        ,m_smgr{smgr}
+        ,m_admission{admission}
+        ,m_pool{pool}
+        ,m_reconnect_delay{reconnect_delay}
+        ,m_reset_window{reset_window}
+        ,m_error_cb{}
+        ,m_rbuf{}
+        ,m_since{}
+        ,m_sync_since{}
+        ,m_sync_seq{}
+        ,m_epoch{}
+        ,m_stamp_seq{}
+        ,m_stamp_time{}
+        ,m_connected{}
+        ,m_synced{}
+        ,m_lag{}
+        ,m_hops{}
+        ,m_resyncs{}
+        ,m_stopped{false}
+    {}
+
+    // must be called before start(): the replica resumes from the point got by stop(), in this process or another one
+    void resume(std::uint64_t since, std::uint64_t epoch) noexcept {
+        m_since = since;
+        m_epoch = epoch;
+    }
+
+    // ErrorCB's signature: void(error_handler_info)
+    // may be called again after stop(), when the hot restart failed
+    template<typename ErrorCB>
+    void start(ErrorCB error_cb) {
+        ba::post(
+             m_sock.get_executor()
+            ,[this, error_cb=std::move(error_cb)]
+             () mutable
+             {
+                m_stopped = false;
+                m_error_cb = std::move(error_cb);
+                connect();
+             }
+        );
+    }
+
+    // disconnects from the upstream and doesn't reconnect anymore.
+    // the changes received before are applied before the storage's operations started after the completion.
+    // CompletionToken's signature: void(std::uint64_t since, std::uint64_t epoch) - the point to resume from
+    template<typename CompletionToken>
+    auto stop(CompletionToken &&token) {
+        return ba::async_initiate<CompletionToken, void(std::uint64_t, std::uint64_t)>(
+             [this](auto handler) {
+                ba::post(
+                     m_sock.get_executor()
+                    ,[this, handler=std::move(handler)]
+                     () mutable
+                     {
+                        m_stopped = true;
+                        m_connected.store(false, std::memory_order_relaxed);
+                        m_synced.store(false, std::memory_order_relaxed);
+                        bs::error_code ec;
+                        m_sock.close(ec);
+                        m_timer.cancel(ec);
+                        m_resolver.cancel();
+                        complete_handler(m_sock.get_executor(), std::move(handler), m_since, m_epoch);
+                     }
+                );
+             }
+            ,token
+        );
+    }
+
+    // the functions below may be called from any thread
+
+    bool connected() const noexcept { return m_connected.load(std::memory_order_relaxed); }
+    // true when the sync from the upstream is over, and the state follows the upstream's one
+    bool synced() const noexcept { return m_synced.load(std::memory_order_relaxed); }
+    std::size_t reconnect_delay() const noexcept { return m_reconnect_delay; }
+    // the time in MS from the latest replicated change was applied by the primary till it was received
+    std::uint64_t lag() const noexcept { return m_lag.load(std::memory_order_relaxed); }
+    // the number of the hops between this replica and the primary, 0 before the first sync
+    std::uint64_t hops() const noexcept { return m_hops.load(std::memory_order_relaxed); }
+    // the number of the full syncs after the first one
+    std::uint64_t resyncs() const noexcept { return m_resyncs.load(std::memory_order_relaxed); }
+
+private:
+    void connect() {
+        m_resolver.async_resolve(
+             m_host
+            ,m_port
+            ,[this](const bs::error_code &ec, tcp::resolver::results_type results)
+             {
+                if ( ec ) {
+                    return on_error(MAKE_ERROR_INFO("replica: resolve", ec), m_reconnect_delay);
+                }
+
+                ba::async_connect(
+                     m_sock
+                    ,results
+                    ,[this](const bs::error_code &ec, const tcp::endpoint &)
+                     { on_connected(ec); }
+                );
+             }
+        );
+    }
+    void on_connected(const bs::error_code &ec) {
+        if ( ec ) {
+            return on_error(MAKE_ERROR_INFO("replica: connect", ec), m_reconnect_delay);
+        }
+
+        bs::error_code ignored;
+        m_sock.set_option(tcp::no_delay{true}, ignored);
+
+        // the frames can be sent right after the protocol's request.
+        // the changes of the same ms-time as the latest one can be not received yet
+        auto request = make_buffer(m_pool, "PROT bin\n");
+        auto repl = make_binary_varints(m_pool, binary_cmd::repl, m_since ? m_since - 1u : 0u, m_epoch);
+        request->append(repl->view());
+        auto *ptr = request.get();
+        ba::async_write(
+             m_sock
+            ,ba::buffer(ptr->data(), ptr->size())
+            // the error is reported by the read
+            ,[request=std::move(request)]
+             (const bs::error_code &, std::size_t)
+             {}
+        );
+
+        m_rbuf.clear();
+        m_sync_since = 0u;
+        read_line();
+    }
+
+    // the text lines are read until the reply to PROT
+    void read_line() {
+        ba::async_read_until(
+             m_sock
+            ,ba::dynamic_buffer(m_rbuf, max_frame_size)
+            ,'\n'
+            ,[this](const bs::error_code &ec, std::size_t rd)
+             {
+                if ( ec ) {
+                    return on_error(MAKE_ERROR_INFO("replica: read", ec), m_reconnect_delay);
+                }
+
+                const auto line = std::string_view{m_rbuf}.substr(0, rd);
+                if ( line.substr(0, 5) == "BUSY " ) {
+                    std::size_t ms = m_reconnect_delay;
+                    std::from_chars(line.data() + 5, line.data() + line.size(), ms);
+
+                    return on_error(MAKE_ERROR_INFO_2("replica", -1, "the primary is busy"), ms);
+                }
+
+                const bool switched = (line == "PROT bin\n");
+                m_rbuf.erase(0, rd);
+                if ( switched ) {
+                    m_connected.store(true, std::memory_order_relaxed);
+                    read_frame();
+                } else {
+                    read_line();
+                }
+             }
+        );
+    }
+    void read_frame() {
+        ba::async_read_until(
+             m_sock
+            ,ba::dynamic_buffer(m_rbuf, max_frame_size)
+            ,frame_match{}
+            ,[this](const bs::error_code &ec, std::size_t rd)
+             {
+                if ( ec ) {
+                    return on_error(MAKE_ERROR_INFO("replica: read", ec), m_reconnect_delay);
+                }
+
+                auto buf = make_sized_buffer(m_pool, rd);
+                buf->append(std::string_view{m_rbuf}.substr(0, rd));
+                m_rbuf.erase(0, rd);
+                on_frame(std::move(buf));
+             }
+        );
+    }
+
+    void on_frame(shared_buffer buf) {
+        binary_frame frame;
+        if ( !parse_frame(buf->view(), frame) ) {
+            return on_error(MAKE_ERROR_INFO_2("replica", -1, "wrong frame received!"), m_reconnect_delay);
+        }
+
+        // the stamp is used by the frame following it only
+        const auto seq = m_stamp_seq;
+        const auto time = m_stamp_time;
+        m_stamp_seq = 0u;
+        switch ( frame.cmd ) {
+            case binary_cmd::repl: {
+                std::uint64_t since, upstream_seq, epoch, hops;
+                if ( !parse_varints_payload(frame.payload, since, upstream_seq, epoch, hops) ) { break; }
+
+                m_hops.store(hops + 1u, std::memory_order_relaxed);
+                m_sync_seq = upstream_seq;
+
+                return on_repl(since, epoch);
+            }
+            case binary_cmd::synd: {
+                std::uint64_t upstream_seq;
+                if ( !parse_varints_payload(frame.payload, upstream_seq) ) { break; }
+                // the end of the sync started by the reply to this connection's REPL only
+                if ( upstream_seq != m_sync_seq ) { break; }
+
+                m_since = std::max(m_since, m_sync_since);
+                m_synced.store(true, std::memory_order_relaxed);
+
+                return read_frame();
+            }
+            case binary_cmd::rseq: {
+                if ( !parse_varints_payload(frame.payload, m_stamp_seq, m_stamp_time) ) { break; }
+
+                return read_frame();
+            }
+            case binary_cmd::data: {
+                std::string_view key, val;
+                if ( !parse_data_payload(frame.payload, key, val) ) { break; }
+                if ( seq ) {
+                    apply(key, val, std::move(buf), false, seq, time);
+                }
+
+                return read_frame();
+            }
+            case binary_cmd::dele: {
+                if ( seq ) {
+                    apply(frame.payload, frame.payload.substr(frame.payload.size()), std::move(buf), true, seq, time);
+                }
+
+                return read_frame();
+            }
+            case binary_cmd::stop: {
+                std::uint64_t ms;
+                if ( !parse_varints_payload(frame.payload, ms) ) { break; }
+
+                // the upstream is reset or not synced itself, and tells when to come back
+                return on_error(MAKE_ERROR_INFO_2("replica", -1, "the upstream asked to reconnect"), ms);
+            }
+            default: return read_frame();
+        }
+
+        on_error(MAKE_ERROR_INFO_2("replica", -1, "wrong frame received!"), m_reconnect_delay);
+    }
+
+    void on_repl(std::uint64_t since, std::uint64_t epoch) {
+        const bool full = (since == 0u);
+        const bool resync = full && m_epoch != 0u;
+        m_epoch = epoch;
+        if ( !resync ) {
+            return read_frame();
+        }
+
+        // the reading is continued when the old state is dropped
+        m_resyncs.fetch_add(1u, std::memory_order_relaxed);
+        m_since = 0u;
+        m_smgr.reset(
+             m_admission.reconnect_window(m_reset_window)
+            ,ba::bind_executor(
+                 m_sock.get_executor()
+                ,[this]() {
+                    m_state.reset(
+                        ba::bind_executor(
+                             m_sock.get_executor()
+                            ,[this]() { read_frame(); }
+                        )
+                    );
+                 }
+            )
+        );
+    }
+
+    void apply(
+         std::string_view key
+        ,std::string_view val
+        ,shared_buffer buf
+        ,bool deleted
+        ,std::uint64_t seq
+        ,std::uint64_t time)
+    {
+        const auto now = ms_time();
+        m_lag.store(now > time ? now - time : 0u, std::memory_order_relaxed);
+        auto &since = synced() ? m_since : m_sync_since;
+        since = std::max(since, time);
+
+        m_state.replicate(
+             key
+            ,val
+            ,std::move(buf)
+            ,deleted
+            ,seq
+            ,time
+            ,[this](message msg, std::string_view key)
+             { m_smgr.broadcast(std::move(msg), key, false, m_error_cb, session_handle{}); }
+        );
+    }
+
+    void on_error(const error_info &ei, std::size_t delay) {
+        if ( m_stopped ) {
+            return;
+        }
+        CALL_ERROR_HANDLER(m_error_cb, ei);
+
+        m_connected.store(false, std::memory_order_relaxed);
+        m_synced.store(false, std::memory_order_relaxed);
+        m_stamp_seq = 0u;
+        bs::error_code ec;
+        m_sock.close(ec);
+
+        m_timer.expires_after(std::chrono::milliseconds{delay});
+        m_timer.async_wait(
+            [this](const bs::error_code &ec)
+            { if ( !ec ) connect(); }
+        );
+    }
+
+private:
+    tcp::socket m_sock;
+    tcp::resolver m_resolver;
+    ba::steady_timer m_timer;
+    const std::string m_host;
+    const std::string m_port;
+    state_storage &m_state;
+    session_manager &m_smgr;
+    admission_control &m_admission;
+    buffers_pool &m_pool;
+    const std::size_t m_reconnect_delay;
+    // the clients' reconnects are spread over it on the resync
+    const std::size_t m_reset_window;
+    std::function<void(const error_info &)> m_error_cb;
+    std::string m_rbuf;
+    // the ms-time of the latest received change, the next connection resumes from it
+    std::uint64_t m_since;
+    // the same for the changes received during the sync, becomes the `m_since` by SYND
+    std::uint64_t m_sync_since;
+    // the upstream's sequence number the sync was started at, as told by REPL and SYND
+    std::uint64_t m_sync_seq;
+    // the upstream's epoch the replica's state belongs to, 0 before the first sync
+    std::uint64_t m_epoch;
+    // the RSEQ's stamp for the next frame, 0 if there was no RSEQ
+    std::uint64_t m_stamp_seq;
+    std::uint64_t m_stamp_time;
+    std::atomic_bool m_connected;
+    std::atomic_bool m_synced;
+    std::atomic_uint64_t m_lag;
+    std::atomic_uint64_t m_hops;
+    std::atomic_uint64_t m_resyncs;
+    bool m_stopped;
+};
+
+/**********************************************************************************************************************/
+
+#endif // __shared_state_server__replica_hpp__included
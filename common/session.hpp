@@ -15,37 +15,240 @@
 #define __shared_state_server__session_hpp__included
 
 #include "utils.hpp"
-#include "intrusive_base.hpp"
-#include "intrusive_ptr.hpp"
-#include "object_pool.hpp"
 #include "string_buffer.hpp"
+#include "protocol.hpp"
+#include "compression.hpp"
+#include "metrics.hpp"
 
 #include <boost/intrusive/list_hook.hpp>
 
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <unistd.h>
+
+/**********************************************************************************************************************/
+
+struct session_manager;
+
+// the index of the session's slot in the session_table and the slot's generation at the time
+// the session was created. the generation is bumped when the session is destroyed,
+// so the stale handles are detected on use instead of keeping the session alive.
+struct session_handle {
+    std::uint32_t index = std::numeric_limits<std::uint32_t>::max();
+    std::uint32_t generation = 0u;
+
+    friend bool operator== (const session_handle &l, const session_handle &r) noexcept
+    { return l.index == r.index && l.generation == r.generation; }
+    friend bool operator!= (const session_handle &l, const session_handle &r) noexcept
+    { return !(l == r); }
+};
+
 /**********************************************************************************************************************/
 
-struct session: boost::intrusive::list_base_hook<>, intrusive_base<session> {
-    using session_ptr = intrusive_ptr<session>;
+// the session moved to another process by the hot restart, see session::detach() and handoff.hpp
+struct detached_session {
+    // the duplicate of the socket's descriptor, -1 if the session was not moved
+    int fd = -1;
+    protocol read_protocol = protocol::text;
+    protocol write_protocol = protocol::text;
+    bool replica = false;
+    // the number of the received lines/frames
+    std::size_t readed = 0u;
+    // the received bytes not processed yet
+    std::string unread;
+    // filled by the session_manager
+    std::vector<std::string> prefixes;
+    bool batched = false;
+};
+
+/**********************************************************************************************************************/
 
-    session(tcp::socket sock, std::size_t max_size, std::size_t inactivity_time, buffers_pool &pool)
+// the session is owned by its strand: the pending async operations are counted there,
+// and when the session is stopped and the last of them is completed, the session is unlinked
+// from the session_manager and then destroyed on its strand.
+// the completion handlers capture the raw `this`, and the functions posted to the strand
+// are called only if the session's generation is not changed.
+
+struct session: boost::intrusive::list_base_hook<> {
+    friend struct session_manager;
+
+    // the read buffer's capacity above this is released after a long line was processed
+    static constexpr std::size_t max_idle_read_capacity = 4096u;
+    // the lines are read into the chunks of this size, so the chunk fits into the 4 KiB pool's block
+    static constexpr std::size_t read_chunk_size = chunk_capacity(max_idle_read_capacity);
+    // the max number of the queued messages written at once
+    static constexpr std::size_t max_gather = 64u;
+
+    session(
+         stream_socket sock
+        ,std::size_t max_size
+        ,std::size_t inactivity_time
+        ,buffers_pool &pool
+        ,metrics &mtr
+        ,session_manager &smgr
+        ,session_handle handle
+        ,const std::atomic_uint32_t &generation)
         :m_sock{std::move(sock)}
-        ,m_inactivity_timer{m_sock.get_executor(), std::chrono::milliseconds{m_inactivity_time}}
+        ,m_inactivity_timer{m_sock.get_executor(), std::chrono::milliseconds{inactivity_time}}
         ,m_on_stop{false}
         ,m_max_size{max_size}
         ,m_inactivity_time{inactivity_time}
         ,m_pool{pool}
-    { m_sock.set_option(tcp::no_delay{true}); }
-    virtual ~session() = default;
+        ,m_metrics{mtr}
+        ,m_smgr{smgr}
+        ,m_handle{handle}
+        ,m_generation{generation}
+        ,m_pending{}
+        ,m_readed{}
+        ,m_read_protocol{protocol::text}
+        ,m_write_protocol{protocol::text}
+        ,m_replica{false}
+        ,m_acks{}
+        ,m_writes{}
+        ,m_writing{}
+        ,m_gather{}
+        ,m_deflater{}
+        ,m_compressed{}
+        ,m_prefixes{}
+        ,m_bcast_mark{}
+        ,m_batch_hook{}
+        ,m_batch{}
+        ,m_batch_protocol{protocol::text}
+        ,m_paused{false}
+        ,m_reading{false}
+        ,m_moved{false}
+        ,m_drain_timer{false}
+        ,m_detach_cb{}
+        ,m_unread{}
+    {}
+
+    session_handle handle() const noexcept { return m_handle; }
+
+    // must be called on the session's strand.
+    // the protocol of the messages being received and sent
+    protocol read_protocol() const noexcept { return m_read_protocol; }
+    protocol write_protocol() const noexcept { return m_write_protocol; }
+
+    // must be called on the session's strand, from ReadedCB called for the first received line.
+    // the next read uses the new protocol immediately, and the messages sent after `reply` use it too.
+    // ErrorCB's signature: void(error_handler_info)
+    // returns false if it's not the first line
+    template<typename ErrorCB>
+    bool switch_protocol(protocol proto, shared_buffer reply, ErrorCB error_cb) {
+        if ( m_readed != 1 ) {
+            return false;
+        }
+
+        m_read_protocol = proto;
+        post([this, proto, reply=std::move(reply), error_cb=std::move(error_cb)]
+             () mutable
+             {
+                send_impl([](bool){}, std::move(error_cb), std::move(reply), false);
+                m_write_protocol = proto;
+             }
+        );
+
+        return true;
+    }
+
+    // must be called on the session's strand.
+    // the messages sent after this in the binary protocol are preceded by the RSEQ frame
+    // carrying their stamp, if they have one
+    void set_replica() noexcept { m_replica = true; }
+
+    // must be called on the session's strand.
+    // replies with COMP in the session's protocol, and the messages queued after the reply
+    // are compressed with the deflate stream of the specified level, or are not if the level is 0.
+    // the messages queued before, even if not written yet, are sent as they are.
+    template<typename ErrorCB>
+    void enable_compression(int level, ErrorCB error_cb) {
+        post([this, level, error_cb=std::move(error_cb)]
+             () mutable
+             {
+                const auto *method = (level || m_deflater) ? "zlib" : "none";
+                auto reply = make_comp_reply(m_pool, m_write_protocol, method);
+                send_impl([](bool){}, std::move(error_cb), std::move(reply), false);
+                if ( level && !m_deflater ) {
+                    m_deflater = std::make_unique<deflate_stream>(level);
+                }
+             }
+        );
+    }
 
-    // may be called from any thread
-    // ReadedCB's signature: bool(shared_buf, holder_ptr)
+    // must be called on the session's strand.
+    // returns the callback with the signature void(bool changed), which must be called once,
+    // from any thread, with the result of the request. the session is kept alive until then.
+    // the results got while the previous ones are not sent yet are sent together as one ACKS message.
     // ErrorCB's signature: void(error_handler_info)
-    template<typename ReadedCB, typename ErrorCB>
-    void start(ReadedCB readed_cb, ErrorCB error_cb, session_ptr holder = {}) {
-        auto lambda = [this, readed_cb=std::move(readed_cb)
-            ,error_cb=std::move(error_cb), holder=std::move(holder)]
+    template<typename ErrorCB>
+    auto make_ack(std::uint64_t id, ErrorCB error_cb) {
+        op_started();
+
+        return [this, id, error_cb=std::move(error_cb)]
+        (bool changed) mutable {
+            ba::post(
+                 m_sock.get_executor()
+                ,[this, id, changed, error_cb=std::move(error_cb)]
+                 () mutable
+                 {
+                    push_ack(ack_result{id, changed}, std::move(error_cb));
+                    op_completed();
+                 }
+            );
+        };
+    }
+
+    // must be called on the session's strand.
+    // returns the callback which must be called once, from any thread, and posts `f` with its args
+    // to the session's strand. the session is kept alive until then, and `f` is not called if it was stopped.
+    // the stopped session may be finished already, so the callback returned for it does nothing.
+    // F's signature: void(Args...)
+    template<typename F>
+    auto make_handler(F f) {
+        const bool active = !m_on_stop;
+        if ( active ) {
+            op_started();
+        }
+
+        return [this, active, f=std::move(f)]
+        (auto ...args) mutable {
+            if ( !active ) {
+                return;
+            }
+
+            ba::post(
+                 m_sock.get_executor()
+                ,[this, f=std::move(f), args=std::make_tuple(std::move(args)...)]
+                 () mutable
+                 {
+                    if ( !m_on_stop ) {
+                        std::apply(f, std::move(args));
+                    }
+                    op_completed();
+                 }
+            );
+        };
+    }
+
+    // the functions below may be called from any thread while the session is alive:
+    // on its strand, on the session manager strand while the session is registered there,
+    // or from the init callback of session_manager::create().
+
+    // F's signature: void()
+    // F is called on the session's strand, or is not called if the session is destroyed
+    template<typename F>
+    void post(F f) {
+        auto lambda = [f=std::move(f), generation=std::addressof(m_generation), expected=m_handle.generation]
         () mutable
-        { start_impl(std::move(readed_cb), std::move(error_cb), make_buffer(m_pool), std::move(holder)); };
+        { if ( generation->load(std::memory_order_acquire) == expected ) { f(); } };
 
         ba::post(
              m_sock.get_executor()
@@ -53,26 +256,166 @@ struct session: boost::intrusive::list_base_hook<>, intrusive_base<session> {
         );
     }
 
-    auto stop() {
-        return ba::post(
-             m_sock.get_executor()
-            ,ba::use_future([this](){ stop_impl(); })
+    // ReadedCB's signature: bool(shared_buf, session &)
+    // ErrorCB's signature: void(error_handler_info)
+    template<typename ReadedCB, typename ErrorCB>
+    void start(ReadedCB readed_cb, ErrorCB error_cb) {
+        post([this, readed_cb=std::move(readed_cb), error_cb=std::move(error_cb)]
+             () mutable
+             { start_impl(std::move(readed_cb), std::move(error_cb), make_sized_buffer(m_pool, read_chunk_size)); }
+        );
+    }
+
+    // the same as start(), for the session moved from another process by the hot restart:
+    // the protocols and the counters are restored, and the bytes not processed there are read first
+    template<typename ReadedCB, typename ErrorCB>
+    void resume(const detached_session &state, ReadedCB readed_cb, ErrorCB error_cb) {
+        auto buf = make_sized_buffer(m_pool, std::max(read_chunk_size, state.unread.size()));
+        buf->append(state.unread);
+        post([this, read_protocol=state.read_protocol, write_protocol=state.write_protocol
+             ,replica=state.replica, readed=state.readed
+             ,readed_cb=std::move(readed_cb), error_cb=std::move(error_cb), buf=std::move(buf)]
+             () mutable
+             {
+                m_read_protocol = read_protocol;
+                m_write_protocol = write_protocol;
+                m_replica = replica;
+                m_readed = readed;
+                start_impl(std::move(readed_cb), std::move(error_cb), std::move(buf));
+             }
+        );
+    }
+
+    void stop() {
+        post([this](){ stop_impl(); });
+    }
+
+    // the first step of moving the session to another process by the hot restart:
+    // the received lines are not processed anymore, they are kept along with the bytes received after them.
+    // F's signature: void()
+    // F is called on the session's strand, or is not called if the session is destroyed
+    template<typename F>
+    void pause(F f) {
+        post([this, f=std::move(f)]
+             () mutable
+             {
+                m_paused = true;
+                f();
+             }
+        );
+    }
+
+    // must be called after pause().
+    // the queued messages are written, and when nothing but the read is pending, the read is cancelled
+    // and the session's state with the duplicate of its socket's descriptor is passed to `cb`.
+    // then the session is closed without shutting the connection down, which is continued by the other process.
+    // the compressed session can't be moved because its deflate stream can't, so it's told to reconnect by STOP.
+    // the session not drained in `timeout` MS is closed, so its client reconnects too.
+    // CB's signature: void(detached_session), the descriptor is -1 if the session was not moved
+    // CB is called on the session's strand, or is not called if the session is destroyed
+    template<typename CB>
+    void detach(std::size_t timeout, CB cb) {
+        post([this, timeout, cb=std::move(cb)]
+             () mutable
+             {
+                if ( m_on_stop ) { return; }
+
+                m_detach_cb = std::move(cb);
+                // the inactivity timer's wait is replaced by the drain's one
+                m_inactivity_time = 0;
+                m_inactivity_timer.expires_after(std::chrono::milliseconds{timeout});
+                m_drain_timer = true;
+                op_started();
+                m_inactivity_timer.async_wait(
+                    [this]
+                    (const bs::error_code &ec)
+                    {
+                        m_drain_timer = false;
+                        if ( !ec && m_detach_cb ) {
+                            finish_detach(detached_session{});
+                        }
+                        op_completed();
+                    }
+                );
+
+                if ( m_deflater ) {
+                    send_impl(
+                         [this](bool){ if ( m_detach_cb ) finish_detach(detached_session{}); }
+                        ,[](const error_info &){}
+                        ,make_stop(m_pool, 0u).get(m_write_protocol)
+                        ,true
+                    );
+                } else {
+                    try_detach();
+                }
+             }
         );
     }
 
-    // may be called from any thread
-    // SentCB's signature: void(bool) - true, if the message was sent successfully
+    // SentCB's signature: void(bool) - true, if the message was sent successfully.
+    //     it's called on the session's strand, so it may use the session.
     // ErrorCB's signature: void(error_handler_info)
     template<typename SentCB, typename ErrorCB>
-    void send(SentCB sent_cb, ErrorCB error_cb, shared_buffer msg, bool disconnect, session_ptr holder) {
-        auto lambda = [this, sent_cb=std::move(sent_cb), error_cb=std::move(error_cb)
-            ,msg=std::move(msg), disconnect, holder=std::move(holder)]
-        () mutable
-        { send_impl(std::move(sent_cb), std::move(error_cb), std::move(msg), disconnect, std::move(holder)); };
+    void send(SentCB sent_cb, ErrorCB error_cb, shared_buffer msg, bool disconnect) {
+        post([this, sent_cb=std::move(sent_cb), error_cb=std::move(error_cb), msg=std::move(msg), disconnect]
+             () mutable
+             { send_impl(std::move(sent_cb), std::move(error_cb), std::move(msg), disconnect); }
+        );
+    }
 
-        ba::post(
-             m_sock.get_executor()
-            ,std::move(lambda)
+    // the encoding is chosen by the session's protocol at the time the message is being sent.
+    // the message not representable in the protocol is skipped, as if it was sent.
+    template<typename SentCB, typename ErrorCB>
+    void send(SentCB sent_cb, ErrorCB error_cb, message msg, bool disconnect) {
+        post([this, sent_cb=std::move(sent_cb), error_cb=std::move(error_cb), msg=std::move(msg), disconnect]
+             () mutable
+             {
+                if ( auto &buf = msg.get(m_write_protocol); buf ) {
+                    if ( auto rseq = make_rseq(msg); rseq ) {
+                        send_impl([](bool){}, error_cb, std::move(rseq), false);
+                    }
+                    send_impl(std::move(sent_cb), std::move(error_cb), std::move(buf), disconnect);
+                } else {
+                    sent_cb(true);
+                }
+             }
+        );
+    }
+
+    // the messages are queued at once, so they are written (and compressed) together.
+    // `sent_cb` is called when the last of them is sent
+    template<typename SentCB, typename ErrorCB>
+    void send(SentCB sent_cb, ErrorCB error_cb, std::vector<message> msgs) {
+        post([this, sent_cb=std::move(sent_cb), error_cb=std::move(error_cb), msgs=std::move(msgs)]
+             () mutable
+             {
+                if ( m_on_stop ) {
+                    sent_cb(false);
+
+                    return;
+                }
+
+                const auto queued = m_writes.size();
+                for ( auto &it: msgs ) {
+                    if ( auto &buf = it.get(m_write_protocol); buf ) {
+                        if ( auto rseq = make_rseq(it); rseq ) {
+                            m_writes.push_back(pending_write{std::move(rseq), [](bool){}, false, compressing()});
+                        }
+                        m_writes.push_back(pending_write{std::move(buf), [](bool){}, false, compressing()});
+                    }
+                }
+                if ( queued == m_writes.size() ) {
+                    sent_cb(true);
+
+                    return;
+                }
+                m_metrics.add(counter::writes_queued, m_writes.size() - queued);
+
+                m_writes.back().sent_cb = std::move(sent_cb);
+                if ( m_writing == 0 ) {
+                    start_write(std::move(error_cb));
+                }
+             }
         );
     }
 
@@ -80,32 +423,183 @@ struct session: boost::intrusive::list_base_hook<>, intrusive_base<session> {
     auto endpoint() const { return m_sock.remote_endpoint(); }
 
 private:
+    // the messages queued while it's true are compressed
+    bool compressing() const noexcept { return m_deflater != nullptr; }
+
+    // the RSEQ frame preceding the message sent to the replica, or null if not needed
+    shared_buffer make_rseq(const message &msg) {
+        if ( !m_replica || !msg.seq || m_write_protocol != protocol::binary ) {
+            return {};
+        }
+
+        return make_binary_varints(m_pool, binary_cmd::rseq, msg.seq, msg.time);
+    }
+
+    // the completion handlers call `op_completed()` last
+    void op_started() noexcept { ++m_pending; }
+    void op_completed() {
+        if ( --m_pending == 0 && m_on_stop ) {
+            finish();
+        } else if ( m_detach_cb ) {
+            try_detach();
+        }
+    }
+
+    // the session is detached when only the read and the drain's timer are pending.
+    // the read is cancelled first, and the bytes it got are kept by on_readed()
+    void try_detach() {
+        if ( m_on_stop || m_deflater || !m_writes.empty() ) {
+            return;
+        }
+        if ( m_pending != std::size_t{m_reading} + std::size_t{m_drain_timer} ) {
+            return;
+        }
+        if ( m_reading ) {
+            bs::error_code ec;
+            m_sock.cancel(ec);
+
+            return;
+        }
+
+        detached_session state;
+        state.fd = ::dup(m_sock.native_handle());
+        state.read_protocol = m_read_protocol;
+        state.write_protocol = m_write_protocol;
+        state.replica = m_replica;
+        state.readed = m_readed;
+        if ( m_unread ) {
+            state.unread = std::string{m_unread->view()};
+            m_unread = {};
+        }
+        m_moved = (state.fd != -1);
+        finish_detach(std::move(state));
+    }
+    void finish_detach(detached_session state) {
+        auto cb = std::move(m_detach_cb);
+        m_detach_cb = nullptr;
+        stop_impl();
+        cb(std::move(state));
+    }
+    // defined in session_manager.hpp
+    void finish();
+
+    template<typename ErrorCB>
+    void push_ack(ack_result ack, ErrorCB error_cb) {
+        m_acks.push_back(ack);
+        if ( m_acks.size() > 1 ) {
+            return;
+        }
+
+        op_started();
+        ba::post(
+             m_sock.get_executor()
+            ,[this, error_cb=std::move(error_cb)]
+             () mutable
+             {
+                auto buf = (m_write_protocol == protocol::binary)
+                    ? make_binary_acks(m_pool, m_acks)
+                    : make_text_acks(m_pool, m_acks)
+                ;
+                m_acks.clear();
+                send_impl([](bool){}, std::move(error_cb), std::move(buf), false);
+                op_completed();
+             }
+        );
+    }
+
+    // the messages are queued and written in the order of the calls, so the partially written message
+    // is never interleaved with the next one. the messages queued while the previous write is in progress
+    // are written together, and are compressed with one flush.
     template<typename SentCB, typename ErrorCB>
-    void send_impl(SentCB sent_cb, ErrorCB error_cb, shared_buffer msg, bool disconnect, session_ptr holder) {
-        auto *str = msg.get();
-        auto lambda = [this, sent_cb=std::move(sent_cb), error_cb=std::move(error_cb)
-            ,msg=std::move(msg), disconnect, holder=std::move(holder)]
-        (const bs::error_code &ec, std::size_t) mutable {
-            if ( !m_on_stop && ec ) {
-                CALL_ERROR_HANDLER(error_cb, MAKE_ERROR_INFO("session", ec));
+    void send_impl(SentCB sent_cb, ErrorCB error_cb, shared_buffer msg, bool disconnect) {
+        if ( m_on_stop ) {
+            sent_cb(false);
 
-                sent_cb(false);
+            return;
+        }
 
-                return;
+        m_writes.push_back(pending_write{std::move(msg), std::move(sent_cb), disconnect, compressing()});
+        m_metrics.add(counter::writes_queued);
+        if ( m_writing == 0 ) {
+            start_write(std::move(error_cb));
+        }
+    }
+    template<typename ErrorCB>
+    void start_write(ErrorCB error_cb) {
+        m_writing = std::min(m_writes.size(), max_gather);
+        // nothing is written after the disconnecting message,
+        // and the messages queued before and after enabling the compression are not written together
+        const bool compress = m_writes.front().compress;
+        for ( std::size_t idx = 0; idx < m_writing; ++idx ) {
+            if ( m_writes[idx].compress != compress ) {
+                m_writing = idx;
+            } else if ( m_writes[idx].disconnect ) {
+                m_writing = idx + 1;
             }
+        }
 
-            sent_cb(true);
+        m_gather.clear();
+        if ( compress ) {
+            std::size_t size = 0;
+            for ( std::size_t idx = 0; idx < m_writing; ++idx ) {
+                size += m_writes[idx].buf->size();
+            }
 
-            if ( disconnect ) {
-                stop();
+            m_compressed = make_sized_buffer(m_pool, size / 2u + 64u);
+            for ( std::size_t idx = 0; idx < m_writing; ++idx ) {
+                m_deflater->compress(m_writes[idx].buf->view(), *m_compressed, idx + 1 == m_writing);
             }
+            m_gather.push_back(m_compressed->buffer());
+        } else {
+            for ( std::size_t idx = 0; idx < m_writing; ++idx ) {
+                m_gather.push_back(m_writes[idx].buf->buffer());
+            }
+        }
+
+        auto lambda = [this, error_cb=std::move(error_cb)]
+        (const bs::error_code &ec, std::size_t wr) mutable {
+            m_compressed = {};
+            m_metrics.add(counter::bytes_out, wr);
+            m_metrics.add(counter::writes_done, m_writing);
+
+            bool disconnect = false;
+            for ( ; m_writing; --m_writing ) {
+                auto write = std::move(m_writes.front());
+                m_writes.pop_front();
+                write.sent_cb(!ec);
+                disconnect = disconnect || write.disconnect;
+            }
+
+            if ( ec ) {
+                if ( !m_on_stop ) {
+                    CALL_ERROR_HANDLER(error_cb, MAKE_ERROR_INFO("session", ec));
+                }
+
+                cancel_writes();
+            } else if ( disconnect ) {
+                stop_impl();
+                cancel_writes();
+            } else if ( !m_writes.empty() ) {
+                start_write(std::move(error_cb));
+            }
+
+            op_completed();
         };
 
-        ba::async_write(
-             m_sock
-            ,ba::buffer(str->string())
-            ,std::move(lambda)
-        );
+        op_started();
+        if ( m_gather.size() == 1 ) {
+            ba::async_write(m_sock, m_gather.front(), std::move(lambda));
+        } else {
+            ba::async_write(m_sock, m_gather, std::move(lambda));
+        }
+    }
+    void cancel_writes() {
+        m_metrics.add(counter::writes_done, m_writes.size());
+        while ( !m_writes.empty() ) {
+            auto write = std::move(m_writes.front());
+            m_writes.pop_front();
+            write.sent_cb(false);
+        }
     }
 
     void stop_impl() {
@@ -113,46 +607,72 @@ private:
 
         m_on_stop = true;
         bs::error_code ec;
-        m_sock.shutdown(tcp::socket::shutdown_both, ec);
-        ec = bs::error_code{};
+        // the moved connection is continued by the other process
+        if ( !m_moved ) {
+            m_sock.shutdown(stream_socket::shutdown_both, ec);
+            ec = bs::error_code{};
+        }
         m_sock.close(ec);
         ec = bs::error_code{};
         m_inactivity_timer.cancel(ec);
+
+        if ( m_pending == 0 ) {
+            finish();
+        }
     }
 
-    void start_inactivity_timer(session_ptr holder) {
+    void start_inactivity_timer() {
+        op_started();
         m_inactivity_timer.async_wait(
-            [this, holder=std::move(holder)]
-            (bs::error_code ec) mutable
-            { on_inactivity_timer_timeout(ec); }
+            [this]
+            (bs::error_code ec)
+            {
+                on_inactivity_timer_timeout(ec);
+                op_completed();
+            }
         );
     }
     void on_inactivity_timer_timeout(bs::error_code ec) {
         if ( ec == boost::asio::error::operation_aborted ) { return; }
 
-        stop();
+        stop_impl();
     }
 
     template<typename ReadedCB, typename ErrorCB>
-    void start_impl(ReadedCB readed_cb, ErrorCB error_cb, shared_buffer buf, session_ptr holder) {
-        if ( m_inactivity_time ) { start_inactivity_timer(holder); }
+    void start_impl(ReadedCB readed_cb, ErrorCB error_cb, shared_buffer buf) {
+        if ( m_on_stop ) { return; }
+
+        if ( m_inactivity_time ) { start_inactivity_timer(); }
 
-        start_read(std::move(readed_cb), std::move(error_cb), std::move(buf), std::move(holder));
+        start_read(std::move(readed_cb), std::move(error_cb), std::move(buf));
     }
     template<typename ReadedCB, typename ErrorCB>
-    void start_read(ReadedCB readed_cb, ErrorCB error_cb, shared_buffer buf, session_ptr holder) {
+    void start_read(ReadedCB readed_cb, ErrorCB error_cb, shared_buffer buf) {
         auto *ptr = buf.get();
-        auto lambda = [this, readed_cb=std::move(readed_cb), error_cb=std::move(error_cb)
-            ,buf=std::move(buf), holder=std::move(holder)]
+        auto lambda = [this, readed_cb=std::move(readed_cb), error_cb=std::move(error_cb), buf=std::move(buf)]
         (const bs::error_code& ec, std::size_t rd) mutable
-        { on_readed(std::move(readed_cb), std::move(error_cb), std::move(buf), ec, rd, std::move(holder)); };
+        {
+            on_readed(std::move(readed_cb), std::move(error_cb), std::move(buf), ec, rd);
+            op_completed();
+        };
 
-        ba::async_read_until(
-             m_sock
-            ,ba::dynamic_buffer(ptr->string(), m_max_size)
-            ,'\n'
-            ,std::move(lambda)
-        );
+        op_started();
+        m_reading = true;
+        if ( m_read_protocol == protocol::binary ) {
+            ba::async_read_until(
+                 m_sock
+                ,ptr->dynamic_buffer(m_max_size)
+                ,frame_match{}
+                ,std::move(lambda)
+            );
+        } else {
+            ba::async_read_until(
+                 m_sock
+                ,ptr->dynamic_buffer(m_max_size)
+                ,'\n'
+                ,std::move(lambda)
+            );
+        }
     }
     template<typename ReadedCB, typename ErrorCB>
     void on_readed(
@@ -160,47 +680,102 @@ private:
         ,ErrorCB error_cb
         ,shared_buffer buf
         ,bs::error_code ec
-        ,std::size_t rd
-        ,session_ptr holder)
+        ,std::size_t rd)
     {
-        if ( !m_on_stop && ec ) {
-            CALL_ERROR_HANDLER(error_cb, MAKE_ERROR_INFO("session", ec));
+        m_reading = false;
+        // the paused session keeps everything it got, the read cancelled by detach() included
+        if ( m_paused && !m_on_stop && (!ec || ec == ba::error::operation_aborted) ) {
+            m_unread = std::move(buf);
 
             return;
         }
+        if ( ec ) {
+            if ( !m_on_stop ) {
+                CALL_ERROR_HANDLER(error_cb, MAKE_ERROR_INFO("session", ec));
+            }
+            stop_impl();
+
+            return;
+        }
+        m_metrics.add(counter::bytes_in, rd);
 
         if ( m_inactivity_time ) {
             if ( m_inactivity_timer.expires_after(std::chrono::milliseconds{m_inactivity_time}) > 0 ) {
-                start_inactivity_timer(holder);
+                start_inactivity_timer();
             } else {
                 ec = ba::error::timed_out;
                 CALL_ERROR_HANDLER(error_cb, MAKE_ERROR_INFO("session", ec));
+                stop_impl();
 
                 return;
             }
         }
 
-        auto str = make_buffer(m_pool, buf->data(), buf->data() + rd);
-        buf->erase(0, rd);
+        // the line references the read chunk without copying
+        auto str = make_slice(m_pool, buf, 0, rd);
+        ++m_readed;
+        buf->consume(rd);
+        buf->shrink(max_idle_read_capacity);
 
-        if ( readed_cb(std::move(str), holder) ) {
-            start_read(std::move(readed_cb), std::move(error_cb), std::move(buf), std::move(holder));
+        if ( readed_cb(std::move(str), *this) ) {
+            start_read(std::move(readed_cb), std::move(error_cb), std::move(buf));
         } else {
-            m_inactivity_timer.cancel();
+            stop_impl();
         }
     }
 
 private:
-    tcp::socket m_sock;
+    stream_socket m_sock;
     ba::steady_timer m_inactivity_timer;
     bool m_on_stop;
     std::size_t m_max_size;
     std::size_t m_inactivity_time;
     buffers_pool &m_pool;
+    metrics &m_metrics;
+    session_manager &m_smgr;
+    const session_handle m_handle;
+    const std::atomic_uint32_t &m_generation;
+    // the number of the pending async operations, accessed only on the session's strand
+    std::size_t m_pending;
+    // the number of the received lines/frames
+    std::size_t m_readed;
+    protocol m_read_protocol;
+    protocol m_write_protocol;
+    bool m_replica;
+    // the DACK's results not sent yet
+    std::vector<ack_result> m_acks;
+    struct pending_write {
+        shared_buffer buf;
+        std::function<void(bool)> sent_cb;
+        bool disconnect;
+        // the compression was enabled when it was queued
+        bool compress;
+    };
+    // the first `m_writing` ones are being written
+    std::deque<pending_write> m_writes;
+    std::size_t m_writing;
+    std::vector<ba::const_buffer> m_gather;
+    // compresses the sent messages if enabled
+    std::unique_ptr<deflate_stream> m_deflater;
+    // the compressed messages being written
+    shared_buffer m_compressed;
+
+    // owned by the session_manager and accessed only on its strand
+    std::vector<std::string> m_prefixes;
+    std::uint64_t m_bcast_mark;
+    boost::intrusive::list_member_hook<> m_batch_hook;
+    shared_buffer m_batch;
+    protocol m_batch_protocol;
+
+    // the hot restart's state, see detach()
+    bool m_paused;
+    bool m_reading;
+    bool m_moved;
+    bool m_drain_timer;
+    std::function<void(detached_session)> m_detach_cb;
+    shared_buffer m_unread;
 };
 
-using sessions_pool = object_pool<session>;
-
 /**********************************************************************************************************************/
 
 #endif // __shared_state_server__session_hpp__included
@@ -17,14 +17,24 @@
 #include "utils.hpp"
 #include "string_buffer.hpp"
 #include "session.hpp"
+#include "session_table.hpp"
+#include "prefix_trie.hpp"
+#include "metrics.hpp"
+#include "shm_ring.hpp"
 
 #include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/intrusive/list.hpp>
 
+#include <functional>
+#include <memory>
+#include <random>
+#include <vector>
+
 /**********************************************************************************************************************/
 
 struct session_manager {
-    using session_ptr = session::session_ptr;
+    friend struct session;
 
     session_manager(const session_manager &) = delete;
     session_manager& operator= (const session_manager &) = delete;
@@ -35,93 +45,509 @@ struct session_manager {
          ba::io_context &ioctx
         ,std::size_t max_size
         ,std::size_t inactivity_time
-        ,sessions_pool &ses_pool
+        ,session_table &ses_table
         ,buffers_pool &str_pool
+        ,metrics &mtr
+        ,shm_ring_writer *ring
+        ,bool subscribe_all
+        ,std::size_t batch_interval
+        ,std::size_t batch_bytes
+        ,std::function<void(const error_info &)> error_cb
     )
         :m_strand{ioctx}
         ,m_max_size{max_size}
         ,m_inactivity_time{inactivity_time}
-        ,m_ses_pool{ses_pool}
+        ,m_ses_table{ses_table}
         ,m_str_pool{str_pool}
+        ,m_metrics{mtr}
+        ,m_ring{ring}
+        ,m_subscribe_all{subscribe_all}
         ,m_list{}
+        ,m_subs{}
+        ,m_bcast_mark{}
+        ,m_batch_interval{batch_interval}
+        ,m_batch_bytes{batch_bytes}
+        ,m_error_cb{std::move(error_cb)}
+        ,m_batched{}
+        ,m_batch_timer{ioctx}
+        ,m_batch_timer_active{false}
+        ,m_jitter{std::random_device{}()}
+        ,m_paused{false}
+        ,m_detached{false}
+        ,m_stopped{false}
     {}
 
-    auto create(tcp::socket sock) {
-        auto sptr = m_ses_pool.get_del(
-             [this](session *s){ session_deleter(s); }
-            ,std::move(sock)
+    ~session_manager() {
+        // the io_context is stopped at this point, so the sessions still registered can be destroyed here.
+        // the ones already released are destroyed by the handlers posted to their strands, see stop_all()
+        m_batched.clear();
+        m_list.clear_and_dispose([this](session *s){ m_ses_table.destroy(*s); });
+    }
+
+    // InitCB's signature: void(session &)
+    // the init callback is called before returning, and the session can't be destroyed until it's done
+    template<typename InitCB>
+    void create(stream_socket sock, InitCB init_cb) {
+        auto &s = m_ses_table.create(
+             std::move(sock)
             ,m_max_size
             ,m_inactivity_time
             ,m_str_pool
+            ,m_metrics
+            ,*this
         );
+        s.op_started();
+        m_metrics.add(counter::connections_opened);
 
-        session *raw_ptr = sptr.get();
+        session *raw_ptr = std::addressof(s);
         ba::post(
              m_strand
             ,[this, raw_ptr]
              ()
-             { m_list.push_back(*raw_ptr); }
+             {
+                register_impl(raw_ptr);
+                if ( m_subscribe_all ) {
+                    subscribe_impl(raw_ptr, std::string{});
+                }
+             }
         );
 
-        return sptr;
+        init_cb(s);
+        s.post([raw_ptr](){ raw_ptr->op_completed(); });
     }
 
-    // will close all the sessions
-    auto reset() {
-        return ba::post(
+    // the same as create(), for the session moved from another process by the hot restart:
+    // the session is registered with its subscriptions and batching instead of the defaults,
+    // and nothing is synced. `state`'s socket descriptor is not used.
+    // InitCB's signature: void(session &)
+    template<typename InitCB>
+    void adopt(stream_socket sock, const detached_session &state, InitCB init_cb) {
+        auto &s = m_ses_table.create(
+             std::move(sock)
+            ,m_max_size
+            ,m_inactivity_time
+            ,m_str_pool
+            ,m_metrics
+            ,*this
+        );
+        s.op_started();
+        m_metrics.add(counter::connections_opened);
+
+        session *raw_ptr = std::addressof(s);
+        ba::post(
              m_strand
-            ,ba::use_future([this](){
-                for ( auto &it: m_list ) { it.stop(); }
-            })
+            ,[this, raw_ptr, prefixes=state.prefixes, batched=state.batched, proto=state.write_protocol]
+             () mutable
+             {
+                register_impl(raw_ptr);
+                for ( auto &it: prefixes ) {
+                    subscribe_impl(raw_ptr, std::move(it));
+                }
+                set_batching_impl(batched, raw_ptr, proto);
+             }
         );
+
+        init_cb(s);
+        s.post([raw_ptr](){ raw_ptr->op_completed(); });
     }
 
-    template<typename ErrorCB>
-    void broadcast(shared_buffer msg, bool disconnect, ErrorCB error_cb, session_ptr holder) {
+    // the functions below, taking the session by reference, must be called on the session's strand.
+    // this guarantees the session is still registered when the posted function is called on the
+    // session manager strand, because the session is unlinked only after its own posting from its strand.
+
+    // subscribes the session to all the keys starting with the prefix.
+    // the empty prefix means all the keys.
+    // CB's signature: void(bool) - true, if the session was not subscribed to the prefix yet.
+    //     it's called on the session's strand.
+    template<typename CB>
+    void subscribe(std::string prefix, session &s, CB cb) {
         ba::post(
              m_strand
-            ,ba::use_future(
-                [this, msg=std::move(msg), disconnect, error_cb=std::move(error_cb), holder=std::move(holder)]
-                () mutable
-                { broadcast_impl(std::move(msg), disconnect, std::move(error_cb), std::move(holder)); }
-            )
+            ,[this, prefix=std::move(prefix), s=std::addressof(s), cb=std::move(cb)]
+             () mutable
+             {
+                const bool subscribed = subscribe_impl(s, std::move(prefix));
+                s->post([subscribed, cb=std::move(cb)]() mutable { cb(subscribed); });
+             }
+        );
+    }
+    void unsubscribe(std::string prefix, session &s) {
+        ba::post(
+             m_strand
+            ,[this, prefix=std::move(prefix), s=std::addressof(s)]
+             ()
+             { unsubscribe_impl(s, prefix); }
         );
     }
 
-    std::size_t size() const {
-        auto fut = ba::post(
+    // when enabled, the broadcast messages for the session are accumulated and sent
+    // as one write on every batch tick, or earlier when the batch bytes threshold is reached.
+    // one timer on the session manager strand drives the ticks for all the batched sessions.
+    void set_batching(bool enable, session &s) {
+        ba::post(
              m_strand
-            ,ba::use_future([this](){ return m_list.size(); })
+            ,[this, enable, s=std::addressof(s), proto=s.write_protocol()]
+             ()
+             { set_batching_impl(enable, s, proto); }
         );
+    }
 
-        return fut.get();
+    // will send STOP to all the sessions and close them after it's sent.
+    // the reconnect delays told to the sessions are staged over `reconnect_window` MS: each session gets
+    // its own slot of the window and a random point within the slot, so the clients come back at the steady
+    // rate instead of all at once. the completion doesn't wait for the sessions to be closed.
+    // CompletionToken's signature: void()
+    template<typename CompletionToken>
+    auto reset(std::size_t reconnect_window, CompletionToken &&token) {
+        return ba::async_initiate<CompletionToken, void()>(
+             [this, reconnect_window](auto handler) {
+                ba::post(
+                     m_strand
+                    ,[this, reconnect_window, handler=std::move(handler)]
+                     () mutable
+                     {
+                        reset_impl(reconnect_window);
+                        complete_handler(m_strand, std::move(handler));
+                     }
+                );
+             }
+            ,token
+        );
+    }
+
+    // the hot restart's first step: the sessions stop processing the received lines, see session::pause().
+    // the sessions registered after it are paused too.
+    // CompletionToken's signature: void(), when all the sessions are paused
+    template<typename CompletionToken>
+    auto pause_all(CompletionToken &&token) {
+        return ba::async_initiate<CompletionToken, void()>(
+             [this](auto handler) {
+                ba::post(
+                     m_strand
+                    ,[this, handler=std::move(handler)]
+                     () mutable
+                     {
+                        m_paused = true;
+                        // completed when the last copy is destroyed, the copies are dropped with the destroyed sessions
+                        auto done = make_countdown(
+                            [this, handler=std::move(handler)]
+                            () mutable
+                            { complete_handler(m_strand, std::move(handler)); }
+                        );
+                        for ( auto &it: m_list ) {
+                            it.pause([done](){});
+                        }
+                     }
+                );
+             }
+            ,token
+        );
+    }
+
+    // the hot restart's second step, when the state can't be changed anymore and its last changes are broadcasted:
+    // the batches are flushed and the sessions are detached, see session::detach().
+    // the sessions registered after it are told to reconnect by STOP.
+    // CompletionToken's signature: void(std::vector<detached_session>), of the moved sessions only
+    template<typename CompletionToken>
+    auto detach_all(std::size_t timeout, CompletionToken &&token) {
+        return ba::async_initiate<CompletionToken, void(std::vector<detached_session>)>(
+             [this, timeout](auto handler) {
+                ba::post(
+                     m_strand
+                    ,[this, timeout, handler=std::move(handler)]
+                     () mutable
+                     {
+                        m_detached = true;
+                        auto res = std::make_shared<std::vector<detached_session>>(m_list.size());
+                        auto done = make_countdown(
+                            [this, res, handler=std::move(handler)]
+                            () mutable
+                            {
+                                std::vector<detached_session> moved;
+                                for ( auto &it: *res ) {
+                                    if ( it.fd != -1 ) {
+                                        moved.push_back(std::move(it));
+                                    }
+                                }
+                                complete_handler(m_strand, std::move(handler), std::move(moved));
+                            }
+                        );
+                        std::size_t idx = 0;
+                        for ( auto &it: m_list ) {
+                            flush_batch(std::addressof(it));
+                            it.detach(
+                                 timeout
+                                ,[done, slot=std::addressof((*res)[idx++]), prefixes=it.m_prefixes
+                                 ,batched=it.m_batch_hook.is_linked()]
+                                 (detached_session state) mutable
+                                 {
+                                    state.prefixes = std::move(prefixes);
+                                    state.batched = batched;
+                                    *slot = std::move(state);
+                                 }
+                            );
+                        }
+                     }
+                );
+             }
+            ,token
+        );
+    }
+
+    // the hot restart failed after detach_all(): the sessions registered after it are served as usual.
+    // must be called on the session manager's strand, where detach_all() completes
+    void resume_all() noexcept {
+        m_paused = false;
+        m_detached = false;
+    }
+
+    // the shutdown: stops all the sessions, and the ones registered after it.
+    // the sessions are destroyed on their strands once their operations are completed,
+    // so the io_contexts must be run or polled after it until they are, see thread_roles::poll().
+    void stop_all() {
+        ba::post(
+             m_strand
+            ,[this]
+             ()
+             {
+                m_stopped = true;
+                for ( auto &it: m_list ) {
+                    it.stop();
+                }
+             }
+        );
+    }
+
+    // may be called from any thread.
+    // the message is not sent to the sender, which may be not alive anymore.
+    template<typename ErrorCB>
+    void broadcast(message msg, bool disconnect, ErrorCB error_cb, session_handle sender) {
+        ba::post(
+             m_strand
+            ,[this, msg=std::move(msg), disconnect, error_cb=std::move(error_cb), sender]
+             () mutable
+             { broadcast_impl(std::move(msg), disconnect, std::move(error_cb), sender); }
+        );
+    }
+
+    // sends the message only to the sessions subscribed to one of the key's prefixes.
+    // the key must refer to the msg's data.
+    template<typename ErrorCB>
+    void broadcast(message msg, std::string_view key, bool disconnect, ErrorCB error_cb, session_handle sender) {
+        ba::post(
+             m_strand
+            ,[this, msg=std::move(msg), key, disconnect, error_cb=std::move(error_cb), sender]
+             () mutable
+             { broadcast_impl(std::move(msg), key, disconnect, std::move(error_cb), sender); }
+        );
     }
 
 private:
+    // returns the pointer calling `f` when its last copy is destroyed, on that copy's thread
+    template<typename F>
+    static std::shared_ptr<void> make_countdown(F f) {
+        auto ptr = std::make_shared<F>(std::move(f));
+
+        return std::shared_ptr<void>{nullptr, [ptr](void *) { (*ptr)(); }};
+    }
+
+    void register_impl(session *s) {
+        m_list.push_back(*s);
+        if ( m_stopped ) {
+            s->stop();
+        } else if ( m_detached ) {
+            s->send([](bool){}, m_error_cb, make_stop(m_str_pool, 0u), true);
+        } else if ( m_paused ) {
+            s->pause([](){});
+        }
+    }
+
     template<typename ErrorCB>
-    void broadcast_impl(shared_buffer msg, bool disconnect, ErrorCB error_cb, session_ptr holder) {
+    void broadcast_impl(message msg, bool disconnect, ErrorCB error_cb, session_handle sender) {
+        m_metrics.add(counter::broadcasts);
+        publish(msg);
         for ( auto it = m_list.begin(); it != m_list.end(); ++it ) {
-            if ( std::addressof(*it) != holder.get() ) {
-                it->send(
-                     [](bool){}
-                    ,error_cb
-                    ,msg
-                    ,disconnect
-                    ,holder
-                );
+            if ( it->handle() != sender ) {
+                deliver(std::addressof(*it), msg, disconnect, error_cb);
             }
         }
     }
 
-    void session_deleter(session *s) {
-        s->stop();
+    template<typename ErrorCB>
+    void broadcast_impl(
+         message msg
+        ,std::string_view key
+        ,bool disconnect
+        ,ErrorCB error_cb
+        ,session_handle sender)
+    {
+        m_metrics.add(counter::broadcasts);
+        publish(msg);
+        // the mark is used to send the message only once to the session subscribed to several matched prefixes
+        const auto mark = ++m_bcast_mark;
+        m_subs.for_each_match(
+             key
+            ,[&](session *s) {
+                if ( s->m_bcast_mark == mark ) { return; }
 
+                s->m_bcast_mark = mark;
+                if ( s->handle() != sender ) {
+                    deliver(s, msg, disconnect, error_cb);
+                }
+            }
+        );
+    }
+
+    // the same-host readers of the shared memory ring get all the broadcasts in the binary protocol,
+    // which can represent any message
+    void publish(const message &msg) {
+        if ( m_ring ) {
+            if ( const auto &buf = msg.get(protocol::binary); buf ) {
+                m_ring->publish(buf->view());
+            }
+        }
+    }
+
+    template<typename ErrorCB>
+    void deliver(
+         session *s
+        ,const message &msg
+        ,bool disconnect
+        ,const ErrorCB &error_cb)
+    {
+        m_metrics.add(counter::deliveries);
+        if ( !s->m_batch_hook.is_linked() ) {
+            s->send([](bool){}, error_cb, msg, disconnect);
+
+            return;
+        }
+
+        const auto &buf = msg.get(s->m_batch_protocol);
+        if ( !buf ) {
+            return;
+        }
+
+        // the message not fitting the batch's chunk is sent with the next batch instead of regrowing the chunk
+        if ( s->m_batch && s->m_batch->size() + buf->size() > s->m_batch->capacity() ) {
+            flush_batch(s);
+        }
+        if ( !s->m_batch ) {
+            s->m_batch = make_sized_buffer(m_str_pool, chunk_capacity(std::min(m_batch_bytes, buf->size() * 16u)));
+        }
+        s->m_batch->append(buf->view());
+
+        if ( disconnect ) {
+            s->send([](bool){}, error_cb, std::move(s->m_batch), disconnect);
+        } else if ( s->m_batch->size() >= m_batch_bytes ) {
+            flush_batch(s);
+        }
+    }
+
+    void reset_impl(std::size_t reconnect_window) {
+        const auto slot = static_cast<double>(reconnect_window) / static_cast<double>(std::max<std::size_t>(m_list.size(), 1u));
+        std::uniform_real_distribution<double> jitter{0.0, slot};
+        std::size_t idx = 0;
+        for ( auto &it: m_list ) {
+            const auto delay = static_cast<std::uint64_t>(slot * static_cast<double>(idx++) + jitter(m_jitter));
+            flush_batch(std::addressof(it));
+            it.send([](bool){}, m_error_cb, make_stop(m_str_pool, delay), true);
+        }
+        m_metrics.add(counter::stops, m_list.size());
+    }
+
+    void flush_batch(session *s) {
+        if ( s->m_batch ) {
+            s->send([](bool){}, m_error_cb, std::move(s->m_batch), false);
+        }
+    }
+
+    void set_batching_impl(bool enable, session *s, protocol proto) {
+        if ( enable == s->m_batch_hook.is_linked() ) {
+            return;
+        }
+
+        if ( !enable ) {
+            flush_batch(s);
+            m_batched.erase(m_batched.iterator_to(*s));
+
+            return;
+        }
+
+        s->m_batch_protocol = proto;
+        m_batched.push_back(*s);
+        if ( !m_batch_timer_active ) {
+            m_batch_timer_active = true;
+            start_batch_timer();
+        }
+    }
+
+    void start_batch_timer() {
+        m_batch_timer.expires_after(std::chrono::microseconds{m_batch_interval});
+        m_batch_timer.async_wait(
+            ba::bind_executor(
+                 m_strand
+                ,[this](const bs::error_code &ec)
+                 { on_batch_tick(ec); }
+            )
+        );
+    }
+    void on_batch_tick(const bs::error_code &ec) {
+        if ( ec == ba::error::operation_aborted ) {
+            m_batch_timer_active = false;
+
+            return;
+        }
+
+        for ( auto &it: m_batched ) {
+            flush_batch(std::addressof(it));
+        }
+
+        if ( m_batched.empty() ) {
+            m_batch_timer_active = false;
+        } else {
+            start_batch_timer();
+        }
+    }
+
+    bool subscribe_impl(session *s, std::string prefix) {
+        if ( !m_subs.insert(prefix, s) ) {
+            return false;
+        }
+
+        s->m_prefixes.push_back(std::move(prefix));
+
+        return true;
+    }
+    void unsubscribe_impl(session *s, std::string_view prefix) {
+        if ( !m_subs.erase(prefix, s) ) {
+            return;
+        }
+
+        auto &prefixes = s->m_prefixes;
+        prefixes.erase(std::find(prefixes.begin(), prefixes.end(), prefix));
+    }
+
+    // called on the session's strand when the session is stopped and has no pending operations.
+    // the session is destroyed on its strand, after it's unlinked here, so any function posted
+    // to the session by the session manager before is dropped by the generation check.
+    void release(session *s) {
         ba::post(
              m_strand
             ,[this, s](){
+                for ( const auto &it: s->m_prefixes ) {
+                    m_subs.erase(it, s);
+                }
+                if ( s->m_batch_hook.is_linked() ) {
+                    m_batched.erase(m_batched.iterator_to(*s));
+                }
                 auto it = m_list.iterator_to(*s);
                 m_list.erase(it);
-                s->~session();
+                m_metrics.add(counter::connections_closed);
+
+                ba::post(
+                     s->get_socket().get_executor()
+                    ,[this, s](){ m_ses_table.destroy(*s); }
+                );
             }
         );
     }
@@ -129,11 +555,39 @@ private:
     ba::io_context::strand m_strand;
     std::size_t m_max_size;
     std::size_t m_inactivity_time;
-    sessions_pool &m_ses_pool;
+    session_table &m_ses_table;
     buffers_pool &m_str_pool;
+    metrics &m_metrics;
+    shm_ring_writer *m_ring;
+    const bool m_subscribe_all;
     boost::intrusive::list<session> m_list;
+    prefix_trie<session *> m_subs;
+    std::uint64_t m_bcast_mark;
+    const std::size_t m_batch_interval;
+    const std::size_t m_batch_bytes;
+    // reports the write errors of the messages sent by the session manager itself: the batches and STOPs
+    const std::function<void(const error_info &)> m_error_cb;
+    boost::intrusive::list<
+         session
+        ,boost::intrusive::member_hook<session, boost::intrusive::list_member_hook<>, &session::m_batch_hook>
+    > m_batched;
+    ba::steady_timer m_batch_timer;
+    bool m_batch_timer_active;
+    // used on the strand only
+    std::minstd_rand m_jitter;
+    // the hot restart's steps done, see pause_all() and detach_all()
+    bool m_paused;
+    bool m_detached;
+    // see stop_all()
+    bool m_stopped;
 };
 
 /**********************************************************************************************************************/
 
+inline void session::finish() {
+    m_smgr.release(this);
+}
+
+/**********************************************************************************************************************/
+
 #endif // __shared_state_server__session_manager_hpp__included
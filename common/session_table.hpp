@@ -0,0 +1,185 @@
+
+// ----------------------------------------------------------------------------
+//                              Apache License
+//                        Version 2.0, January 2004
+//                     http://www.apache.org/licenses/
+//
+// This file is part of shared-state-server(https://github.com/niXman/shared-state-server) project.
+//
+// This was a test task for implementing multithreaded Shared-State server using asio.
+//
+// Copyright (c) 2023 niXman (github dot nixman dog pm.me). All rights reserved.
+// ----------------------------------------------------------------------------
+
+#ifndef __shared_state_server__session_table_hpp__included
+#define __shared_state_server__session_table_hpp__included
+
+#include "thread_index.hpp"
+#include "memory_pool.hpp"
+#include "session.hpp"
+
+#include <boost/lockfree/stack.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <type_traits>
+
+/**********************************************************************************************************************/
+
+// the slab of the session slots, referenced by the session_handle's index.
+// the slots are allocated in the chunks of `capacity` slots which are never moved or freed
+// until the table is destroyed, so the slot's generation can be checked at any time.
+// when preallocated, the first chunk is allocated at construction as a prefaulted slab.
+
+struct session_table final {
+    static constexpr std::size_t max_chunks = 1024u;
+
+    session_table(const session_table &) = delete;
+    session_table& operator= (const session_table &) = delete;
+    session_table(session_table &&) = delete;
+    session_table& operator= (session_table &&) = delete;
+
+    session_table(std::size_t capacity, prealloc_mode mode = prealloc_mode::none)
+        :m_chunk_size{std::max<std::size_t>(capacity, 1u)}
+        ,m_mode{mode}
+        ,m_grow_mutex{}
+        ,m_chunks{}
+        ,m_chunks_n{}
+        ,m_free{m_chunk_size}
+        ,m_in_use{}
+    {
+        if ( mode != prealloc_mode::none ) {
+            grow();
+        }
+    }
+    ~session_table() {
+        assert(in_use() == 0);
+
+        const auto chunks_n = m_chunks_n.load(std::memory_order_acquire);
+        for ( std::size_t idx = 0; idx < chunks_n; ++idx ) {
+            auto &chunk = m_chunks[idx];
+            for ( std::size_t n = 0; n < m_chunk_size; ++n ) {
+                chunk.slots[n].~slot();
+            }
+            if ( m_mode == prealloc_mode::none ) {
+                ::operator delete(chunk.memory.ptr, std::align_val_t{alignof(slot)});
+            } else {
+                slab_free(chunk.memory);
+            }
+        }
+    }
+
+    // constructs the session in a free slot, passing it the slot's handle and generation
+    // after the specified arguments
+    template<typename ...Args>
+    session& create(Args && ...args) {
+        std::uint32_t index;
+        while ( !m_free.pop(index) ) {
+            grow();
+        }
+
+        auto &sl = get_slot(index);
+        try {
+            auto *s = new(std::addressof(sl.storage)) session(
+                 std::forward<Args>(args)...
+                ,session_handle{index, sl.generation.load(std::memory_order_relaxed)}
+                ,sl.generation
+            );
+            m_in_use.fetch_add(1u, std::memory_order_relaxed);
+
+            return *s;
+        } catch (...) {
+            push_free(index);
+            throw;
+        }
+    }
+
+    // must be called on the session's strand.
+    // invalidates all the handles to the session and returns its slot to the free list.
+    void destroy(session &s) {
+        const auto index = s.handle().index;
+        auto &sl = get_slot(index);
+        assert(std::addressof(sl.storage) == static_cast<void *>(std::addressof(s)));
+
+        s.~session();
+        sl.generation.fetch_add(1u, std::memory_order_release);
+        m_in_use.fetch_sub(1u, std::memory_order_relaxed);
+        push_free(index);
+    }
+
+    // true if the first chunk is backed by the huge pages
+    bool hugepages() const noexcept { return m_chunks_n.load(std::memory_order_acquire) && m_chunks[0].memory.hugepages; }
+    // the number of the allocated slots
+    std::size_t size() const noexcept { return m_chunks_n.load(std::memory_order_acquire) * m_chunk_size; }
+    // the number of the alive sessions
+    std::size_t in_use() const noexcept { return m_in_use.load(std::memory_order_relaxed); }
+
+private:
+    struct alignas(cache_line_size) slot {
+        std::atomic_uint32_t generation{0u};
+        typename std::aligned_storage<sizeof(session), alignof(session)>::type storage;
+    };
+    struct chunk {
+        slab_memory memory;
+        slot *slots;
+    };
+
+    slot& get_slot(std::uint32_t index) noexcept {
+        return m_chunks[index / m_chunk_size].slots[index % m_chunk_size];
+    }
+
+    void push_free(std::uint32_t index) {
+        while ( !m_free.push(index) )
+        {}
+    }
+
+    void grow() {
+        std::lock_guard<std::mutex> lock{m_grow_mutex};
+
+        // the other thread could grow the table while we were waiting for the lock
+        if ( !m_free.empty() ) {
+            return;
+        }
+
+        const auto chunks_n = m_chunks_n.load(std::memory_order_relaxed);
+        if ( chunks_n == max_chunks ) {
+            throw std::bad_alloc{};
+        }
+
+        auto &chunk = m_chunks[chunks_n];
+        const auto bytes = m_chunk_size * sizeof(slot);
+        if ( m_mode == prealloc_mode::none ) {
+            chunk.memory = {::operator new(bytes, std::align_val_t{alignof(slot)}), bytes, false};
+        } else {
+            chunk.memory = slab_allocate(bytes, m_mode == prealloc_mode::hugepages);
+        }
+        chunk.slots = static_cast<slot *>(chunk.memory.ptr);
+        for ( std::size_t n = 0; n < m_chunk_size; ++n ) {
+            new(chunk.slots + n) slot{};
+        }
+        m_chunks_n.store(chunks_n + 1u, std::memory_order_release);
+
+        // the lower indices are popped first
+        for ( auto n = m_chunk_size; n; --n ) {
+            push_free(static_cast<std::uint32_t>(chunks_n * m_chunk_size + n - 1u));
+        }
+    }
+
+private:
+    const std::size_t m_chunk_size;
+    const prealloc_mode m_mode;
+    std::mutex m_grow_mutex;
+    // the chunk is written once under the mutex, before any of its indices is pushed to the free list
+    chunk m_chunks[max_chunks];
+    std::atomic_size_t m_chunks_n;
+    boost::lockfree::stack<std::uint32_t> m_free;
+    alignas(cache_line_size) std::atomic_size_t m_in_use;
+};
+
+/**********************************************************************************************************************/
+
+#endif // __shared_state_server__session_table_hpp__included
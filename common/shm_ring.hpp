@@ -0,0 +1,377 @@
+
+// ----------------------------------------------------------------------------
+//                              Apache License
+//                        Version 2.0, January 2004
+//                     http://www.apache.org/licenses/
+//
+// This file is part of shared-state-server(https://github.com/niXman/shared-state-server) project.
+//
+// This was a test task for implementing multithreaded Shared-State server using asio.
+//
+// Copyright (c) 2023 niXman (github dot nixman dog pm.me). All rights reserved.
+// ----------------------------------------------------------------------------
+
+#ifndef __shared_state_server__shm_ring_hpp__included
+#define __shared_state_server__shm_ring_hpp__included
+
+#include "thread_index.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**********************************************************************************************************************/
+
+// the single-producer multi-consumer byte ring in the shared memory (/dev/shm).
+// the producer appends the whole messages and publishes them by advancing `write_pos`,
+// so `write_pos` is always at a message boundary. the readers never write the ring's data,
+// each of them keeps its own read position, so the slow reader doesn't block the producer, but is lapped:
+// the reader detects it by the distance to `write_pos` before copying the data, and by the distance
+// to `claim_pos`, advanced by the producer before it overwrites anything, after copying it,
+// drops what it has, and resyncs at the current `write_pos`.
+// the reader waits on the `seq` futex only when there is nothing to read,
+// and the producer wakes the waiters only if there are any, so the fast path has no syscalls.
+
+static constexpr std::uint64_t shm_ring_magic = 0x676e69725f737373ull; // "sss_ring"
+
+struct shm_ring_header {
+    std::uint64_t magic;
+    // the size of the data in bytes, the power of two
+    std::uint64_t capacity;
+    // the number of the bytes published since the ring was created
+    alignas(cache_line_size) std::atomic_uint64_t write_pos;
+    // the end of the message being written, the data up to `claim_pos - capacity` can be overwritten
+    std::atomic_uint64_t claim_pos;
+    // the futex word, changed when the waiters must be woken
+    alignas(cache_line_size) std::atomic_uint32_t seq;
+    std::atomic_uint32_t waiters;
+};
+
+static_assert(std::atomic_uint64_t::is_always_lock_free && std::atomic_uint32_t::is_always_lock_free
+    ,"the ring's atomics must be lock-free to be shared between the processes");
+
+/**********************************************************************************************************************/
+
+namespace details {
+
+inline std::runtime_error shm_error(const char *what, const std::string &name) {
+    return std::runtime_error{std::string{what} + "(" + name + ") error: " + std::strerror(errno)};
+}
+
+// the header's size is a multiple of the cache line, so the data starts at the cache line
+constexpr std::size_t shm_data_offset = sizeof(shm_ring_header);
+
+// maps the whole ring, the header followed by the data
+inline void* shm_map(int fd, std::size_t size) {
+    return ::mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+}
+
+} // ns details
+
+/**********************************************************************************************************************/
+
+// NOT thread-safe, should be used from one strand only.
+// the ring is created at construction and removed at destruction.
+// on the hot restart the ring is handed off to the new process with its descriptor, so the readers
+// keep reading the same ring, and the process which handed it off doesn't remove it.
+
+struct shm_ring_writer {
+    shm_ring_writer(const shm_ring_writer &) = delete;
+    shm_ring_writer& operator= (const shm_ring_writer &) = delete;
+
+    // the capacity is rounded up to the power of two
+    shm_ring_writer(std::string name, std::size_t capacity)
+        :m_name{std::move(name)}
+        ,m_fd{-1}
+        ,m_owner{true}
+        ,m_size{}
+        ,m_header{}
+        ,m_data{}
+        ,m_mask{}
+    {
+        std::size_t cap = 4096u;
+        for ( ; cap < capacity; cap <<= 1u )
+        {}
+
+        int fd = ::shm_open(m_name.c_str(), O_CREAT|O_RDWR|O_TRUNC, 0644);
+        if ( fd == -1 ) {
+            throw details::shm_error("shm_open", m_name);
+        }
+
+        m_size = details::shm_data_offset + cap;
+        if ( ::ftruncate(fd, static_cast<off_t>(m_size)) == -1 ) {
+            const auto err = details::shm_error("ftruncate", m_name);
+            ::close(fd);
+            ::shm_unlink(m_name.c_str());
+
+            throw err;
+        }
+
+        void *ptr = details::shm_map(fd, m_size);
+        if ( ptr == MAP_FAILED ) {
+            const auto err = details::shm_error("mmap", m_name);
+            ::close(fd);
+            ::shm_unlink(m_name.c_str());
+
+            throw err;
+        }
+
+        m_fd = fd;
+        m_header = ::new(ptr) shm_ring_header{};
+        m_header->capacity = cap;
+        m_data = static_cast<char *>(ptr) + details::shm_data_offset;
+        m_mask = cap - 1u;
+        // the readers check the magic last
+        std::atomic_thread_fence(std::memory_order_release);
+        m_header->magic = shm_ring_magic;
+    }
+    // takes over the ring handed off by another process, the descriptor is owned after the call.
+    // the data and the position are kept, so the readers continue with the next message.
+    // the ring is not removed at destruction until own() is called, so the failed takeover
+    // leaves it to the process it was taken from
+    shm_ring_writer(std::string name, int fd)
+        :m_name{std::move(name)}
+        ,m_fd{fd}
+        ,m_owner{false}
+        ,m_size{}
+        ,m_header{}
+        ,m_data{}
+        ,m_mask{}
+    {
+        struct stat st;
+        if ( ::fstat(m_fd, &st) == -1 || static_cast<std::size_t>(st.st_size) < details::shm_data_offset ) {
+            ::close(m_fd);
+
+            throw std::runtime_error{"the shared memory ring(" + m_name + ") is not initialized"};
+        }
+
+        m_size = static_cast<std::size_t>(st.st_size);
+        void *ptr = details::shm_map(m_fd, m_size);
+        if ( ptr == MAP_FAILED ) {
+            const auto err = details::shm_error("mmap", m_name);
+            ::close(m_fd);
+
+            throw err;
+        }
+
+        m_header = static_cast<shm_ring_header *>(ptr);
+        if ( m_header->magic != shm_ring_magic || details::shm_data_offset + m_header->capacity != m_size ) {
+            ::munmap(ptr, m_size);
+            ::close(m_fd);
+
+            throw std::runtime_error{"the shared memory ring(" + m_name + ") is not initialized"};
+        }
+        m_data = static_cast<char *>(ptr) + details::shm_data_offset;
+        m_mask = m_header->capacity - 1u;
+    }
+    ~shm_ring_writer() {
+        ::munmap(m_header, m_size);
+        ::close(m_fd);
+        if ( m_owner ) {
+            ::shm_unlink(m_name.c_str());
+        }
+    }
+
+    // the ring is removed at destruction by this process, or is not because it's handed off
+    void own() noexcept { m_owner = true; }
+    void disown() noexcept { m_owner = false; }
+
+    // returns false if the message is larger than the ring, such message is never published
+    bool publish(std::string_view msg) noexcept {
+        if ( msg.size() > m_mask ) {
+            return false;
+        }
+
+        const auto pos = m_header->write_pos.load(std::memory_order_relaxed);
+        m_header->claim_pos.store(pos + msg.size(), std::memory_order_relaxed);
+        // pairs with the fence in `shm_ring_reader::read()`,
+        // so the reader which copied any of the bytes written below sees the claim
+        std::atomic_thread_fence(std::memory_order_release);
+
+        const auto off = static_cast<std::size_t>(pos & m_mask);
+        const auto first = std::min(msg.size(), m_mask + 1u - off);
+        std::memcpy(m_data + off, msg.data(), first);
+        std::memcpy(m_data, msg.data() + first, msg.size() - first);
+
+        m_header->write_pos.store(pos + msg.size(), std::memory_order_release);
+        // pairs with the fence in `shm_ring_reader::wait()`,
+        // so either the waiter is seen here, or the waiter sees the new `write_pos`
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if ( m_header->waiters.load(std::memory_order_relaxed) ) {
+            m_header->seq.fetch_add(1u, std::memory_order_relaxed);
+            ::syscall(SYS_futex, std::addressof(m_header->seq), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+        }
+
+        return true;
+    }
+
+    const std::string& name() const noexcept { return m_name; }
+    std::size_t capacity() const noexcept { return m_mask + 1u; }
+    // the ring's shared memory object, to be handed off
+    int fd() const noexcept { return m_fd; }
+
+private:
+    std::string m_name;
+    int m_fd;
+    bool m_owner;
+    std::size_t m_size;
+    shm_ring_header *m_header;
+    char *m_data;
+    std::size_t m_mask;
+};
+
+/**********************************************************************************************************************/
+
+// NOT thread-safe, should be used from one thread only.
+// the reader starts from the current end of the ring, so the state published before it
+// must be got another way, the same as after it was lapped.
+
+struct shm_ring_reader {
+    shm_ring_reader(const shm_ring_reader &) = delete;
+    shm_ring_reader& operator= (const shm_ring_reader &) = delete;
+
+    explicit shm_ring_reader(const std::string &name)
+        :m_size{}
+        ,m_header{}
+        ,m_data{}
+        ,m_mask{}
+        ,m_pos{}
+        ,m_lapped{}
+    {
+        int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+        if ( fd == -1 ) {
+            throw details::shm_error("shm_open", name);
+        }
+
+        struct stat st;
+        if ( ::fstat(fd, &st) == -1 || static_cast<std::size_t>(st.st_size) < details::shm_data_offset ) {
+            ::close(fd);
+
+            throw std::runtime_error{"the shared memory ring(" + name + ") is not initialized"};
+        }
+
+        m_size = static_cast<std::size_t>(st.st_size);
+        void *ptr = details::shm_map(fd, m_size);
+        if ( ptr == MAP_FAILED ) {
+            const auto err = details::shm_error("mmap", name);
+            ::close(fd);
+
+            throw err;
+        }
+        ::close(fd);
+
+        m_header = static_cast<shm_ring_header *>(ptr);
+        if ( m_header->magic != shm_ring_magic
+            || details::shm_data_offset + m_header->capacity != m_size )
+        {
+            ::munmap(ptr, m_size);
+
+            throw std::runtime_error{"the shared memory ring(" + name + ") is not initialized"};
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        m_data = static_cast<const char *>(ptr) + details::shm_data_offset;
+        m_mask = m_header->capacity - 1u;
+        m_pos = m_header->write_pos.load(std::memory_order_acquire);
+    }
+    ~shm_ring_reader() {
+        ::munmap(m_header, m_size);
+    }
+
+    struct read_result {
+        // the number of the bytes copied to the output
+        std::size_t size;
+        // the reader was lapped and is resynced at the current end of the ring,
+        // the bytes read before must be dropped, the messages were lost
+        bool lapped;
+    };
+
+    // copies up to `max` published bytes to `out` and never blocks.
+    // the bytes are the part of the messages stream, a message can be split between the calls
+    read_result read(char *out, std::size_t max) noexcept {
+        const auto wpos = m_header->write_pos.load(std::memory_order_acquire);
+        if ( wpos - m_pos > m_mask + 1u ) {
+            return resync(wpos);
+        }
+
+        const auto size = static_cast<std::size_t>(std::min<std::uint64_t>(wpos - m_pos, max));
+        const auto off = static_cast<std::size_t>(m_pos & m_mask);
+        const auto first = std::min(size, m_mask + 1u - off);
+        std::memcpy(out, m_data + off, first);
+        std::memcpy(out + first, m_data, size - first);
+
+        // the copied bytes could be overwritten by the producer meanwhile,
+        // even by the message not published yet
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const auto claim = m_header->claim_pos.load(std::memory_order_relaxed);
+        if ( claim - m_pos > m_mask + 1u ) {
+            return resync(m_header->write_pos.load(std::memory_order_acquire));
+        }
+
+        m_pos += size;
+
+        return {size, false};
+    }
+
+    // waits until there is something to read, or the timeout expires.
+    // spins for a while first, so the syscall is made only when the ring stays idle
+    void wait(std::chrono::milliseconds timeout, std::size_t spins = 1024u) noexcept {
+        for ( ; spins; --spins ) {
+            if ( m_header->write_pos.load(std::memory_order_acquire) != m_pos ) {
+                return;
+            }
+        }
+
+        m_header->waiters.fetch_add(1u, std::memory_order_relaxed);
+        const auto seq = m_header->seq.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if ( m_header->write_pos.load(std::memory_order_relaxed) == m_pos ) {
+            const auto secs = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+            struct timespec ts{
+                 static_cast<time_t>(secs.count())
+                ,static_cast<long>(std::chrono::duration_cast<std::chrono::nanoseconds>(timeout - secs).count())
+            };
+            ::syscall(SYS_futex, std::addressof(m_header->seq), FUTEX_WAIT, seq, &ts, nullptr, 0);
+        }
+        m_header->waiters.fetch_sub(1u, std::memory_order_relaxed);
+    }
+
+    // the number of the times the reader was lapped
+    std::size_t lapped() const noexcept { return m_lapped; }
+
+private:
+    read_result resync(std::uint64_t wpos) noexcept {
+        m_pos = wpos;
+        ++m_lapped;
+
+        return {0u, true};
+    }
+
+private:
+    std::size_t m_size;
+    shm_ring_header *m_header;
+    const char *m_data;
+    std::size_t m_mask;
+    std::uint64_t m_pos;
+    std::size_t m_lapped;
+};
+
+/**********************************************************************************************************************/
+
+#endif // __shared_state_server__shm_ring_hpp__included
@@ -16,117 +16,607 @@
 
 #include "utils.hpp"
 #include "string_buffer.hpp"
+#include "protocol.hpp"
+#include "metrics.hpp"
 
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/strand.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/intrusive/set.hpp>
+#include <boost/intrusive/list.hpp>
+
+#include <atomic>
+#include <memory>
+#include <random>
+#include <vector>
 
 /**********************************************************************************************************************/
 
+// the deleted key is kept as a tombstone for `tombstone_ttl` MS, so the delta syncs can report the deletion.
+// the expired tombstones are erased in the background, by no more than `compact_batch` per strand's turn.
+// each change is stamped with the sequence number and the ms-time, carried by its message,
+// which are given by the primary for the replicated changes. the sequence numbers are meaningful
+// within the storage's epoch only, which is chosen randomly at construction and at each reset.
+// the reset only detaches the pairs from the storage, they are deleted off the strand
+// by no more than `release_batch` per turn, so the reset of the large state doesn't stall the storage.
+
 struct state_storage {
+    static constexpr std::size_t compact_batch = 256u;
+    static constexpr std::size_t release_batch = 4096u;
+
     state_storage(const state_storage &) = delete;
     state_storage& operator= (const state_storage &) = delete;
     state_storage(state_storage &&) = delete;
     state_storage& operator= (state_storage &&) = delete;
 
-    state_storage(ba::io_context &ioctx)
+    state_storage(ba::io_context &ioctx, buffers_pool &pool, metrics &mtr, std::size_t tombstone_ttl)
         :m_strand{ioctx}
+        ,m_pool{pool}
+        ,m_metrics{mtr}
+        ,m_tombstone_ttl{tombstone_ttl}
+        ,m_compact_timer{ioctx}
+        ,m_horizon{}
+        ,m_seq{}
+        ,m_size{}
+        ,m_epoch{make_epoch()}
         ,m_map{}
-    {}
+        ,m_tombs{}
+    { start_compact_timer(); }
+    ~state_storage() {
+        m_tombs.clear();
+        m_map.clear_and_dispose([](auto *p){ delete p; });
+    }
+
+    // CB's signature: void(message msg, std::string_view key)
+    // called only when the storage was really updated (a new key-val pair was added, or value for the concrete key was changed).
+    // the message is encoded for both protocols once, the key refers to the message's chars.
+    // the key and val must refer to the buf's chars, which is encoded in the specified protocol.
+    // AckCB's signature: void(bool changed)
+    // called after the update was applied, whether the storage was changed or not.
+    template<typename CB, typename AckCB>
+    auto update(const std::string_view key, const std::string_view val, shared_buffer buf, protocol proto, CB cb, AckCB ack_cb) {
+        return ba::post(
+             m_strand
+            ,[this, key, val, buf=std::move(buf), proto, cb=std::move(cb), ack_cb=std::move(ack_cb)]
+             () mutable
+             {
+                const bool changed = update_impl(key, val, std::move(buf), proto, std::move(cb));
+                if ( changed ) {
+                    m_metrics.add(counter::updates);
+                }
+                ack_cb(changed);
+             }
+        );
+    }
 
-    // CB's signature: void(shared_buffer buf)
-    // called only when the storage was really updated (a new key-val pair was added, or value for the concrete key was changed)
+    // CB's signature: void(message msg, std::string_view key)
+    // called only when the live key was deleted.
+    // the key must refer to the buf's chars, which is encoded in the specified protocol.
     template<typename CB>
-    auto update(const std::string_view key, const std::string_view val, shared_buffer buf, CB cb) {
+    auto remove(const std::string_view key, shared_buffer buf, protocol proto, CB cb) {
         return ba::post(
              m_strand
-            ,[this, key, val, buf=std::move(buf), cb=std::move(cb)]
+            ,[this, key, buf=std::move(buf), proto, cb=std::move(cb)]
              () mutable
-             { update_impl(key, val, std::move(buf), std::move(cb)); }
+             { remove_impl(key, std::move(buf), proto, std::move(cb)); }
         );
     }
 
-    auto reset() {
+    // applies the change replicated from the primary: DATA if `deleted` is false, otherwise DELE.
+    // the change not newer than the key's current one is ignored, so the sync and the stream may overlap.
+    // the key and val must refer to the buf's chars, which is the binary frame.
+    // CB's signature: void(message msg, std::string_view key)
+    // called only when the storage was really updated.
+    template<typename CB>
+    auto replicate(
+         const std::string_view key
+        ,const std::string_view val
+        ,shared_buffer buf
+        ,bool deleted
+        ,std::uint64_t seq
+        ,std::uint64_t time
+        ,CB cb)
+    {
         return ba::post(
              m_strand
-            ,ba::use_future([this](){ m_map.clear_and_dispose([](auto *p){ delete p; }); })
+            ,[this, key, val, buf=std::move(buf), deleted, seq, time, cb=std::move(cb)]
+             () mutable
+             {
+                if ( auto it = m_map.find(key); it != m_map.end() ) {
+                    if ( it->msg.seq >= seq ) {
+                        return;
+                    }
+                    // the same state, but the newer stamp must be kept for the older changes to be ignored
+                    if ( deleted ? it->deleted : (!it->deleted && it->val == val) ) {
+                        it->msg.seq = seq;
+                        set_seq(seq);
+
+                        return;
+                    }
+                }
+
+                if ( deleted ) {
+                    remove_impl(key, std::move(buf), protocol::binary, std::move(cb), seq, time);
+                } else if ( update_impl(key, val, std::move(buf), protocol::binary, std::move(cb), seq, time) ) {
+                    m_metrics.add(counter::updates);
+                }
+             }
         );
     }
 
-    auto size()
-    { return ba::post(m_strand, ba::use_future([this](){ return m_map.size(); })); }
+    // the point the replica can resume from: the `since` of the delta sync, 0 if the full sync is required
+    // because the replica's state is of another epoch or is older than the kept tombstones,
+    // the current sequence number, and the epoch.
+    // CompletionToken's signature: void(std::uint64_t since, std::uint64_t seq, std::uint64_t epoch)
+    template<typename CompletionToken>
+    auto resume_point(std::uint64_t since, std::uint64_t epoch, CompletionToken &&token) {
+        return ba::async_initiate<CompletionToken, void(std::uint64_t, std::uint64_t, std::uint64_t)>(
+             [this](auto handler, std::uint64_t since, std::uint64_t epoch) {
+                ba::post(
+                     m_strand
+                    ,[this, handler=std::move(handler), since, epoch]
+                     () mutable
+                     {
+                        since = (epoch == m_epoch) ? effective_since(since) : 0u;
+                        complete_handler(m_strand, std::move(handler), since, seq(), m_epoch);
+                     }
+                );
+             }
+            ,token
+            ,since
+            ,epoch
+        );
+    }
 
-private:
-    auto get_first_impl() {
-        auto it = m_map.begin();
-        if ( it != m_map.end() ) {
-            auto buf = it->key_val;
-            return std::make_tuple(false, it, std::move(buf));
-        }
+    // the whole state for the hot restart: the live pairs in the order of the keys and then the tombstones
+    // in the order of the deletion, as the binary DATA/DELE frames each preceded by RSEQ with its stamp,
+    // the current sequence number, the epoch, and the ms-time of the latest erased tombstone.
+    // CompletionToken's signature: void(std::string frames, std::uint64_t seq, std::uint64_t epoch, std::uint64_t horizon)
+    template<typename CompletionToken>
+    auto snapshot(CompletionToken &&token) {
+        return ba::async_initiate<CompletionToken, void(std::string, std::uint64_t, std::uint64_t, std::uint64_t)>(
+             [this](auto handler) {
+                ba::post(
+                     m_strand
+                    ,[this, handler=std::move(handler)]
+                     () mutable
+                     {
+                        std::string frames;
+                        auto append = [this, &frames](const map_value &v) {
+                            auto rseq = make_binary_varints(m_pool, binary_cmd::rseq, v.msg.seq, v.msg.time);
+                            frames.append(rseq->view());
+                            frames.append(v.msg.binary->view());
+                        };
+                        for ( const auto &it: m_map ) {
+                            if ( !it.deleted ) {
+                                append(it);
+                            }
+                        }
+                        for ( const auto &it: m_tombs ) {
+                            append(it);
+                        }
+                        complete_handler(m_strand, std::move(handler), std::move(frames), seq(), m_epoch, m_horizon);
+                     }
+                );
+             }
+            ,token
+        );
+    }
+
+    // replaces the empty state by the snapshot() taken by another process, so the stamps and the epoch
+    // stay the same and the replicas and the clients can resume from it.
+    // CompletionToken's signature: void(bool) - false, if the frames are malformed
+    template<typename CompletionToken>
+    auto restore(std::string frames, std::uint64_t seq, std::uint64_t epoch, std::uint64_t horizon, CompletionToken &&token) {
+        return ba::async_initiate<CompletionToken, void(bool)>(
+             [this](auto handler, std::string frames, std::uint64_t seq, std::uint64_t epoch, std::uint64_t horizon) {
+                ba::post(
+                     m_strand
+                    ,[this, handler=std::move(handler), frames=std::move(frames), seq, epoch, horizon]
+                     () mutable
+                     {
+                        const bool ok = restore_impl(frames);
+                        set_seq(seq);
+                        m_epoch = epoch;
+                        m_horizon = horizon;
+                        complete_handler(m_strand, std::move(handler), ok);
+                     }
+                );
+             }
+            ,token
+            ,std::move(frames)
+            ,seq
+            ,epoch
+            ,horizon
+        );
+    }
 
-        return std::make_tuple(true, it, shared_buffer{});
+    // the sequence number of the latest change, may be called from any thread
+    std::uint64_t seq() const noexcept { return m_seq.load(std::memory_order_relaxed); }
+    // the number of the live keys, may be called from any thread
+    std::size_t size() const noexcept { return m_size.load(std::memory_order_relaxed); }
+
+    // CompletionToken's signature: void()
+    template<typename CompletionToken>
+    auto reset(CompletionToken &&token) {
+        return ba::async_initiate<CompletionToken, void()>(
+             [this](auto handler) {
+                ba::post(
+                     m_strand
+                    ,[this, handler=std::move(handler)]
+                     () mutable
+                     {
+                        m_tombs.clear();
+                        release(m_strand.context(), m_map);
+                        update_size();
+                        m_seq.store(0u, std::memory_order_relaxed);
+                        m_epoch = make_epoch();
+                        complete_handler(m_strand, std::move(handler));
+                     }
+                );
+             }
+            ,token
+        );
     }
+
+private:
+    static bool starts_with(std::string_view key, std::string_view prefix) noexcept
+    { return key.compare(0, prefix.size(), prefix) == 0; }
+
+    // the changes older than the oldest kept tombstone can't be delta-synced
+    std::uint64_t effective_since(std::uint64_t since) const noexcept
+    { return since > m_horizon ? since : 0u; }
+
     template<typename Iter>
-    auto get_next_impl(Iter it) {
-        auto new_it = std::next(it);
-        if ( new_it != m_map.end() ) {
-            auto buf = new_it->key_val;
-            return std::make_tuple(false, std::move(new_it), std::move(buf));
+    auto get_visible(Iter it, std::string_view prefix, std::uint64_t since, std::size_t max) {
+        since = effective_since(since);
+        std::vector<message> msgs;
+        std::string_view key;
+        for ( ; it != m_map.end() && starts_with(it->key, prefix) && msgs.size() < max; ++it ) {
+            if ( since ? it->time > since : !it->deleted ) {
+                key = it->key;
+                msgs.push_back(it->msg);
+            }
         }
 
-        return std::make_tuple(true, std::move(it), shared_buffer{});
+        const bool latest = (it == m_map.end() || !starts_with(it->key, prefix));
+        return std::make_tuple(latest, key, std::move(msgs));
     }
 
 public:
-    auto get_first() {
-        auto fut = ba::post(m_strand, ba::use_future([this](){ return get_first_impl(); }));
-        return fut.get();
+    // the prefix limits the iteration to the keys starting with it, the empty prefix means all the keys.
+    // when `since` (ms-time) is not 0, only the keys changed or deleted after it are visited
+    // (the deleted keys with their DELE message), otherwise only the live keys.
+    // CompletionToken's signature: void(bool latest, std::string_view key, std::vector<message> msgs)
+    // completed with up to `max` messages, `latest` is true if there are no more of them.
+    // the key is the last message's key, it refers to the message's chars and is used to continue the iteration,
+    // so the iteration is not invalidated by the concurrent changes.
+    template<typename CompletionToken>
+    auto get_first(std::string prefix, std::uint64_t since, std::size_t max, CompletionToken &&token) {
+        return ba::async_initiate<CompletionToken, void(bool, std::string_view, std::vector<message>)>(
+             [this](auto handler, std::string prefix, std::uint64_t since, std::size_t max) {
+                ba::post(
+                     m_strand
+                    ,[this, handler=std::move(handler), prefix=std::move(prefix), since, max]
+                     () mutable
+                     {
+                        auto [latest, key, msgs] = get_visible(m_map.lower_bound(prefix), prefix, since, max);
+                        complete_handler(m_strand, std::move(handler), latest, key, std::move(msgs));
+                     }
+                );
+             }
+            ,token
+            ,std::move(prefix)
+            ,since
+            ,max
+        );
     }
 
-    template<typename Iter>
-    auto get_next(Iter it) {
-        auto fut = ba::post(m_strand, ba::use_future([this, it](){ return get_next_impl(it); }));
-        return fut.get();
+    // the prev_key's chars must be kept alive until the operation is completed,
+    // e.g. by the messages owned by the handler
+    template<typename CompletionToken>
+    auto get_next(std::string_view prev_key, std::string prefix, std::uint64_t since, std::size_t max, CompletionToken &&token) {
+        return ba::async_initiate<CompletionToken, void(bool, std::string_view, std::vector<message>)>(
+             [this](auto handler, std::string_view prev_key, std::string prefix, std::uint64_t since, std::size_t max) {
+                ba::post(
+                     m_strand
+                    ,[this, handler=std::move(handler), prev_key, prefix=std::move(prefix), since, max]
+                     () mutable
+                     {
+                        auto [latest, key, msgs] = get_visible(m_map.upper_bound(prev_key), prefix, since, max);
+                        complete_handler(m_strand, std::move(handler), latest, key, std::move(msgs));
+                     }
+                );
+             }
+            ,token
+            ,prev_key
+            ,std::move(prefix)
+            ,since
+            ,max
+        );
     }
 
 private:
+    static std::uint64_t make_epoch() {
+        std::random_device rd;
+
+        return (static_cast<std::uint64_t>(rd()) << 32u) | rd();
+    }
+
+    void update_size() noexcept { m_size.store(m_map.size() - m_tombs.size(), std::memory_order_relaxed); }
+
+    void set_seq(std::uint64_t seq) noexcept {
+        if ( seq > m_seq.load(std::memory_order_relaxed) ) {
+            m_seq.store(seq, std::memory_order_relaxed);
+        }
+    }
+    // the local change is stamped with the next sequence number, the replicated one keeps the primary's stamp
+    void stamp(message &msg, std::uint64_t seq, std::uint64_t time) noexcept {
+        msg.seq = seq ? seq : m_seq.load(std::memory_order_relaxed) + 1u;
+        msg.time = seq ? time : ms_time();
+        set_seq(msg.seq);
+    }
+
+    bool restore_impl(std::string_view frames) {
+        auto noop = [](message, std::string_view){};
+        std::uint64_t seq = 0u, time = 0u;
+        while ( !frames.empty() ) {
+            const auto [end, matched] = frame_match{}(frames.begin(), frames.end());
+            const auto size = static_cast<std::size_t>(end - frames.begin());
+            if ( !matched ) {
+                return false;
+            }
+
+            auto buf = make_sized_buffer(m_pool, size);
+            buf->append(frames.substr(0, size));
+            frames.remove_prefix(size);
+
+            binary_frame frame;
+            if ( !parse_frame(buf->view(), frame) ) {
+                return false;
+            }
+            switch ( frame.cmd ) {
+                case binary_cmd::rseq: {
+                    if ( !parse_varints_payload(frame.payload, seq, time) ) { return false; }
+                    break;
+                }
+                case binary_cmd::data: {
+                    std::string_view key, val;
+                    if ( !seq || !parse_data_payload(frame.payload, key, val) ) { return false; }
+                    update_impl(key, val, std::move(buf), protocol::binary, noop, seq, time);
+                    seq = 0u;
+                    break;
+                }
+                case binary_cmd::dele: {
+                    if ( !seq ) { return false; }
+                    remove_impl(frame.payload, std::move(buf), protocol::binary, noop, seq, time);
+                    seq = 0u;
+                    break;
+                }
+                default: return false;
+            }
+        }
+
+        return true;
+    }
+
+    // returns true if the storage was changed
     template<typename CB>
-    void update_impl(const std::string_view key, const std::string_view val, shared_buffer buf, CB cb) {
+    bool update_impl(
+         std::string_view key
+        ,std::string_view val
+        ,shared_buffer buf
+        ,protocol proto
+        ,CB cb
+        ,std::uint64_t seq = 0u
+        ,std::uint64_t time = 0u)
+    {
         //DEBUG_EXPR(std::cout << "hash_calculated: key=" << *key << ", hash=" << *hash << std::endl;);
 
         // check for key
         auto it = m_map.find(key);
         if ( it == m_map.end() ) {
-            auto *value = ::new map_value{key, val, std::move(buf)};
+            auto msg = encode(key, val, std::move(buf), proto);
+            stamp(msg, seq, time);
+            const auto changed = msg.time;
+            auto *value = ::new map_value{key, val, std::move(msg), changed};
             auto inserted = m_map.insert(*value);
-            cb(inserted.first->key_val);
+            update_size();
+            cb(inserted.first->msg, inserted.first->key);
 
-            return;
+            return true;
         }
 
         // check for val
-        if ( it->val != val ) {
+        if ( it->deleted || it->val != val ) {
+            if ( it->deleted ) {
+                m_tombs.erase(m_tombs.iterator_to(*it));
+                it->deleted = false;
+                update_size();
+            }
+
+            auto msg = encode(key, val, std::move(buf), proto);
+            stamp(msg, seq, time);
             it->key = key;
             it->val = val;
-            it->key_val = std::move(buf);
+            it->msg = std::move(msg);
+            it->time = it->msg.time;
+
+            cb(it->msg, it->key);
+
+            return true;
+        }
+
+        return false;
+    }
+
+    template<typename CB>
+    void remove_impl(
+         std::string_view key
+        ,shared_buffer buf
+        ,protocol proto
+        ,CB cb
+        ,std::uint64_t seq = 0u
+        ,std::uint64_t time = 0u)
+    {
+        auto it = m_map.find(key);
+        // the replicated deletion of the unknown key is kept as the tombstone too,
+        // so the older DATA of the key received later can't revive it.
+        // but nobody has seen the key, so it's neither counted nor broadcasted
+        const bool known = (it != m_map.end());
+        if ( !known && seq ) {
+            it = m_map.insert(*::new map_value{key, key.substr(key.size()), message{}, 0u}).first;
+        }
+        if ( it == m_map.end() || it->deleted ) {
+            return;
+        }
+
+        // the empty val just to be compacted along with the key
+        auto val = key.substr(key.size());
+        compact(key, val, buf);
+
+        message msg;
+        if ( proto == protocol::text ) {
+            msg.binary = make_binary_frame(m_pool, binary_cmd::dele, key);
+            msg.text = std::move(buf);
+        } else {
+            if ( is_text_representable(key, val) ) {
+                msg.text = make_text_dele(m_pool, key);
+            }
+            msg.binary = std::move(buf);
+        }
+
+        stamp(msg, seq, time);
+        it->key = key;
+        it->val = val;
+        it->msg = std::move(msg);
+        it->time = it->msg.time;
+        it->deleted = true;
+        m_tombs.push_back(*it);
+        update_size();
+
+        // the message and the key are kept alive by the callback's copy
+        auto res = it->msg;
+        if ( m_tombstone_ttl == 0 ) {
+            erase_tombstone(*it);
+        }
+        if ( !known ) {
+            return;
+        }
+        m_metrics.add(counter::deletes);
+
+        cb(std::move(res), key);
+    }
+
+    struct map_value;
+    struct get_key;
+    using map_type = boost::intrusive::set<map_value, boost::intrusive::key_of_value<get_key>>;
+
+    void erase_tombstone(map_value &v) {
+        m_horizon = std::max(m_horizon, v.time);
+        m_tombs.erase(m_tombs.iterator_to(v));
+        m_map.erase_and_dispose(m_map.iterator_to(v), [](auto *p){ delete p; });
+    }
 
-            cb(it->key_val);
+    // takes all the pairs away from the map, which is left empty
+    static void release(ba::io_context &ioctx, map_type &map) {
+        std::shared_ptr<map_type> pairs{
+             new map_type
+            // the pairs left if the io_context is stopped
+            ,[](map_type *p){ p->clear_and_dispose([](auto *v){ delete v; }); delete p; }
+        };
+        pairs->swap(map);
+        release_some(ioctx, std::move(pairs));
+    }
+    static void release_some(ba::io_context &ioctx, std::shared_ptr<map_type> pairs) {
+        for ( std::size_t n = 0; n < release_batch && !pairs->empty(); ++n ) {
+            delete pairs->unlink_leftmost_without_rebalance();
+        }
+        if ( !pairs->empty() ) {
+            ba::post(ioctx, [&ioctx, pairs=std::move(pairs)]() mutable { release_some(ioctx, std::move(pairs)); });
+        }
+    }
 
+    void start_compact_timer() {
+        if ( m_tombstone_ttl == 0 ) {
             return;
         }
+
+        m_compact_timer.expires_after(std::chrono::milliseconds{std::max<std::size_t>(m_tombstone_ttl / 2, 1)});
+        m_compact_timer.async_wait(
+            ba::bind_executor(
+                 m_strand
+                ,[this](const bs::error_code &ec)
+                 { if ( !ec ) compact_tombstones(); }
+            )
+        );
+    }
+    // called on the strand.
+    // the tombstones are in the order of the deletion time
+    void compact_tombstones() {
+        const auto now = ms_time();
+        auto expired = [this, now]
+            { return !m_tombs.empty() && m_tombs.front().time + m_tombstone_ttl <= now; };
+
+        for ( std::size_t n = 0; n < compact_batch && expired(); ++n ) {
+            erase_tombstone(m_tombs.front());
+        }
+
+        if ( expired() ) {
+            ba::post(m_strand, [this](){ compact_tombstones(); });
+        } else {
+            start_compact_timer();
+        }
+    }
+
+    // the stored pair must not keep alive the whole read chunk it was sliced from
+    static void compact(std::string_view &key, std::string_view &val, shared_buffer &buf) {
+        const auto *prev = buf->data();
+        if ( buf->shrink_to_fit() ) {
+            key = std::string_view{buf->data() + (key.data() - prev), key.size()};
+            val = std::string_view{buf->data() + (val.data() - prev), val.size()};
+        }
+    }
+
+    // builds the encoding for the other protocol.
+    // the key and val keep referring to the received encoding.
+    message encode(std::string_view &key, std::string_view &val, shared_buffer buf, protocol proto) {
+        compact(key, val, buf);
+
+        message msg;
+        if ( proto == protocol::text ) {
+            msg.binary = make_binary_data(m_pool, key, val);
+            msg.text = std::move(buf);
+        } else {
+            if ( is_text_representable(key, val) ) {
+                msg.text = make_text_data(m_pool, key, val);
+            }
+            msg.binary = std::move(buf);
+        }
+
+        return msg;
     }
 
 private:
     struct map_value: boost::intrusive::set_base_hook<> {
-        map_value(const std::string_view k, const std::string_view v, shared_buffer kv)
+        map_value(const std::string_view k, const std::string_view v, message m, std::uint64_t t)
             :key{k}
             ,val{v}
-            ,key_val{std::move(kv)}
+            ,msg{std::move(m)}
+            ,time{t}
+            ,deleted{false}
+            ,tomb_hook{}
         {}
 
+        // refer to the chars of the message's encoding the pair was received in
         std::string_view key;
         std::string_view val;
-        shared_buffer key_val;
+        // DATA, or DELE for the tombstone
+        message msg;
+        // ms-time of the last change
+        std::uint64_t time;
+        bool deleted;
+        boost::intrusive::list_member_hook<> tomb_hook;
     };
     struct get_key {
         using type = std::string_view;
@@ -135,10 +625,23 @@ private:
     };
 
     ba::io_context::strand m_strand;
-    boost::intrusive::set<
+    buffers_pool &m_pool;
+    metrics &m_metrics;
+    const std::size_t m_tombstone_ttl;
+    ba::steady_timer m_compact_timer;
+    // ms-time of the latest erased tombstone
+    std::uint64_t m_horizon;
+    // written on the strand only
+    std::atomic_uint64_t m_seq;
+    // the live keys, written on the strand only
+    std::atomic_size_t m_size;
+    std::uint64_t m_epoch;
+    map_type m_map;
+    // in the order of the deletion
+    boost::intrusive::list<
          map_value
-        ,boost::intrusive::key_of_value<get_key>
-    > m_map;
+        ,boost::intrusive::member_hook<map_value, boost::intrusive::list_member_hook<>, &map_value::tomb_hook>
+    > m_tombs;
 };
 
 /**********************************************************************************************************************/
@@ -14,82 +14,493 @@
 #ifndef __shared_state_server__string_buffer_hpp__included
 #define __shared_state_server__string_buffer_hpp__included
 
+#include "utils.hpp"
 #include "intrusive_base.hpp"
 #include "intrusive_ptr.hpp"
 #include "object_pool.hpp"
+#include "memory_pool.hpp"
 
-#include <string>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
 #include <type_traits>
 
 /**********************************************************************************************************************/
 
-struct string_buffer: intrusive_base<string_buffer> {
-    string_buffer()
-        :m_buf{}
+// the pool of the size-classed memory blocks for the string_buffer's chunks.
+// the requests bigger than the biggest class are served by the heap directly.
+
+struct bytes_pool {
+    static constexpr std::size_t min_block_size = 64u;
+    static constexpr std::size_t num_classes = 11u; // 64 bytes .. 64 KiB
+    static constexpr std::size_t max_block_size = min_block_size << (num_classes - 1u);
+    // the maximum bytes of the free blocks kept in each class after `trim()`
+    static constexpr std::size_t max_idle_class_bytes = 1024u * 1024u;
+    // only the classes up to this size are preallocated
+    static constexpr std::size_t max_prealloc_block_size = 256u;
+
+    bytes_pool(const bytes_pool &) = delete;
+    bytes_pool& operator= (const bytes_pool &) = delete;
+
+    bytes_pool(std::size_t capacity, prealloc_mode mode = prealloc_mode::none)
+        :bytes_pool{capacity, mode, std::make_index_sequence<num_classes>{}}
     {}
 
-    template<
-         typename Arg
-        ,typename = typename std::enable_if_t<
-            std::is_same_v<typename std::decay_t<Arg>, string_buffer>
-        >
-    >
-    string_buffer(Arg &&arg)
-        :m_buf{std::forward<Arg>(arg).m_buf}
+    // the size of the block which will be used for the `n` bytes request
+    static constexpr std::size_t block_size(std::size_t n) noexcept
+    { return (n <= max_block_size) ? (min_block_size << class_index(n)) : n; }
+
+    void* allocate(std::size_t n) {
+        if ( n > max_block_size ) {
+            m_large_bytes.fetch_add(n, std::memory_order_relaxed);
+            return ::operator new(n);
+        }
+
+        return m_classes[class_index(n)].acquire();
+    }
+    void deallocate(void *p, std::size_t n) noexcept {
+        if ( n > max_block_size ) {
+            m_large_bytes.fetch_sub(n, std::memory_order_relaxed);
+            ::operator delete(p);
+
+            return;
+        }
+
+        m_classes[class_index(n)].release(p);
+    }
+
+    // releases the idle blocks
+    void trim() {
+        for ( auto &it: m_classes ) {
+            it.trim(max_idle_class_bytes / it.block_size());
+        }
+    }
+
+    // the bytes allocated from the heap, including the free blocks
+    std::size_t bytes() const noexcept {
+        std::size_t res = m_large_bytes.load(std::memory_order_relaxed);
+        for ( const auto &it: m_classes ) {
+            res += it.size() * it.block_size();
+        }
+
+        return res;
+    }
+    // the bytes of the blocks currently in use
+    std::size_t bytes_in_use() const noexcept {
+        std::size_t res = m_large_bytes.load(std::memory_order_relaxed);
+        for ( const auto &it: m_classes ) {
+            res += it.in_use() * it.block_size();
+        }
+
+        return res;
+    }
+
+private:
+    template<std::size_t ...Is>
+    bytes_pool(std::size_t capacity, prealloc_mode mode, std::index_sequence<Is...>)
+        :m_classes{{
+            memory_pool{
+                 min_block_size << Is
+                ,capacity
+                ,((min_block_size << Is) <= max_prealloc_block_size) ? mode : prealloc_mode::none
+            }...
+         }}
+        ,m_large_bytes{}
     {}
 
-    template<
-         typename Arg0
-        ,typename ...Args
-        ,typename = typename std::enable_if_t<
-            !std::is_same_v<typename std::decay_t<Arg0>, string_buffer>
-        >
-    >
-    string_buffer(Arg0 &&arg0, Args && ...args)
-        :m_buf{std::forward<Arg0>(arg0), std::forward<Args>(args)...}
+    static constexpr std::size_t class_index(std::size_t n) noexcept {
+        return (n <= min_block_size)
+            ? 0u
+            : static_cast<std::size_t>(64 - __builtin_clzll(n - 1u)) - 6u
+        ;
+    }
+    static_assert(min_block_size == (1u << 6u));
+
+    std::array<memory_pool, num_classes> m_classes;
+    std::atomic_size_t m_large_bytes;
+};
+
+/**********************************************************************************************************************/
+
+struct buffer_chunk;
+
+struct buffer_chunk_policy {
+    void intrusive_release(buffer_chunk *p) noexcept;
+};
+
+// the refcounted block of chars allocated from the bytes_pool together with its header.
+// the chars are written only by the string_buffer which allocated the chunk, and only past the `tail`,
+// so the already written chars can be referenced by any number of the other buffers without copying.
+
+struct buffer_chunk: intrusive_static_base<buffer_chunk, buffer_chunk_policy> {
+    friend struct buffer_chunk_policy;
+    friend struct string_buffer;
+
+    buffer_chunk(const buffer_chunk &) = delete;
+    buffer_chunk& operator= (const buffer_chunk &) = delete;
+
+    // the chunk with the capacity for at least `n` chars
+    static intrusive_ptr<buffer_chunk> create(bytes_pool &pool, std::size_t n) {
+        const auto block_size = bytes_pool::block_size(sizeof(buffer_chunk) + n);
+        void *mem = pool.allocate(block_size);
+
+        return intrusive_ptr<buffer_chunk>{::new(mem) buffer_chunk{pool, block_size}};
+    }
+
+    char*       data()           noexcept { return reinterpret_cast<char *>(this + 1); }
+    const char* data()     const noexcept { return reinterpret_cast<const char *>(this + 1); }
+    std::size_t capacity() const noexcept { return m_block_size - sizeof(buffer_chunk); }
+
+private:
+    buffer_chunk(bytes_pool &pool, std::size_t block_size) noexcept
+        :m_pool{std::addressof(pool)}
+        ,m_block_size{block_size}
+        ,m_tail{}
+    {}
+
+    bytes_pool *m_pool;
+    const std::size_t m_block_size;
+    // the number of the written chars, accessed only by the writer
+    std::size_t m_tail;
+};
+
+static_assert(sizeof(buffer_chunk) % alignof(std::max_align_t) == 0);
+
+// the capacity of the chunk taking the whole block `block_size(n)`.
+// the callers sizing their buffers by a byte budget reserve this, so the chunk's header
+// does not push a power-of-two budget into the next, twice bigger, size class.
+constexpr std::size_t chunk_capacity(std::size_t n) noexcept
+{ return bytes_pool::block_size(n) - sizeof(buffer_chunk); }
+
+inline void buffer_chunk_policy::intrusive_release(buffer_chunk *p) noexcept {
+    auto *pool = p->m_pool;
+    const auto block_size = p->m_block_size;
+    p->~buffer_chunk();
+    pool->deallocate(p, block_size);
+}
+
+/**********************************************************************************************************************/
+
+// the slice of the buffer_chunk's chars.
+// the buffer which allocated the chunk is its writer, and appends in place while it ends at the chunk's tail.
+// the slices made by `make_slice()` share the chunk without copying and are read-only,
+// so any modification of them, as well as any modification of the writer which can overwrite
+// the shared chars, moves the chars into a new chunk.
+// erasing at the front never copies.
+
+struct string_buffer: intrusive_static_base<string_buffer, object_pool_policy<string_buffer>> {
+    using chunk_ptr = intrusive_ptr<buffer_chunk>;
+
+    struct dynamic_buffer_type;
+
+    explicit string_buffer(bytes_pool &pool) noexcept
+        :m_pool{std::addressof(pool)}
+        ,m_chunk{}
+        ,m_data{nullptr}
+        ,m_size{}
+        ,m_writer{false}
     {}
+    string_buffer(bytes_pool &pool, std::string_view str)
+        :string_buffer{pool}
+    { append(str); }
+    string_buffer(bytes_pool &pool, const char *beg, const char *end)
+        :string_buffer{pool, std::string_view{beg, static_cast<std::size_t>(end - beg)}}
+    {}
+    // the read-only slice of `n` chars of `src` starting from `pos`
+    string_buffer(const string_buffer &src, std::size_t pos, std::size_t n) noexcept
+        :m_pool{src.m_pool}
+        ,m_chunk{src.m_chunk}
+        ,m_data{src.m_data + pos}
+        ,m_size{n}
+        ,m_writer{false}
+    { assert(pos + n <= src.m_size); }
+
+    string_buffer(const string_buffer &) = delete;
+    string_buffer& operator= (const string_buffer &) = delete;
+
+    const char* data()     const noexcept { return m_data; }
+    std::size_t size()     const noexcept { return m_size; }
+    std::size_t length()   const noexcept { return m_size; }
+    std::size_t capacity() const noexcept { return m_size + writable_size(); }
+    bool        empty()    const noexcept { return m_size == 0; }
+
+    std::string_view view()   const noexcept { return {m_data, m_size}; }
+    ba::const_buffer buffer() const noexcept { return ba::const_buffer{m_data, m_size}; }
+
+    // the adapter for the asio's read operations, reading directly into the chunk
+    dynamic_buffer_type dynamic_buffer(std::size_t max_size = std::numeric_limits<std::size_t>::max()) noexcept;
 
-    const auto& string() const noexcept { return m_buf; }
-    auto&       string()       noexcept { return m_buf; }
-    const char* data()   const noexcept { return m_buf.data(); }
-    std::size_t size()   const noexcept { return m_buf.size(); }
-    std::size_t length() const noexcept { return m_buf.length(); }
+    // the space for at least `n` chars past the end, valid until `commit()` or any other modification.
+    // when moved, the new chunk is not smaller than the current one.
+    char* prepare(std::size_t n) {
+        if ( writable_size() < n ) {
+            reallocate(std::max(m_size + n, m_chunk ? m_chunk->capacity() : 0u), 0u);
+        }
 
-    string_buffer& preppend(const char *str) { m_buf.insert(0, str); return *this; }
-    string_buffer& append(char ch) noexcept { m_buf += ch; return *this; }
-    string_buffer& append(const std::string &str) noexcept { m_buf += str; return *this; }
+        return m_data + m_size;
+    }
+    // appends `n` chars written to the space returned by `prepare()`
+    void commit(std::size_t n) noexcept {
+        m_size += n;
+        m_chunk->m_tail = end_offset();
+    }
 
-    void pop_back() noexcept { m_buf.pop_back(); }
-    void erase(std::size_t pos, std::size_t n) { m_buf.erase(pos, n); }
-    void clear() noexcept { m_buf.clear(); }
+    // reserves the capacity rounded up to the size of the pool's block
+    void reserve(std::size_t n) {
+        if ( n > capacity() ) {
+            reallocate(n, 0u);
+        }
+    }
+    // releases the chunk bigger than `max_capacity`
+    void shrink(std::size_t max_capacity) {
+        if ( !m_chunk || m_chunk->capacity() <= max_capacity ) {
+            return;
+        }
 
-    string_buffer& operator=  (const char *str) { m_buf = str; return *this; }
-    string_buffer& operator+= (const char chr) { m_buf += chr; return *this; }
-    string_buffer& operator+= (const char *str) { m_buf += str; return *this; }
-    string_buffer& operator+= (const string_buffer &str) { m_buf += str.m_buf; return *this; }
+        if ( m_size ) {
+            reallocate(m_size, 0u);
+        } else {
+            m_chunk = chunk_ptr{};
+            m_data = nullptr;
+            m_writer = false;
+        }
+    }
+    // moves the chars into the own chunk of the fitting size, if the current one is at least twice bigger.
+    // used to not keep the whole chunk alive by a small long-lived slice.
+    // returns true if the chars were moved.
+    bool shrink_to_fit() {
+        if ( m_chunk && bytes_pool::block_size(sizeof(buffer_chunk) + m_size) * 2u <= m_chunk->m_block_size ) {
+            reallocate(m_size, 0u);
+
+            return true;
+        }
+
+        return false;
+    }
+
+    string_buffer& preppend(std::string_view str) {
+        if ( !m_writer || !m_chunk.unique() || static_cast<std::size_t>(m_data - m_chunk->data()) < str.size() ) {
+            reallocate(m_size, str.size());
+        }
+
+        m_data -= str.size();
+        m_size += str.size();
+        std::memcpy(m_data, str.data(), str.size());
+
+        return *this;
+    }
+    string_buffer& append(char ch) {
+        *prepare(1u) = ch;
+        commit(1u);
+
+        return *this;
+    }
+    string_buffer& append(std::string_view str) {
+        if ( !str.empty() ) {
+            std::memcpy(prepare(str.size()), str.data(), str.size());
+            commit(str.size());
+        }
+
+        return *this;
+    }
+
+    void pop_back() noexcept { --m_size; }
+    // never copies
+    void consume(std::size_t n) noexcept {
+        n = std::min(n, m_size);
+        m_data += n;
+        m_size -= n;
+        if ( m_size == 0 && m_writer && m_chunk.unique() ) {
+            rewind();
+        }
+    }
+    void erase(std::size_t pos, std::size_t n) {
+        n = std::min(n, m_size - pos);
+        if ( pos == 0 ) {
+            consume(n);
+        } else if ( pos + n == m_size ) {
+            m_size -= n;
+        } else if ( m_writer && m_chunk.unique() ) {
+            std::memmove(m_data + pos, m_data + pos + n, m_size - pos - n);
+            m_size -= n;
+        } else {
+            auto chunk = buffer_chunk::create(*m_pool, m_size - n);
+            std::memcpy(chunk->data(), m_data, pos);
+            std::memcpy(chunk->data() + pos, m_data + pos + n, m_size - pos - n);
+            reset(std::move(chunk), 0u, m_size - n);
+        }
+    }
+    void clear() noexcept {
+        // the writer keeps appending at the tail while the chunk is shared
+        m_data += m_size;
+        m_size = 0;
+        if ( m_writer && m_chunk.unique() ) {
+            rewind();
+        }
+    }
+
+    string_buffer& operator=  (std::string_view str) { clear(); return append(str); }
+    string_buffer& operator+= (const char chr) { return append(chr); }
+    string_buffer& operator+= (std::string_view str) { return append(str); }
+    string_buffer& operator+= (const string_buffer &str) { return append(str.view()); }
 
     friend inline bool operator== (const string_buffer &l, const string_buffer &r) noexcept
-    { return l.m_buf == r.m_buf; }
+    { return l.view() == r.view(); }
 
     friend inline bool operator!= (const string_buffer &l, const string_buffer &r) noexcept
-    { return l.m_buf != r.m_buf; }
+    { return l.view() != r.view(); }
 
     friend inline bool operator< (const string_buffer &l, const string_buffer &r) noexcept
-    { return l.m_buf < r.m_buf; }
+    { return l.view() < r.view(); }
+
+private:
+    std::size_t end_offset() const noexcept
+    { return static_cast<std::size_t>(m_data - m_chunk->data()) + m_size; }
+
+    // the writer can write past the end if there are no chars written after it,
+    // or if nobody else references the chunk
+    std::size_t writable_size() const noexcept {
+        if ( !m_writer ) {
+            return 0u;
+        }
+
+        const auto end = end_offset();
+        if ( end != m_chunk->m_tail && !m_chunk.unique() ) {
+            return 0u;
+        }
+
+        return m_chunk->capacity() - end;
+    }
+
+    // must be called only if the buffer is empty and is the only user of the chunk
+    void rewind() noexcept {
+        m_data = m_chunk->data();
+        m_chunk->m_tail = 0u;
+    }
+
+    // moves the chars into the new chunk with the capacity for `n` chars after the `headroom`
+    void reallocate(std::size_t n, std::size_t headroom) {
+        auto chunk = buffer_chunk::create(*m_pool, headroom + std::max(n, m_size));
+        if ( m_size ) {
+            std::memcpy(chunk->data() + headroom, m_data, m_size);
+        }
+        reset(std::move(chunk), headroom, m_size);
+    }
+    void reset(chunk_ptr chunk, std::size_t offset, std::size_t size) noexcept {
+        m_chunk = std::move(chunk);
+        m_data = m_chunk->data() + offset;
+        m_size = size;
+        m_writer = true;
+        m_chunk->m_tail = offset + size;
+    }
 
 private:
-    std::string m_buf;
+    bytes_pool *m_pool;
+    chunk_ptr m_chunk;
+    char *m_data;
+    std::size_t m_size;
+    bool m_writer;
 };
 
 /**********************************************************************************************************************/
 
-using buffers_pool = object_pool<string_buffer>;
+// the asio's DynamicBuffer_v1
+
+struct string_buffer::dynamic_buffer_type {
+    using const_buffers_type = ba::const_buffer;
+    using mutable_buffers_type = ba::mutable_buffer;
+
+    dynamic_buffer_type(string_buffer &buf, std::size_t max_size) noexcept
+        :m_buf{std::addressof(buf)}
+        ,m_max_size{max_size}
+    {}
+
+    std::size_t size()     const noexcept { return m_buf->size(); }
+    std::size_t max_size() const noexcept { return m_max_size; }
+    std::size_t capacity() const noexcept { return m_buf->capacity(); }
+
+    const_buffers_type data() const noexcept { return m_buf->buffer(); }
+
+    mutable_buffers_type prepare(std::size_t n) {
+        if ( size() > m_max_size || m_max_size - size() < n ) {
+            throw std::length_error{"string_buffer too long"};
+        }
+
+        return ba::mutable_buffer{m_buf->prepare(n), n};
+    }
+    void commit(std::size_t n) noexcept { m_buf->commit(std::min(n, m_buf->writable_size())); }
+    void consume(std::size_t n) noexcept { m_buf->consume(n); }
+
+private:
+    string_buffer *m_buf;
+    std::size_t m_max_size;
+};
+
+inline string_buffer::dynamic_buffer_type string_buffer::dynamic_buffer(std::size_t max_size) noexcept
+{ return dynamic_buffer_type{*this, max_size}; }
+
+/**********************************************************************************************************************/
 
 using shared_buffer = intrusive_ptr<string_buffer>;
 
+// the string_buffer objects are pooled by the object_pool,
+// and their chunks are allocated from the size-classed bytes_pool.
+
+struct buffers_pool {
+    buffers_pool(const buffers_pool &) = delete;
+    buffers_pool& operator= (const buffers_pool &) = delete;
+
+    buffers_pool(std::size_t capacity, prealloc_mode mode = prealloc_mode::none)
+        :m_capacity{capacity}
+        ,m_bytes{capacity, mode}
+        ,m_objects{capacity, mode}
+    {}
+
+    template<typename ...Args>
+    shared_buffer get(Args && ...args)
+    { return m_objects.get(m_bytes, std::forward<Args>(args)...); }
+
+    // the empty buffer with the capacity for at least `n` chars
+    shared_buffer get_sized(std::size_t n) {
+        auto buf = get();
+        buf->reserve(n);
+
+        return buf;
+    }
+
+    // the read-only buffer referencing `n` chars of `buf` starting from `pos`, without copying
+    shared_buffer get_slice(const shared_buffer &buf, std::size_t pos, std::size_t n)
+    { return m_objects.get(*buf, pos, n); }
+
+    // releases the idle memory
+    void trim() { m_objects.trim(m_capacity); m_bytes.trim(); }
+
+    std::size_t size() const noexcept { return m_objects.size(); }
+    std::size_t in_use() const noexcept { return m_objects.in_use(); }
+    std::size_t bytes() const noexcept { return m_bytes.bytes(); }
+    std::size_t bytes_in_use() const noexcept { return m_bytes.bytes_in_use(); }
+
+private:
+    const std::size_t m_capacity;
+    bytes_pool m_bytes;
+    object_pool<string_buffer> m_objects;
+};
+
 template<typename ...Args>
 inline auto make_buffer(buffers_pool &pool, Args && ...args)
-{ return pool.get_del([](string_buffer *s){ s->clear(); }, std::forward<Args>(args)...); }
+{ return pool.get(std::forward<Args>(args)...); }
+
+inline auto make_sized_buffer(buffers_pool &pool, std::size_t n)
+{ return pool.get_sized(n); }
+
+inline auto make_slice(buffers_pool &pool, const shared_buffer &buf, std::size_t pos, std::size_t n)
+{ return pool.get_slice(buf, pos, n); }
 
 /**********************************************************************************************************************/
 
@@ -0,0 +1,80 @@
+
+// ----------------------------------------------------------------------------
+//                              Apache License
+//                        Version 2.0, January 2004
+//                     http://www.apache.org/licenses/
+//
+// This file is part of shared-state-server(https://github.com/niXman/shared-state-server) project.
+//
+// This was a test task for implementing multithreaded Shared-State server using asio.
+//
+// Copyright (c) 2023 niXman (github dot nixman dog pm.me). All rights reserved.
+// ----------------------------------------------------------------------------
+
+#ifndef __shared_state_server__thread_index_hpp__included
+#define __shared_state_server__thread_index_hpp__included
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+
+/**********************************************************************************************************************/
+
+// the size of the cache line used to avoid false sharing
+static constexpr std::size_t cache_line_size = 64u;
+
+// the number of the lowest indices given back when their threads exit, so the per-thread caches
+// sized by it are reused by the later threads. the indices above it are never reused
+static constexpr std::size_t reused_thread_indices = 64u;
+
+namespace details {
+
+// the bit is set for each of the reused indices in use
+inline std::atomic_uint64_t thread_indices_in_use{0u};
+inline std::atomic_size_t thread_indices_above{reused_thread_indices};
+
+// the lowest free index. the index given back by the exited thread is acquired,
+// so the next thread sees everything the exited one did with its per-thread caches
+inline std::size_t acquire_thread_index() noexcept {
+    auto used = thread_indices_in_use.load(std::memory_order_relaxed);
+    while ( ~used ) {
+        const auto idx = static_cast<std::size_t>(__builtin_ctzll(~used));
+        if ( thread_indices_in_use.compare_exchange_weak(
+             used, used | (std::uint64_t{1} << idx), std::memory_order_acquire, std::memory_order_relaxed) )
+        {
+            return idx;
+        }
+    }
+
+    return thread_indices_above.fetch_add(1u, std::memory_order_relaxed);
+}
+
+// gives the index back when the thread exits. the thread's later calls get the index
+// no per-thread cache is sized for, so the thread_local destructors running after it bypass the caches
+struct thread_index_release {
+    ~thread_index_release() {
+        const auto idx = std::exchange(index, std::numeric_limits<std::size_t>::max());
+        if ( idx < reused_thread_indices ) {
+            thread_indices_in_use.fetch_and(~(std::uint64_t{1} << idx), std::memory_order_release);
+        }
+    }
+
+    std::size_t &index;
+};
+
+} // ns details
+
+// the index of the calling thread, assigned on first call.
+// the lowest free index is assigned, so the indices are dense
+inline std::size_t this_thread_index() noexcept {
+    static thread_local std::size_t index = details::acquire_thread_index();
+    static thread_local const details::thread_index_release release{index};
+
+    return index;
+}
+
+/**********************************************************************************************************************/
+
+#endif // __shared_state_server__thread_index_hpp__included
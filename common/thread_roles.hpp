@@ -0,0 +1,317 @@
+
+// ----------------------------------------------------------------------------
+//                              Apache License
+//                        Version 2.0, January 2004
+//                     http://www.apache.org/licenses/
+//
+// This file is part of shared-state-server(https://github.com/niXman/shared-state-server) project.
+//
+// This was a test task for implementing multithreaded Shared-State server using asio.
+//
+// Copyright (c) 2023 niXman (github dot nixman dog pm.me). All rights reserved.
+// ----------------------------------------------------------------------------
+
+#ifndef __shared_state_server__thread_roles_hpp__included
+#define __shared_state_server__thread_roles_hpp__included
+
+#include "utils.hpp"
+
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+/**********************************************************************************************************************/
+
+// the roles the threads can be dedicated to, each dedicated role gets its own io_context,
+// the roles not dedicated share the workers' io_context
+enum class thread_role: std::size_t {
+     worker       // the sessions: the sockets I/O and the commands
+    ,accept       // the listeners' accept loops
+    ,storage      // the state_storage's strand, applies the changes and serves the syncs
+    ,fanout       // the session_manager's strand, the broadcasts and the batching
+    ,housekeeping // the signals, the pools trimming and the metrics endpoint
+    ,roles_n
+};
+
+static constexpr std::size_t thread_roles_n = static_cast<std::size_t>(thread_role::roles_n);
+
+inline const char* thread_role_name(thread_role role) noexcept {
+    static const char *names[] = {"worker", "accept", "storage", "fanout", "housekeeping"};
+    static_assert(sizeof(names) / sizeof(names[0]) == thread_roles_n);
+
+    return names[static_cast<std::size_t>(role)];
+}
+
+// the number of the threads dedicated to each role, 0 for the roles sharing the workers
+using thread_roles_config = std::array<std::size_t, thread_roles_n>;
+
+/**********************************************************************************************************************/
+
+// parses the comma separated list of `role:threads`, e.g. `accept:1,fanout:2`.
+// the workers are not listed, their number is given separately
+inline thread_roles_config parse_thread_roles(const std::string &str) {
+    thread_roles_config res{};
+    for ( std::size_t pos = 0; pos < str.size(); ) {
+        auto end = str.find(',', pos);
+        end = (end == std::string::npos) ? str.size() : end;
+        const auto item = str.substr(pos, end - pos);
+        pos = end + 1;
+
+        const auto colon = item.find(':');
+        const auto name = item.substr(0, colon);
+        std::size_t idx = 1;
+        for ( ; idx < thread_roles_n && name != thread_role_name(static_cast<thread_role>(idx)); ++idx )
+        {}
+        if ( colon == std::string::npos || idx == thread_roles_n ) {
+            throw std::invalid_argument{"wrong thread role: " + item};
+        }
+
+        res[idx] = std::stoul(item.substr(colon + 1));
+    }
+
+    return res;
+}
+
+// parses the list of the CPUs in the taskset's format, e.g. `0-3,8`
+inline std::vector<int> parse_cpu_list(const std::string &str) {
+    std::vector<int> res;
+    for ( std::size_t pos = 0; pos < str.size(); ) {
+        auto end = str.find(',', pos);
+        end = (end == std::string::npos) ? str.size() : end;
+        const auto item = str.substr(pos, end - pos);
+        pos = end + 1;
+
+        const auto dash = item.find('-');
+        const auto first = std::stoi(item.substr(0, dash));
+        const auto last = (dash == std::string::npos) ? first : std::stoi(item.substr(dash + 1));
+        if ( first < 0 || last < first || last >= CPU_SETSIZE ) {
+            throw std::invalid_argument{"wrong CPU range: " + item};
+        }
+        for ( auto cpu = first; cpu <= last; ++cpu ) {
+            res.push_back(cpu);
+        }
+    }
+
+    return res;
+}
+
+/**********************************************************************************************************************/
+
+// owns the io_contexts and the threads running them.
+// the threads are started in the roles' order, the dedicated roles first and the workers last,
+// and if the CPUs are given, the thread N is pinned to the CPU `cpus[N % cpus.size()]`.
+// the CPU time is accounted per role with the threads' CPU-time clocks.
+// in the busy-polling mode the threads of the roles on the messages' path (the workers, the storage and the fanout)
+// spin on `poll()` until nothing is ready for the spin budget, and only then block in the kernel,
+// trading the CPU for the wake-up latency.
+
+struct thread_roles final {
+    thread_roles(const thread_roles &) = delete;
+    thread_roles& operator= (const thread_roles &) = delete;
+    thread_roles(thread_roles &&) = delete;
+    thread_roles& operator= (thread_roles &&) = delete;
+
+    // the busy polling is disabled if `busy_poll` is 0
+    thread_roles(
+         std::size_t workers
+        ,const thread_roles_config &dedicated
+        ,std::vector<int> cpus
+        ,std::chrono::microseconds busy_poll = {})
+        :m_busy_poll{busy_poll}
+        ,m_contexts{}
+        ,m_guards{}
+        ,m_threads{}
+    {
+        if ( !cpus.empty() ) {
+            cpu_set_t allowed;
+            CPU_ZERO(&allowed);
+            ::sched_getaffinity(0, sizeof(allowed), &allowed);
+            for ( auto cpu: cpus ) {
+                if ( !CPU_ISSET(cpu, &allowed) ) {
+                    throw std::invalid_argument{"the CPU " + std::to_string(cpu) + " is not available"};
+                }
+            }
+        }
+
+        auto config = dedicated;
+        config[static_cast<std::size_t>(thread_role::worker)] = std::max<std::size_t>(workers, 1u);
+        for ( std::size_t idx = 0; idx < thread_roles_n; ++idx ) {
+            // the workers are started last
+            const auto role_idx = (idx + 1) % thread_roles_n;
+            const auto role = static_cast<thread_role>(role_idx);
+            const auto threads = config[role_idx];
+            if ( !threads ) {
+                continue;
+            }
+
+            m_contexts[role_idx] = std::make_unique<ba::io_context>(static_cast<int>(threads));
+            m_guards.emplace_back(m_contexts[role_idx]->get_executor());
+            for ( std::size_t n = 0; n < threads; ++n ) {
+                const int cpu = cpus.empty() ? -1 : cpus[m_threads.size() % cpus.size()];
+                m_threads.push_back(std::make_unique<thread_info>(role, cpu));
+            }
+        }
+    }
+
+    // the context the role's objects are bound to
+    ba::io_context& context(thread_role role) noexcept {
+        const auto &ctx = m_contexts[static_cast<std::size_t>(role)];
+
+        return ctx ? *ctx : *m_contexts[static_cast<std::size_t>(thread_role::worker)];
+    }
+    bool dedicated(thread_role role) const noexcept {
+        return role == thread_role::worker || m_contexts[static_cast<std::size_t>(role)] != nullptr;
+    }
+    std::size_t threads(thread_role role) const noexcept {
+        std::size_t res = 0;
+        for ( const auto &it: m_threads ) {
+            res += (it->role == role);
+        }
+
+        return res;
+    }
+
+    // runs all the threads, the calling thread becomes the last worker.
+    // blocks until `stop()` is called
+    void run() {
+        std::vector<std::thread> threadsv;
+        threadsv.reserve(m_threads.size());
+        for ( std::size_t idx = 0; idx + 1 < m_threads.size(); ++idx ) {
+            threadsv.emplace_back([this, idx]{ run_thread(*m_threads[idx]); });
+        }
+
+        run_thread(*m_threads.back());
+
+        // wait for all threads to exit
+        for ( auto &it: threadsv ) {
+            it.join();
+        }
+    }
+    // may be called from any thread
+    void stop() {
+        for ( auto &it: m_contexts ) {
+            if ( it ) {
+                it->stop();
+            }
+        }
+    }
+
+    // after `run()` returned: runs the handlers which are ready on all the contexts on the calling thread,
+    // until none is ready. returns the number of the handlers run.
+    // used to complete the objects' shutdown before they are destroyed.
+    std::size_t poll() {
+        std::size_t res = 0;
+        for ( std::size_t n = 1; n; res += n ) {
+            n = 0;
+            for ( auto &it: m_contexts ) {
+                if ( it ) {
+                    it->restart();
+                    n += it->poll();
+                }
+            }
+        }
+
+        return res;
+    }
+
+    // the CPU time in seconds used by the running threads of the role.
+    // may be called from any thread
+    double cpu_seconds(thread_role role) const noexcept {
+        double res = 0;
+        for ( const auto &it: m_threads ) {
+            struct timespec ts;
+            if ( it->role == role
+                && it->started.load(std::memory_order_acquire)
+                && ::clock_gettime(it->clock, &ts) == 0 )
+            {
+                res += static_cast<double>(ts.tv_sec) + static_cast<double>(ts.tv_nsec) / 1e9;
+            }
+        }
+
+        return res;
+    }
+
+private:
+    struct thread_info {
+        thread_info(thread_role r, int c)
+            :role{r}
+            ,cpu{c}
+            ,clock{}
+            ,started{}
+        {}
+
+        const thread_role role;
+        const int cpu;
+        // valid when `started` is set
+        clockid_t clock;
+        std::atomic_bool started;
+    };
+
+    void run_thread(thread_info &info) {
+        if ( info.cpu != -1 ) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(info.cpu, &set);
+            if ( ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) != 0 ) {
+                std::cerr << "can't pin the " << thread_role_name(info.role)
+                          << " thread to the CPU " << info.cpu << std::endl;
+            }
+        }
+        if ( ::pthread_getcpuclockid(::pthread_self(), &info.clock) == 0 ) {
+            info.started.store(true, std::memory_order_release);
+        }
+
+        auto &ctx = context(info.role);
+        if ( m_busy_poll.count() && info.role != thread_role::accept && info.role != thread_role::housekeeping ) {
+            run_busy_poll(ctx);
+        } else {
+            ctx.run();
+        }
+
+        info.started.store(false, std::memory_order_release);
+    }
+
+    void run_busy_poll(ba::io_context &ctx) {
+        using clock = std::chrono::steady_clock;
+        while ( !ctx.stopped() ) {
+            for ( auto idle_since = clock::now(); !ctx.stopped(); ) {
+                if ( ctx.poll() ) {
+                    idle_since = clock::now();
+                } else if ( clock::now() - idle_since >= m_busy_poll ) {
+                    break;
+                }
+            }
+
+            // blocks until the next handler, then spins again
+            ctx.run_one();
+        }
+    }
+
+private:
+    using work_guard = ba::executor_work_guard<ba::io_context::executor_type>;
+
+    const std::chrono::microseconds m_busy_poll;
+    std::unique_ptr<ba::io_context> m_contexts[thread_roles_n];
+    // the dedicated contexts can run out of work, e.g. the fanout's when nobody is connected
+    std::vector<work_guard> m_guards;
+    std::vector<std::unique_ptr<thread_info>> m_threads;
+};
+
+/**********************************************************************************************************************/
+
+#endif // __shared_state_server__thread_roles_hpp__included
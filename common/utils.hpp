@@ -15,12 +15,16 @@
 #define __shared_state_server__utils_hpp__included
 
 #include <chrono>
+#include <tuple>
+#include <utility>
 
 #include <boost/asio.hpp>
 
 namespace ba = boost::asio;
 namespace bs = boost::system;
 using tcp = boost::asio::ip::tcp;
+// the sessions' sockets, either TCP or AF_UNIX
+using stream_socket = boost::asio::generic::stream_protocol::socket;
 
 /**********************************************************************************************************************/
 // error processing
@@ -75,6 +79,24 @@ inline std::uint64_t ms_time() {
     return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
 }
 
+/**********************************************************************************************************************/
+// the asynchronous operations take the completion token (a callback, `ba::bind_executor(...)`,
+// `ba::use_future`, or `ba::use_awaitable` in C++20), so the io threads never wait for the result.
+
+// must be called on the `ex` strand.
+// calls the handler with the args on its associated executor,
+// or right away if the handler has no one.
+template<typename Executor, typename Handler, typename ...Args>
+void complete_handler(const Executor &ex, Handler handler, Args ...args) {
+    auto hex = ba::get_associated_executor(handler, ex);
+    ba::dispatch(
+         hex
+        ,[handler=std::move(handler), args=std::make_tuple(std::move(args)...)]
+         () mutable
+         { std::apply(std::move(handler), std::move(args)); }
+    );
+}
+
 /**********************************************************************************************************************/
 
 #endif // __shared_state_server__utils_hpp__included
@@ -15,17 +15,27 @@
 
 #include <iostream>
 
-#include "../common/fnv1a.hpp"
 #include "../common/utils.hpp"
-#include "../common/intrusive_ptr.hpp"
-#include "../common/object_pool.hpp"
 #include "../common/string_buffer.hpp"
+#include "../common/protocol.hpp"
+#include "../common/command_registry.hpp"
 #include "../common/state_storage.hpp"
 #include "../common/session.hpp"
+#include "../common/session_table.hpp"
 #include "../common/session_manager.hpp"
 #include "../common/acceptor.hpp"
+#include "../common/admission.hpp"
+#include "../common/metrics.hpp"
+#include "../common/shm_ring.hpp"
+#include "../common/thread_roles.hpp"
+#include "../common/replica.hpp"
+#include "../common/handoff.hpp"
 
+#include <atomic>
+#include <charconv>
+#include <functional>
 #include <thread>
+#include <utility>
 #include <vector>
 
 #ifndef HIDE_DEBUG_OUTPUT
@@ -34,8 +44,6 @@
 #   define DEBUG_EXPR(...)
 #endif
 
-using session_ptr = session::session_ptr;
-
 /**********************************************************************************************************************/
 
 // PING - is sent only by the client to the server,
@@ -45,18 +53,91 @@ using session_ptr = session::session_ptr;
 // DATA - is sent both by the client to the server and by the server to the client
 //        in the form "DATA key val\n".
 
-// STOP - is sent by the server to clients in form "STOP \n", telling them that they should
-//        disconnect and reconnect later because the server will reset its state.
+// STOP - is sent by the server to clients in form "STOP ms\n", telling them that they should
+//        disconnect and reconnect not earlier than after `ms` milliseconds because the server
+//        resets its state. the server closes the connection after it. the delays are spread
+//        over the reset window, so the clients come back gradually.
 
-static constexpr auto ALL_CMDS_LEN = 4u;
+// SUBS - is sent only by the client to the server,
+//        in the form "SUBS prefix\n" or "SUBS prefix since\n".
+//        subscribes the client to the changes of all the keys starting with the prefix
+//        and sends the client all the current key-val pairs matching the prefix.
+//        the empty prefix means all the keys.
+//        when `since` (ms-time) is specified, only the pairs changed after it are sent,
+//        and the keys deleted after it are sent as DELE. if the tombstones of that time
+//        were already erased, all the current pairs are sent as without `since`.
 
-static constexpr auto PING_CMD = std::string_view{"PING"};
-static_assert(PING_CMD.size() == ALL_CMDS_LEN);
-static constexpr auto PING_HASH = fnv1a(PING_CMD);
+// DACK - is sent only by the client to the server,
+//        in the form "DACK id key val\n".
+//        the same as DATA, but the server replies with ACKS when the update is applied.
+//        the id is an unsigned integer chosen by the client.
+
+// ACKS - is sent only by the server to the client,
+//        in the form "ACKS id:changed id:changed...\n", where `changed` is 1 if the value was changed, otherwise 0.
+//        the results of the DACKs applied while the previous ACKS was not sent yet are sent in one line.
+
+// COMP - is sent both by the client to the server and by the server to the client,
+//        in the form "COMP zlib\n".
+//        the server replies with "COMP zlib\n", and everything the server sends after the reply
+//        is the raw deflate stream, flushed after each message (see compression.hpp).
+//        the server replies with "COMP none\n" if the compression is disabled.
+//        the client-to-server direction is never compressed.
+
+// DELE - is sent both by the client to the server and by the server to the client
+//        in the form "DELE key\n".
+//        deletes the key, the deleted key is kept as the tombstone for `tombstone_ttl` MS.
+
+// USUB - is sent only by the client to the server,
+//        in the form "USUB prefix\n".
+//        unsubscribes the client from the prefix previously subscribed with SUBS.
+
+// BTCH - is sent only by the client to the server,
+//        in the form "BTCH 1\n" or "BTCH 0\n".
+//        enables/disables the batching of the changes sent to the client:
+//        the changes are accumulated and sent every `batch_interval` microseconds,
+//        or earlier when `batch_bytes` are accumulated.
+
+// BUSY - is sent only by the server to the client,
+//        in the form "BUSY ms\n", always in the text form because it's sent before anything is read.
+//        the connection is rejected by the admission control and closed after it,
+//        the client should reconnect not earlier than after `ms` milliseconds.
+
+// REPL - is sent only by the replica to the primary, in the binary protocol only,
+//        see protocol.hpp for the payload. the primary replies with REPL telling the `since`
+//        the sync is started from, 0 for the full sync, subscribes the replica to all the keys,
+//        and precedes each DATA/DELE sent to it with RSEQ. see replica.hpp.
+//        the replica serves REPL the same way, so the replicas can be chained into the relays tree,
+//        the reply tells the number of the hops between the server and the primary.
+//        the replica not synced with its upstream yet replies with STOP, since its state can miss the keys.
+
+// RSEQ - is sent only by the primary to the replica, in the binary protocol only,
+//        carries the sequence number and the ms-time of the change which follows it.
+
+// SYND - is sent only by the primary to the replica, in the binary protocol only,
+//        after the last message of the sync started by REPL.
 
+// PROT - is sent only by the client to the server as the first line,
+//        in the form "PROT bin\n" or "PROT txt\n".
+//        switches the connection to the binary (or keeps the text) protocol, the server replies
+//        with the same line. see protocol.hpp for the binary framing.
+
+// to add a command, add its handler to `text_commands` below
+
+static constexpr auto PING_CMD = std::string_view{"PING"};
 static constexpr auto DATA_CMD = std::string_view{"DATA"};
-static_assert(DATA_CMD.size() == ALL_CMDS_LEN);
-static constexpr auto DATA_HASH = fnv1a(DATA_CMD);
+static constexpr auto SUBS_CMD = std::string_view{"SUBS"};
+static constexpr auto USUB_CMD = std::string_view{"USUB"};
+static constexpr auto BTCH_CMD = std::string_view{"BTCH"};
+static constexpr auto PROT_CMD = std::string_view{"PROT"};
+static constexpr auto DELE_CMD = std::string_view{"DELE"};
+static constexpr auto DACK_CMD = std::string_view{"DACK"};
+static constexpr auto COMP_CMD = std::string_view{"COMP"};
+
+// the max number of the messages sent by one sync step
+static constexpr std::size_t sync_batch = 64u;
+// the time in MS the session is given to write its queued messages on the hot restart,
+// the session not drained in time is closed instead of being handed off
+static constexpr std::size_t handoff_drain_time = 3000u;
 
 /**********************************************************************************************************************/
 
@@ -69,14 +150,12 @@ void error_handler(const error_info &ei) {
 // PING
 
 template<typename ErrorCB>
-bool handle_ping(const ErrorCB &error_cb, shared_buffer buf, session_ptr session) {
-    auto *session_ptr = session.get();
-    session_ptr->send(
+bool handle_ping(const ErrorCB &error_cb, shared_buffer buf, session &session) {
+    session.send(
          [](bool){}
         ,error_cb
         ,std::move(buf)
         ,false
-        ,std::move(session)
     );
 
     return true;
@@ -86,52 +165,398 @@ bool handle_ping(const ErrorCB &error_cb, shared_buffer buf, session_ptr session
 // called on socket strand
 // DATA
 
+// AckCB's signature: void(bool changed)
+template<typename ErrorCB, typename AckCB>
+bool handle_data(
+     const ErrorCB &error_cb
+    ,state_storage &state
+    ,session_manager &smgr
+    ,shared_buffer buf
+    ,std::string_view key
+    ,std::string_view val
+    ,session &session
+    ,AckCB ack_cb)
+{
+    state.update(
+         key
+        ,val
+        ,std::move(buf)
+        ,session.read_protocol()
+        ,[error_cb=std::move(error_cb), &smgr, sender=session.handle()]
+         (message msg, std::string_view key) mutable
+         { smgr.broadcast(std::move(msg), key, false, std::move(error_cb), sender); }
+        ,std::move(ack_cb)
+    );
+
+    return true;
+}
+
 template<typename ErrorCB>
 bool handle_data(
      const ErrorCB &error_cb
     ,state_storage &state
     ,session_manager &smgr
     ,shared_buffer buf
-    ,session_ptr session)
+    ,std::string_view key
+    ,std::string_view val
+    ,session &session)
+{ return handle_data(error_cb, state, smgr, std::move(buf), key, val, session, [](bool){}); }
+
+/**********************************************************************************************************************/
+
+void start_sync(
+     state_storage &state
+    ,admission_control &admission
+    ,std::string prefix
+    ,std::uint64_t since
+    ,session &session
+    ,shared_buffer done = {});
+
+// the arguments of the text command, without the trailing new-line char
+inline std::string_view get_args(const shared_buffer &buf) {
+    auto args = std::string_view{buf->data() + (4 + 1), buf->size() - (4 + 1)}; // 1 - because of space char
+    if ( !args.empty() && args.back() == '\n' ) {
+        args.remove_suffix(1);
+    }
+
+    return args;
+}
+
+/**********************************************************************************************************************/
+// called on socket strand
+// SUBS
+
+bool handle_subs(
+     state_storage &state
+    ,session_manager &smgr
+    ,admission_control &admission
+    ,std::string prefix
+    ,std::uint64_t since
+    ,session &session)
 {
-    const auto data = std::string_view{buf->data() + (4 + 1), buf->size() - (4 + 1)}; // 1 - because of space char
-    const auto pos  = data.find(' ');
-    if ( pos != std::string_view::npos ) {
-        const auto key = data.substr(0, pos);
-        const auto val = data.substr(pos+1);
-        state.update(
-             key
-            ,val
-            ,std::move(buf)
-            ,[error_cb=std::move(error_cb), &smgr, session=std::move(session)]
-             (shared_buffer buf) mutable
-             { smgr.broadcast(std::move(buf), false, std::move(error_cb), std::move(session)); }
-        );
+    auto prefix2 = prefix;
+    smgr.subscribe(
+         std::move(prefix2)
+        ,session
+        ,[&state, &admission, prefix=std::move(prefix), since, session=std::addressof(session)]
+         (bool subscribed) mutable
+         { if ( subscribed ) start_sync(state, admission, std::move(prefix), since, *session); }
+    );
+
+    return true;
+}
+
+/**********************************************************************************************************************/
+// called on socket strand
+// DELE
+
+template<typename ErrorCB>
+bool handle_dele(
+     const ErrorCB &error_cb
+    ,state_storage &state
+    ,session_manager &smgr
+    ,shared_buffer buf
+    ,std::string_view key
+    ,session &session)
+{
+    state.remove(
+         key
+        ,std::move(buf)
+        ,session.read_protocol()
+        ,[error_cb=std::move(error_cb), &smgr, sender=session.handle()]
+         (message msg, std::string_view key) mutable
+         { smgr.broadcast(std::move(msg), key, false, std::move(error_cb), sender); }
+    );
+
+    return true;
+}
+
+/**********************************************************************************************************************/
+// called on socket strand
+// USUB
+
+bool handle_usub(session_manager &smgr, std::string prefix, session &session) {
+    smgr.unsubscribe(std::move(prefix), session);
+
+    return true;
+}
+
+/**********************************************************************************************************************/
+// called on socket strand
+// BTCH
+
+bool handle_btch(session_manager &smgr, bool enable, session &session) {
+    smgr.set_batching(enable, session);
+
+    return true;
+}
+
+/**********************************************************************************************************************/
+// called on socket strand
+// PROT
+
+template<typename ErrorCB>
+bool handle_prot(const ErrorCB &error_cb, shared_buffer buf, session &session) {
+    const auto args = get_args(buf);
+    if ( args != "bin" && args != "txt" ) {
+        return false;
+    }
+
+    // the request is sent back as the reply
+    const auto proto = (args == "bin") ? protocol::binary : protocol::text;
+    return session.switch_protocol(proto, std::move(buf), error_cb);
+}
+
+/**********************************************************************************************************************/
+
+struct command_context {
+    state_storage &state;
+    session_manager &smgr;
+    admission_control &admission;
+    // 0 if the compression is disabled
+    int compress_level;
+    // the SO_BUSY_POLL's time in microseconds set to the TCP sockets, 0 if not set
+    int so_busy_poll;
+    buffers_pool &pool;
+    // the minimal window in MS the clients' reconnects are spread over on the reset
+    std::size_t reset_window;
+    // the client following the upstream if this server is a replica, nullptr for the primary.
+    // the replica's state is changed by the upstream only
+    const replica_client *replica;
+};
+
+/**********************************************************************************************************************/
+// called on socket strand
+
+template<typename ErrorCB>
+bool check_writable(const command_context &ctx, const ErrorCB &error_cb) {
+    if ( ctx.replica ) {
+        CALL_ERROR_HANDLER(error_cb, MAKE_ERROR_INFO_2("on_readed", -1, "the replica is read-only!"));
+
+        return false;
+    }
+
+    return true;
+}
+
+/**********************************************************************************************************************/
+// called on socket strand
+// COMP
+
+template<typename ErrorCB>
+bool handle_comp(const ErrorCB &error_cb, int level, std::string_view method, session &session) {
+    if ( method != "zlib" ) {
+        return false;
+    }
+
+    session.enable_compression(level, error_cb);
+
+    return true;
+}
+
+/**********************************************************************************************************************/
+// called on socket strand
+// REPL
+
+template<typename ErrorCB>
+bool handle_repl(
+     const ErrorCB &error_cb
+    ,const command_context &ctx
+    ,std::uint64_t since
+    ,std::uint64_t epoch
+    ,session &session)
+{
+    session.set_replica();
+    // the relay's own state can miss the keys until its sync is over, so the replica comes back later
+    if ( ctx.replica && !ctx.replica->synced() ) {
+        session.send([](bool){}, error_cb, make_stop(ctx.pool, ctx.replica->reconnect_delay()), true);
 
         return true;
     }
 
-    return false;
+    ctx.state.resume_point(
+         since
+        ,epoch
+        ,session.make_handler(
+            [&ctx, error_cb, ses=std::addressof(session)]
+            (std::uint64_t since, std::uint64_t seq, std::uint64_t epoch)
+            {
+                const std::uint64_t hops = ctx.replica ? ctx.replica->hops() : 0u;
+                auto reply = make_binary_varints(ctx.pool, binary_cmd::repl, since, seq, epoch, hops);
+                ses->send([](bool){}, error_cb, std::move(reply), false);
+                // the sync is started even if the replica was subscribed already.
+                // the replica can resume after the sync only, when it got all the keys changed since
+                auto done = make_binary_varints(ctx.pool, binary_cmd::synd, seq);
+                ctx.smgr.subscribe(
+                     std::string{}
+                    ,*ses
+                    ,[&ctx, since, done=std::move(done), ses]
+                     (bool) mutable
+                     { start_sync(ctx.state, ctx.admission, std::string{}, since, *ses, std::move(done)); }
+                );
+            }
+        )
+    );
+
+    return true;
 }
 
 /**********************************************************************************************************************/
 // called on socket strand
 
 template<typename ErrorCB>
-bool on_readed(
-     state_storage &state
-    ,session_manager &smgr
+bool on_frame(
+     const command_context &ctx
     ,const ErrorCB &error_cb
     ,shared_buffer buf
-    ,session_ptr session)
+    ,session &session)
 {
-    if ( buf->size() > ALL_CMDS_LEN && *(buf->data() + ALL_CMDS_LEN) == ' ' ) {
-        std::string_view cmd{buf->data(), ALL_CMDS_LEN};
-        switch ( auto hash = fnv1a(cmd); hash ) {
-            case PING_HASH: { return handle_ping(error_cb, std::move(buf), std::move(session)); }
-            case DATA_HASH: { return handle_data(error_cb, state, smgr, std::move(buf), std::move(session)); }
-            default: { CALL_ERROR_HANDLER(error_cb, MAKE_ERROR_INFO_2("on_readed", -1, "wrong line received!")); return false; }
+    auto &state = ctx.state;
+    auto &smgr = ctx.smgr;
+
+    binary_frame frame;
+    if ( parse_frame(buf->view(), frame) ) {
+        const auto payload = frame.payload;
+        switch ( frame.cmd ) {
+            case binary_cmd::ping: { return handle_ping(error_cb, std::move(buf), session); }
+            case binary_cmd::data: {
+                std::string_view key, val;
+                if ( !parse_data_payload(payload, key, val) ) { break; }
+                if ( !check_writable(ctx, error_cb) ) { return false; }
+
+                return handle_data(error_cb, state, smgr, std::move(buf), key, val, session);
+            }
+            case binary_cmd::subs: {
+                std::string_view prefix;
+                std::uint64_t since;
+                if ( !parse_subs_payload(payload, prefix, since) ) { break; }
+
+                return handle_subs(state, smgr, ctx.admission, std::string{prefix}, since, session);
+            }
+            case binary_cmd::usub: { return handle_usub(smgr, std::string{payload}, session); }
+            case binary_cmd::btch: {
+                if ( payload.size() != 1 || (payload.front() != 0 && payload.front() != 1) ) { break; }
+
+                return handle_btch(smgr, payload.front() == 1, session);
+            }
+            case binary_cmd::dele: {
+                if ( !check_writable(ctx, error_cb) ) { return false; }
+
+                return handle_dele(error_cb, state, smgr, std::move(buf), payload, session);
+            }
+            case binary_cmd::dack: {
+                // the DATA frame is stored and broadcasted
+                if ( !check_writable(ctx, error_cb) ) { return false; }
+                std::uint64_t id;
+                std::string_view key, val;
+                if ( !dack_to_data_frame(*buf, id) ) { break; }
+                if ( !parse_frame(buf->view(), frame) || !parse_data_payload(frame.payload, key, val) ) { break; }
+
+                auto ack = session.make_ack(id, error_cb);
+                return handle_data(error_cb, state, smgr, std::move(buf), key, val, session, std::move(ack));
+            }
+            case binary_cmd::comp: { return handle_comp(error_cb, ctx.compress_level, payload, session); }
+            case binary_cmd::repl: {
+                std::uint64_t since, epoch;
+                if ( !parse_varints_payload(payload, since, epoch) ) { break; }
+
+                return handle_repl(error_cb, ctx, since, epoch, session);
+            }
+            default: break;
+        }
+    }
+
+    CALL_ERROR_HANDLER(error_cb, MAKE_ERROR_INFO_2("on_frame", -1, "wrong frame received!"));
+
+    return false;
+}
+
+/**********************************************************************************************************************/
+// the text commands
+
+// called on socket strand
+using text_handler = bool(*)(const command_context &ctx, shared_buffer buf, session &session);
+
+static constexpr command<text_handler> text_commands[] = {
+     {PING_CMD, [](const command_context &, shared_buffer buf, session &session)
+         { return handle_ping(error_handler, std::move(buf), session); }}
+    ,{DATA_CMD, [](const command_context &ctx, shared_buffer buf, session &session) {
+         if ( !check_writable(ctx, error_handler) ) { return false; }
+         const auto args = get_args(buf);
+         const auto pos  = args.find(' ');
+         if ( pos == std::string_view::npos ) { return false; }
+
+         const auto key = args.substr(0, pos);
+         const auto val = args.substr(pos + 1);
+         return handle_data(error_handler, ctx.state, ctx.smgr, std::move(buf), key, val, session);
+     }}
+    ,{SUBS_CMD, [](const command_context &ctx, shared_buffer buf, session &session) {
+         const auto args = get_args(buf);
+         const auto pos  = args.find(' ');
+         std::uint64_t since = 0;
+         if ( pos != std::string_view::npos ) {
+             const auto str = args.substr(pos + 1);
+             const auto res = std::from_chars(str.data(), str.data() + str.size(), since);
+             if ( res.ec != std::errc{} || res.ptr != str.data() + str.size() ) { return false; }
+         }
+
+         return handle_subs(ctx.state, ctx.smgr, ctx.admission, std::string{args.substr(0, pos)}, since, session);
+     }}
+    ,{USUB_CMD, [](const command_context &ctx, shared_buffer buf, session &session)
+         { return handle_usub(ctx.smgr, std::string{get_args(buf)}, session); }}
+    ,{BTCH_CMD, [](const command_context &ctx, shared_buffer buf, session &session) {
+         const auto args = get_args(buf);
+         if ( args.empty() || (args.front() != '0' && args.front() != '1') ) { return false; }
+
+         return handle_btch(ctx.smgr, args.front() == '1', session);
+     }}
+    ,{PROT_CMD, [](const command_context &, shared_buffer buf, session &session)
+         { return handle_prot(error_handler, std::move(buf), session); }}
+    ,{DACK_CMD, [](const command_context &ctx, shared_buffer buf, session &session) {
+         // "DACK id key val\n" is converted into "DATA key val\n" which is stored and broadcasted
+         if ( !check_writable(ctx, error_handler) ) { return false; }
+         auto args = get_args(buf);
+         std::uint64_t id;
+         const auto res = std::from_chars(args.data(), args.data() + args.size(), id);
+         if ( res.ec != std::errc{} || res.ptr == args.data() + args.size() || *res.ptr != ' ' ) { return false; }
+
+         buf->consume(static_cast<std::size_t>(res.ptr + 1 - buf->data()));
+         buf->preppend("DATA ");
+         args = get_args(buf);
+         const auto pos  = args.find(' ');
+         if ( pos == std::string_view::npos ) { return false; }
+
+         const auto key = args.substr(0, pos);
+         const auto val = args.substr(pos + 1);
+         auto ack = session.make_ack(id, error_handler);
+         return handle_data(error_handler, ctx.state, ctx.smgr, std::move(buf), key, val, session, std::move(ack));
+     }}
+    ,{COMP_CMD, [](const command_context &ctx, shared_buffer buf, session &session)
+         { return handle_comp(error_handler, ctx.compress_level, get_args(buf), session); }}
+    ,{DELE_CMD, [](const command_context &ctx, shared_buffer buf, session &session) {
+         if ( !check_writable(ctx, error_handler) ) { return false; }
+         const auto key = get_args(buf);
+         if ( key.empty() || key.find(' ') != std::string_view::npos ) { return false; }
+
+         return handle_dele(error_handler, ctx.state, ctx.smgr, std::move(buf), key, session);
+     }}
+};
+static constexpr command_registry text_registry{text_commands};
+
+/**********************************************************************************************************************/
+// called on socket strand
+
+bool on_readed(const command_context &ctx, shared_buffer buf, session &session) {
+    if ( session.read_protocol() == protocol::binary ) {
+        return on_frame(ctx, error_handler, std::move(buf), session);
+    }
+
+    if ( buf->size() > command_name_size && *(buf->data() + command_name_size) == ' ' ) {
+        if ( auto handler = text_registry.find(buf->data()); handler ) {
+            return handler(ctx, std::move(buf), session);
         }
+
+        CALL_ERROR_HANDLER(error_handler, MAKE_ERROR_INFO_2("on_readed", -1, "wrong line received!"));
     }
 
     return false;
@@ -140,74 +565,220 @@ bool on_readed(
 /**********************************************************************************************************************/
 // called on socket's strand
 
-template<typename Iter>
-void sync_next(state_storage &state, Iter prev, session_ptr session) {
-    auto [latest, iter, buf] = state.get_next(std::move(prev));
-    if ( !latest ) {
-        auto *session_ptr = session.get();
-        auto session2 = session;
-        session_ptr->send(
-            [&state, iter=std::move(iter), session=std::move(session)]
-             (bool sent)
-             { if ( sent ) sync_next(state, std::move(iter), std::move(session)); }
-            ,error_handler
-            ,std::move(buf)
-            ,false
-            ,std::move(session2)
-        );
+void sync_next(
+     state_storage &state
+    ,std::string prefix
+    ,std::uint64_t since
+    ,std::vector<message> prev
+    ,std::string_view prev_key
+    ,admission_control::sync_permit permit
+    ,shared_buffer done
+    ,session &session);
+
+// called on socket's strand.
+// the frame telling the end of the sync, if any, is sent after the sync's last message
+void sync_done(shared_buffer done, session &session) {
+    if ( done ) {
+        session.send([](bool){}, error_handler, std::move(done), false);
     }
 }
 
-// called on acceptor strand
-void start_sync(state_storage &state, session_ptr session) {
-    auto [latest, iter, buf] = state.get_first();
-    if ( !latest ) {
-        auto *session_ptr = session.get();
-        auto session2 = session;
-        session_ptr->send(
-            [&state, iter=std::move(iter), session=std::move(session)]
-             (bool sent)
-             { if ( sent ) sync_next(state, std::move(iter), std::move(session)); }
-            ,error_handler
-            ,std::move(buf)
-            ,false
-            ,std::move(session2)
-        );
+// called on socket's strand.
+// the key refers to the last message's chars, so the messages are kept until the next batch is got.
+// the permit is kept until the sync is finished or dropped
+void sync_send(
+     state_storage &state
+    ,std::string prefix
+    ,std::uint64_t since
+    ,bool latest
+    ,std::string_view key
+    ,std::vector<message> msgs
+    ,admission_control::sync_permit permit
+    ,shared_buffer done
+    ,session &session)
+{
+    auto to_send = msgs;
+    session.send(
+        [&state, prefix=std::move(prefix), since, latest, key, msgs=std::move(msgs), permit=std::move(permit)
+            ,done=std::move(done), session=std::addressof(session)]
+         (bool sent) mutable
+         {
+            if ( !sent ) {
+                return;
+            }
+            if ( latest ) {
+                return sync_done(std::move(done), *session);
+            }
+
+            sync_next(state, std::move(prefix), since, std::move(msgs), key, std::move(permit), std::move(done), *session);
+         }
+        ,error_handler
+        ,std::move(to_send)
+    );
+}
+
+// called on socket's strand.
+// continues from the previous key, so the sync is not affected by the keys deleted meanwhile
+void sync_next(
+     state_storage &state
+    ,std::string prefix
+    ,std::uint64_t since
+    ,std::vector<message> prev // keeps the prev_key's chars alive
+    ,std::string_view prev_key
+    ,admission_control::sync_permit permit
+    ,shared_buffer done
+    ,session &session)
+{
+    state.get_next(
+         prev_key
+        ,prefix
+        ,since
+        ,sync_batch
+        ,session.make_handler(
+            [&state, prefix, since, prev=std::move(prev), permit=std::move(permit), done=std::move(done)
+                ,session=std::addressof(session)]
+            (bool latest, std::string_view key, std::vector<message> msgs) mutable
+            {
+                if ( msgs.empty() ) {
+                    return sync_done(std::move(done), *session);
+                }
+
+                sync_send(state, std::move(prefix), since, latest, key, std::move(msgs), std::move(permit), std::move(done), *session);
+            }
+         )
+    );
+}
+
+// called on socket's strand.
+// the storage is queried on its own strand, and the result is sent from the socket's strand,
+// so the io threads never wait for the storage
+void sync_first(
+     state_storage &state
+    ,std::string prefix
+    ,std::uint64_t since
+    ,admission_control::sync_permit permit
+    ,shared_buffer done
+    ,session &session)
+{
+    state.get_first(
+         prefix
+        ,since
+        ,sync_batch
+        ,session.make_handler(
+            [&state, prefix, since, permit=std::move(permit), done=std::move(done), session=std::addressof(session)]
+            (bool latest, std::string_view key, std::vector<message> msgs) mutable
+            {
+                if ( msgs.empty() ) {
+                    return sync_done(std::move(done), *session);
+                }
+
+                sync_send(state, std::move(prefix), since, latest, key, std::move(msgs), std::move(permit), std::move(done), *session);
+            }
+         )
+    );
+}
+
+// called on socket's strand.
+// when the number of the concurrent syncs is limited, the sync waits for the free slot
+void start_sync(
+     state_storage &state
+    ,admission_control &admission
+    ,std::string prefix
+    ,std::uint64_t since
+    ,session &session
+    ,shared_buffer done)
+{
+    admission_control::sync_permit permit;
+    if ( admission.try_acquire_sync(permit) ) {
+        return sync_first(state, std::move(prefix), since, std::move(permit), std::move(done), session);
     }
+
+    admission.wait_sync(
+        session.make_handler(
+            [&state, prefix=std::move(prefix), since, done=std::move(done), session=std::addressof(session)]
+            (admission_control::sync_permit permit) mutable
+            { sync_first(state, std::move(prefix), since, std::move(permit), std::move(done), *session); }
+        )
+    );
 }
 
 /**********************************************************************************************************************/
 
-// called on acceptor strand
-void on_new_connection(state_storage &state, session_manager &smgr, tcp::socket sock) {
-    auto ep = sock.remote_endpoint();
-    auto addr = ep.address().to_string();
-    addr += ":";
-    addr += std::to_string(ep.port());
-
-    auto size_fut = state.size();
-    std::cout << "new connection from: " << addr
-              << ", will send " << size_fut.get() << " pairs..." << std::endl;
-
-    auto session = smgr.create(std::move(sock));
-    session->start(
-         [&state, &smgr]
-         (shared_buffer buf, session_ptr session)
-         { return on_readed(state, smgr, error_handler, std::move(buf), std::move(session)); }
-        ,error_handler
-        ,session
+// called on socket's strand.
+// the connection is closed after the BUSY reply, which tells the client when to retry
+void reject_connection(stream_socket sock, std::size_t retry_after) {
+    auto sock_ptr = std::make_unique<stream_socket>(std::move(sock));
+    auto reply = std::make_unique<std::string>("BUSY " + std::to_string(retry_after) + "\n");
+    auto &sock_ref = *sock_ptr;
+    const auto buf = ba::buffer(*reply);
+    ba::async_write(
+         sock_ref
+        ,buf
+        ,[sock=std::move(sock_ptr), reply=std::move(reply)]
+         (const bs::error_code &, std::size_t)
+         {
+            bs::error_code ec;
+            sock->shutdown(stream_socket::shutdown_both, ec);
+         }
     );
+}
+
+// called on the connection's strand, so the accept loop is not slowed down by it.
+// nothing here blocks or logs, the connections are counted by the metrics
+void on_new_connection(const command_context &ctx, bool subscribe_all, stream_socket sock) {
+    if ( const auto retry_after = ctx.admission.admit(); retry_after ) {
+        return reject_connection(std::move(sock), retry_after);
+    }
+
+    ctx.smgr.create(
+         std::move(sock)
+        ,[&ctx, subscribe_all]
+         (session &ses)
+         {
+            ses.start(
+                 [&ctx]
+                 (shared_buffer buf, session &ses)
+                 { return on_readed(ctx, std::move(buf), ses); }
+                ,error_handler
+            );
 
-    start_sync(state, std::move(session));
+            if ( subscribe_all ) {
+                ses.post(
+                    [&ctx, ses=std::addressof(ses)]
+                    ()
+                    { start_sync(ctx.state, ctx.admission, std::string{}, 0, *ses); }
+                );
+            }
+         }
+    );
+    ctx.admission.admitted();
+}
+
+// called before the io_contexts are run, for each connection handed off by the previous process
+void on_handed_off_connection(const command_context &ctx, ba::io_context &ioctx, const detached_session &state) {
+    ctx.smgr.adopt(
+         make_handoff_socket(ioctx, state.fd)
+        ,state
+        ,[&ctx, &state]
+         (session &ses)
+         {
+            ses.resume(
+                 state
+                ,[&ctx]
+                 (shared_buffer buf, session &ses)
+                 { return on_readed(ctx, std::move(buf), ses); }
+                ,error_handler
+            );
+         }
+    );
 }
 
 /**********************************************************************************************************************/
 
-void start_statistics_timer(
+// returns the pooled memory not used anymore back to the system
+void start_trim_timer(
      ba::io_context &ioctx
     ,buffers_pool &bufs
-    ,sessions_pool &ses
-    ,session_manager &smgr
     ,std::unique_ptr<ba::steady_timer> timer = {})
 {
     timer = (!timer) ? std::make_unique<ba::steady_timer>(ioctx) : std::move(timer);
@@ -215,76 +786,394 @@ void start_statistics_timer(
     auto *timer_ptr = timer.get();
     timer_ptr->expires_from_now(std::chrono::seconds(1));
     timer_ptr->async_wait(
-        [&ioctx, &bufs, &ses, &smgr, timer=std::move(timer)]
+        [&ioctx, &bufs, timer=std::move(timer)]
         (bs::error_code) mutable
     {
-        std::cout
-            << "buffers  in use   : " << bufs.in_use() << std::endl
-            << "sessions in use   : " << ses.in_use() << std::endl
-            << "active connections: " << smgr.size() << std::endl
-            << "===============================" << std::endl
-        ;
-        start_statistics_timer(ioctx, bufs, ses, smgr, std::move(timer));
+        bufs.trim();
+        start_trim_timer(ioctx, bufs, std::move(timer));
     });
 }
 
+/**********************************************************************************************************************/
+// may be called from any thread, reads only the lock-free counters
+
+std::string render_metrics(
+     const metrics &mtr
+    ,const admission_control &adm
+    ,const buffers_pool &bufs
+    ,const session_table &ses
+    ,const thread_roles &roles
+    ,const replica_client *replica
+    ,std::size_t keys
+    ,std::uint64_t seq)
+{
+    std::string out;
+    std::vector<std::pair<const char *, double>> cpu;
+    for ( std::size_t idx = 0; idx < thread_roles_n; ++idx ) {
+        const auto role = static_cast<thread_role>(idx);
+        if ( roles.dedicated(role) ) {
+            cpu.emplace_back(thread_role_name(role), roles.cpu_seconds(role));
+        }
+    }
+    append_metric(out, "shared_state_thread_cpu_seconds_total", "counter"
+        ,"The CPU time used by the threads of the role, the roles without own threads are accounted to the workers."
+        ,"role", cpu);
+    append_metric(out, "shared_state_keys", "gauge", "The number of the live keys."
+        ,keys);
+    append_metric(out, "shared_state_seq", "gauge", "The sequence number of the latest change."
+        ,seq);
+    if ( replica ) {
+        append_metric(out, "shared_state_replication_connected", "gauge", "1 if the replica is connected to the primary."
+            ,replica->connected());
+        append_metric(out, "shared_state_replication_lag_ms", "gauge", "The time from the latest replicated change was applied by the primary till it was received."
+            ,replica->lag());
+        append_metric(out, "shared_state_replication_hops", "gauge", "The number of the hops between the replica and the primary, 1 if it follows the primary directly."
+            ,replica->hops());
+        append_metric(out, "shared_state_replication_resyncs_total", "counter", "The number of the full syncs the replica had to do after the first one."
+            ,replica->resyncs());
+    }
+    append_metric(out, "shared_state_connections", "gauge", "The number of the active connections."
+        ,mtr.get(counter::connections_opened, counter::connections_closed));
+    append_metric(out, "shared_state_connections_total", "counter", "The number of the accepted connections."
+        ,mtr.get(counter::connections_opened));
+    append_metric(out, "shared_state_rejected_connections_total", "counter", "The number of the connections rejected with BUSY."
+        ,mtr.get(counter::connections_rejected));
+    append_metric(out, "shared_state_stops_total", "counter", "The number of the clients told by STOP to reconnect on the reset."
+        ,mtr.get(counter::stops));
+    append_metric(out, "shared_state_waiting_syncs", "gauge", "The number of the syncs waiting for the free slot."
+        ,adm.waiting_syncs());
+    append_metric(out, "shared_state_sessions_in_use", "gauge", "The number of the session slots in use."
+        ,ses.in_use());
+    append_metric(out, "shared_state_buffers_in_use", "gauge", "The number of the string buffers in use."
+        ,bufs.in_use());
+    append_metric(out, "shared_state_buffers_bytes_in_use", "gauge", "The bytes of the pooled blocks in use."
+        ,bufs.bytes_in_use());
+    append_metric(out, "shared_state_buffers_bytes", "gauge", "The bytes of the pooled blocks allocated."
+        ,bufs.bytes());
+    append_metric(out, "shared_state_updates_total", "counter", "The number of the updates changed the state."
+        ,mtr.get(counter::updates));
+    append_metric(out, "shared_state_deletes_total", "counter", "The number of the deleted keys."
+        ,mtr.get(counter::deletes));
+    append_metric(out, "shared_state_broadcasts_total", "counter", "The number of the broadcasted messages."
+        ,mtr.get(counter::broadcasts));
+    append_metric(out, "shared_state_deliveries_total", "counter", "The number of the broadcasted messages queued to the subscribers."
+        ,mtr.get(counter::deliveries));
+    append_metric(out, "shared_state_received_bytes_total", "counter", "The number of the bytes received from the clients."
+        ,mtr.get(counter::bytes_in));
+    append_metric(out, "shared_state_sent_bytes_total", "counter", "The number of the bytes sent to the clients."
+        ,mtr.get(counter::bytes_out));
+    append_metric(out, "shared_state_write_queue_depth", "gauge", "The number of the messages queued and not yet written."
+        ,mtr.get(counter::writes_queued, counter::writes_done));
+
+    return out;
+}
+
+/**********************************************************************************************************************/
+
+// the SO_BUSY_POLL's time in microseconds, the asio's SettableSocketOption
+struct busy_poll_option {
+    explicit busy_poll_option(int usecs) noexcept
+        :m_usecs{usecs}
+    {}
+
+    template<typename Protocol>
+    int level(const Protocol &) const noexcept { return SOL_SOCKET; }
+    template<typename Protocol>
+    int name(const Protocol &) const noexcept { return SO_BUSY_POLL; }
+    template<typename Protocol>
+    const void* data(const Protocol &) const noexcept { return std::addressof(m_usecs); }
+    template<typename Protocol>
+    std::size_t size(const Protocol &) const noexcept { return sizeof(m_usecs); }
+
+private:
+    int m_usecs;
+};
+
+template<typename Acceptor>
+void start_listener(Acceptor &acc, const command_context &ctx, bool subscribe_all) {
+    acc.start(
+         [&ctx, subscribe_all] (typename Acceptor::socket_type sock)
+         {
+            if constexpr ( std::is_same_v<typename Acceptor::socket_type, tcp::socket> ) {
+                if ( ctx.so_busy_poll ) {
+                    bs::error_code ec;
+                    sock.set_option(busy_poll_option{ctx.so_busy_poll}, ec);
+                }
+            }
+            on_new_connection(ctx, subscribe_all, stream_socket{std::move(sock)});
+         }
+        ,error_handler
+    );
+}
+
+// the AF_UNIX listener is optional
+void start_listeners(acceptor &acc, local_acceptor *local_acc, const command_context &ctx, bool subscribe_all) {
+    start_listener(acc, ctx, subscribe_all);
+    if ( local_acc ) {
+        start_listener(*local_acc, ctx, subscribe_all);
+    }
+}
+
+// CB's signature: void()
+// called when both listeners are stopped
+template<typename CB>
+void stop_listeners(acceptor &acc, local_acceptor *local_acc, CB cb) {
+    acc.stop(
+        [local_acc, cb=std::move(cb)]
+        () mutable
+        {
+            if ( local_acc ) {
+                local_acc->stop(std::move(cb));
+            } else {
+                cb();
+            }
+        }
+    );
+}
+
+/**********************************************************************************************************************/
+// the hot restart, see handoff.hpp
+
+struct handoff_job {
+    thread_roles &roles;
+    acceptor &acc;
+    local_acceptor *local_acc;
+    acceptor *mtr_acc;
+    replica_client *replica;
+    shm_ring_writer *ring;
+    const command_context &ctx;
+    // starts the listeners adopted back when the new process failed to take over
+    const std::function<void()> &serve_again;
+    ba::local::stream_protocol::socket sock;
+    handoff_state state;
+};
+
+// CB's signature: void()
+// called when the listener is released, or at once if there is no listener
+template<typename Acceptor, typename CB>
+void release_listener(Acceptor *acc, int &fd, CB cb) {
+    if ( !acc ) {
+        return cb();
+    }
+
+    acc->release(
+        [&fd, cb=std::move(cb)]
+        (int released) mutable
+        {
+            fd = released;
+            cb();
+        }
+    );
+}
+
+// the sessions detached but not taken over are told to reconnect,
+// their reconnects are spread over the window the same way as on the reset
+void stop_handed_off(const command_context &ctx, std::vector<detached_session> &sessions) {
+    const auto window = ctx.admission.reconnect_window(ctx.reset_window);
+    const auto slot = window / std::max<std::size_t>(sessions.size(), 1u);
+    std::size_t idx = 0;
+    for ( auto &it: sessions ) {
+        const auto stop = make_stop(ctx.pool, slot * idx++);
+        // the detached session's socket has no queued bytes, so the short message is written at once
+        if ( const auto &buf = stop.get(it.write_protocol); buf ) {
+            [[maybe_unused]] const auto wr = ::send(it.fd, buf->data(), buf->size(), MSG_NOSIGNAL|MSG_DONTWAIT);
+        }
+        ::shutdown(it.fd, SHUT_RDWR);
+        ::close(std::exchange(it.fd, -1));
+    }
+}
+
+// called on the fanout strand when the new process failed to take over:
+// the listeners and the replica are taken back, the ring is still this process's, and the process keeps serving
+void take_back(const std::shared_ptr<handoff_job> &job) {
+    auto &state = job->state;
+    stop_handed_off(job->ctx, state.sessions);
+    job->ctx.smgr.resume_all();
+
+    auto adopt = [](auto *acc, int &fd) {
+        if ( acc && fd != -1 ) {
+            acc->adopt(std::exchange(fd, -1));
+        }
+    };
+    adopt(std::addressof(job->acc), state.tcp_fd);
+    adopt(job->local_acc, state.local_fd);
+    adopt(job->mtr_acc, state.metrics_fd);
+    close_handoff(state);
+
+    if ( job->replica ) {
+        job->replica->resume(state.repl_since, state.repl_epoch);
+        job->replica->start(error_handler);
+    }
+    job->serve_again();
+    std::cout << "the handoff failed, the connections are told to reconnect, serving again" << std::endl;
+}
+
+// called on the fanout strand when the sessions are detached.
+// nothing is served anymore, so the state is sent blocking, and the process exits when the new one
+// confirms it took over. the ring is left to the new process then
+void send_handed_off(const std::shared_ptr<handoff_job> &job) {
+    const auto sessions = job->state.sessions.size();
+    bool confirmed = false;
+    try {
+        confirmed = send_handoff(job->sock.native_handle(), job->state);
+        if ( !confirmed ) {
+            std::cerr << "handoff: the new process has gone before it took over" << std::endl;
+        }
+    } catch (const std::exception &ex) {
+        std::cerr << "std::exception: " << ex.what() << std::endl;
+    }
+    if ( !confirmed ) {
+        return take_back(job);
+    }
+
+    std::cout << "handed off " << sessions << " connections!" << std::endl;
+    if ( job->ring ) {
+        job->ring->disown();
+    }
+    close_handoff(job->state);
+    job->roles.stop();
+}
+
+// the steps follow each other: the sessions are paused, the state is taken when the changes made
+// before are applied, and the sessions are detached when those changes are broadcasted
+void hand_off_sessions(const std::shared_ptr<handoff_job> &job) {
+    auto &ctx = job->ctx;
+    ctx.smgr.pause_all(
+        [job, &ctx]
+        ()
+        {
+            ctx.state.snapshot(
+                [job, &ctx]
+                (std::string frames, std::uint64_t seq, std::uint64_t epoch, std::uint64_t horizon)
+                {
+                    job->state.frames = std::move(frames);
+                    job->state.seq = seq;
+                    job->state.epoch = epoch;
+                    job->state.horizon = horizon;
+                    ctx.smgr.detach_all(
+                         handoff_drain_time
+                        ,[job]
+                         (std::vector<detached_session> sessions)
+                         {
+                            job->state.sessions = std::move(sessions);
+                            send_handed_off(job);
+                         }
+                    );
+                }
+            );
+        }
+    );
+}
+
+// called on the handoff connection's strand.
+// the listeners are released first, so the new connections wait in the backlog for the new process
+void hand_off(const std::shared_ptr<handoff_job> &job) {
+    std::cout << "handing off to the new process..." << std::endl;
+    if ( job->ring ) {
+        // the ring's own descriptor is kept by the ring
+        job->state.ring_fd = ::dup(job->ring->fd());
+        job->state.ring_name = job->ring->name();
+    }
+    auto stop_replica = [job]() {
+        if ( !job->replica ) {
+            return hand_off_sessions(job);
+        }
+
+        job->replica->stop(
+            [job]
+            (std::uint64_t since, std::uint64_t epoch)
+            {
+                job->state.replica = true;
+                job->state.repl_since = since;
+                job->state.repl_epoch = epoch;
+                hand_off_sessions(job);
+            }
+        );
+    };
+    release_listener(
+         std::addressof(job->acc)
+        ,job->state.tcp_fd
+        ,[job, stop_replica]
+         ()
+         {
+            release_listener(
+                 job->local_acc
+                ,job->state.local_fd
+                ,[job, stop_replica]
+                 ()
+                 { release_listener(job->mtr_acc, job->state.metrics_fd, stop_replica); }
+            );
+         }
+    );
+}
+
 /**********************************************************************************************************************/
 
 void start_signal_handler(
-     ba::io_context &ioctx
+     thread_roles &roles
     ,acceptor &acc
-    ,session_manager &smgr
-    ,state_storage &state
+    ,local_acceptor *local_acc
+    ,const command_context &ctx
+    ,bool subscribe_all
     ,std::unique_ptr<ba::signal_set> signals = {})
 {
     if ( !signals ) {
-        signals = std::make_unique<ba::signal_set>(ioctx, SIGINT, SIGTERM, SIGUSR1);
+        signals = std::make_unique<ba::signal_set>(roles.context(thread_role::housekeeping), SIGINT, SIGTERM, SIGUSR1);
         signals->add(SIGUSR2);
     }
 
     auto *signals_ptr = signals.get();
     signals_ptr->async_wait(
-        [&ioctx, &acc, &smgr, &state, signals=std::move(signals)]
+        [&roles, &acc, local_acc, &ctx, subscribe_all, signals=std::move(signals)]
         (bs::error_code, int sig) mutable {
             std::cout << "SIG" << sigabbrev_np(sig) << " signal received!" << std::endl;
             if ( sig == SIGINT || sig == SIGTERM ) {
-                ioctx.stop();
+                roles.stop();
             } else {
                 if ( sig == SIGUSR1 ) {
-                    auto is_open_fut = acc.is_open();
-                    if ( is_open_fut.get() ) {
-                        std::cout << "stop accept!" << std::endl;
-                        acc.stop();
-                    } else {
-                        std::cout << "start accept!" << std::endl;
-                        acc.start(
-                             [&state, &smgr] (tcp::socket sock)
-                             { on_new_connection(state, smgr, std::move(sock)); }
-                            ,error_handler
-                        );
-                    }
+                    acc.is_open(
+                        [&acc, local_acc, &ctx, subscribe_all]
+                        (bool is_open)
+                        {
+                            if ( is_open ) {
+                                std::cout << "stop accept!" << std::endl;
+                                stop_listeners(acc, local_acc, []{});
+                            } else {
+                                std::cout << "start accept!" << std::endl;
+                                start_listeners(acc, local_acc, ctx, subscribe_all);
+                            }
+                        }
+                    );
                 } else if ( sig == SIGUSR2 ) {
-                    auto acc_fut = acc.stop();
-                    acc_fut.get();
-
-                    auto smgr_fut = smgr.reset();
-                    smgr_fut.get();
-
-                    auto reset_fut = state.reset();
-                    reset_fut.get();
-
-                    acc.start(
-                         [&state, &smgr] (tcp::socket sock)
-                         { on_new_connection(state, smgr, std::move(sock)); }
-                        ,error_handler
+                    // the steps follow each other, none of them waits for the previous one
+                    stop_listeners(
+                         acc
+                        ,local_acc
+                        ,[&acc, local_acc, &ctx, subscribe_all]
+                         ()
+                         {
+                            ctx.smgr.reset(
+                                 ctx.admission.reconnect_window(ctx.reset_window)
+                                ,[&acc, local_acc, &ctx, subscribe_all]
+                                ()
+                                {
+                                    ctx.state.reset(
+                                        [&acc, local_acc, &ctx, subscribe_all]
+                                        ()
+                                        { start_listeners(acc, local_acc, ctx, subscribe_all); }
+                                    );
+                                }
+                            );
+                         }
                     );
                 }
 
                 start_signal_handler(
-                     ioctx
+                     roles
                     ,acc
-                    ,smgr
-                    ,state
+                    ,local_acc
+                    ,ctx
+                    ,subscribe_all
                     ,std::move(signals)
                 );
             }
@@ -294,6 +1183,16 @@ void start_signal_handler(
 
 /**********************************************************************************************************************/
 
+prealloc_mode parse_prealloc_mode(const std::string &str) {
+    if ( str == "none" ) { return prealloc_mode::none; }
+    if ( str == "slab" ) { return prealloc_mode::slab; }
+    if ( str == "hugepages" ) { return prealloc_mode::hugepages; }
+
+    throw std::invalid_argument{"wrong preallocation mode: " + str};
+}
+
+/**********************************************************************************************************************/
+
 int main(int argc, char **argv) try {
     struct: cmdargs::kwords_group {
         CMDARGS_OPTION_ADD(ip, std::string, "server IP", and_(port));
@@ -301,15 +1200,94 @@ int main(int argc, char **argv) try {
         CMDARGS_OPTION_ADD(threads, std::size_t
             ,"the number of working threads, by default - all avail threads be used"
             ,optional, default_<std::size_t>(std::thread::hardware_concurrency()));
+        CMDARGS_OPTION_ADD(thread_roles, std::string
+            ,"the threads dedicated to the roles in addition to the working threads, "
+             "the comma separated list of `role:threads`, where the role is one of "
+             "`accept`, `storage`, `fanout`, `housekeeping`, the roles not listed are run by the working threads"
+            ,optional, default_<std::string>(""));
+        CMDARGS_OPTION_ADD(busy_poll, std::size_t
+            ,"the time in microseconds the working, storage and fanout threads spin polling for the work "
+             "before they block, or 0 to not spin. burns the CPUs for the lower latency"
+            ,optional, default_<std::size_t>(0u));
+        CMDARGS_OPTION_ADD(so_busy_poll, std::size_t
+            ,"the SO_BUSY_POLL's time in microseconds set to the TCP sockets, so the kernel polls the device "
+             "queue on the reads, or 0 to not set. the values above `net.core.busy_read` need CAP_NET_ADMIN"
+            ,optional, default_<std::size_t>(0u));
+        CMDARGS_OPTION_ADD(cpu_affinity, std::string
+            ,"the CPUs the threads are pinned to, in the taskset's list format, e.g. `0-3,8`. "
+             "the threads of the roles are pinned first, in the order above, then the working threads, "
+             "and the CPUs are reused in the round-robin if there are less of them than the threads"
+            ,optional, default_<std::string>(""));
         CMDARGS_OPTION_ADD(max_size, std::size_t, "the maximum length of input lines"
             ,optional, default_<std::size_t>(1024u));
         CMDARGS_OPTION_ADD(sessions_n, std::size_t, "the number of initialy preallocated sessions"
             ,optional, default_<std::size_t>(1024u));
         CMDARGS_OPTION_ADD(buffers_n, std::size_t, "the number of initialy preallocated string buffers"
             ,optional, default_<std::size_t>(1024u*10u));
+        CMDARGS_OPTION_ADD(prealloc, std::string
+            ,"how the sessions and buffers are preallocated: `none` - on demand, `slab` - up front in one "
+             "contiguous slab, `hugepages` - the same as `slab`, but backed by the huge pages if possible"
+            ,optional, default_<std::string>("none"));
         CMDARGS_OPTION_ADD(inactivity_time, std::size_t
             ,"the timeout in MS after which a client will be disconnected as dead, or 0 to disable"
             ,optional, default_<std::size_t>(1000u));
+        CMDARGS_OPTION_ADD(subscribe_all, bool
+            ,"subscribe new connections to all the keys and send them the full state, "
+             "otherwise the clients must use SUBS command to receive the changes"
+            ,optional, default_<bool>(true));
+        CMDARGS_OPTION_ADD(batch_interval, std::size_t
+            ,"the interval in microseconds the batched changes are sent to the clients enabled batching"
+            ,optional, default_<std::size_t>(1000u));
+        CMDARGS_OPTION_ADD(batch_bytes, std::size_t
+            ,"the number of accumulated bytes after which the batched changes are sent immediately"
+            ,optional, default_<std::size_t>(1024u*16u));
+        CMDARGS_OPTION_ADD(tombstone_ttl, std::size_t
+            ,"the time in MS the deleted keys are kept for the delta syncs, or 0 to not keep them"
+            ,optional, default_<std::size_t>(60u*1000u));
+        CMDARGS_OPTION_ADD(compress_level, std::size_t
+            ,"the deflate level (1-9) of the connections requested the compression, or 0 to disable the compression"
+            ,optional, default_<std::size_t>(1u));
+        CMDARGS_OPTION_ADD(pending_accepts, std::size_t
+            ,"the number of the accepts kept outstanding on each listener"
+            ,optional, default_<std::size_t>(16u));
+        CMDARGS_OPTION_ADD(max_connections, std::size_t
+            ,"the max number of the connections, the excess ones are rejected with BUSY, or 0 to not limit"
+            ,optional, default_<std::size_t>(0u));
+        CMDARGS_OPTION_ADD(max_accept_rate, std::size_t
+            ,"the max number of the new connections per second, the excess ones are rejected with BUSY, or 0 to not limit"
+            ,optional, default_<std::size_t>(0u));
+        CMDARGS_OPTION_ADD(max_syncs, std::size_t
+            ,"the max number of the concurrent syncs, the excess ones wait for their turn, or 0 to not limit"
+            ,optional, default_<std::size_t>(0u));
+        CMDARGS_OPTION_ADD(retry_after, std::size_t
+            ,"the time in MS the rejected clients are told to retry after"
+            ,optional, default_<std::size_t>(1000u));
+        CMDARGS_OPTION_ADD(reset_window, std::size_t
+            ,"the minimal time in MS the clients' reconnects are spread over on the reset (SIGUSR2), "
+             "widened to keep the reconnects within max_accept_rate"
+            ,optional, default_<std::size_t>(5000u));
+        CMDARGS_OPTION_ADD(unix_path, std::string
+            ,"the path of the AF_UNIX socket the server listens on in addition to TCP, or empty to not listen"
+            ,optional, default_<std::string>(""));
+        CMDARGS_OPTION_ADD(shm_ring, std::string
+            ,"the name of the shared memory ring (in /dev/shm) the broadcasts are published to "
+             "for the same-host readers, or empty to not publish"
+            ,optional, default_<std::string>(""));
+        CMDARGS_OPTION_ADD(shm_ring_size, std::size_t
+            ,"the size of the shared memory ring in bytes, rounded up to the power of two"
+            ,optional, default_<std::size_t>(1024u*1024u*4u));
+        CMDARGS_OPTION_ADD(replica_of, std::string
+            ,"the `host:port` of the upstream server this one replicates, the primary or another replica, "
+             "the replica relays the upstream's stream to its read-only clients, or empty to be the primary"
+            ,optional, default_<std::string>(""));
+        CMDARGS_OPTION_ADD(handoff_path, std::string
+            ,"the path of the AF_UNIX socket for the hot restart: the server started with the path some server "
+             "listens on takes over its listening sockets, state and connections, and then listens on it itself "
+             "for the next one, or empty to disable"
+            ,optional, default_<std::string>(""));
+        CMDARGS_OPTION_ADD(metrics_port, std::uint16_t
+            ,"the PORT the metrics are served on in the Prometheus text format over HTTP, or 0 to disable"
+            ,optional, default_<std::uint16_t>(0u));
 
         CMDARGS_OPTION_ADD_HELP();
         CMDARGS_OPTION_ADD_VERSION("0.0.1");
@@ -328,44 +1306,237 @@ int main(int argc, char **argv) try {
     const auto ip         = args[kwords.ip];
     const auto port       = args[kwords.port];
     const auto threads    = args[kwords.threads];
+    const auto roles_cfg  = parse_thread_roles(args[kwords.thread_roles]);
+    const auto cpus       = parse_cpu_list(args[kwords.cpu_affinity]);
+    const auto busy_poll  = std::chrono::microseconds{args[kwords.busy_poll]};
+    const auto so_bpoll   = static_cast<int>(args[kwords.so_busy_poll]);
     const auto sessions_n = args[kwords.sessions_n];
     const auto buffers_n  = args[kwords.buffers_n];
     const auto ina_time   = args[kwords.inactivity_time];
+    const auto prealloc   = parse_prealloc_mode(args[kwords.prealloc]);
     const auto max_size   = args[kwords.max_size];
+    const auto sub_all    = args[kwords.subscribe_all];
+    const auto batch_int  = args[kwords.batch_interval];
+    const auto batch_size = args[kwords.batch_bytes];
+    const auto tomb_ttl   = args[kwords.tombstone_ttl];
+    const auto comp_level = static_cast<int>(args[kwords.compress_level]);
+    const auto mtr_port   = args[kwords.metrics_port];
+    const auto unix_path  = args[kwords.unix_path];
+    const auto pend_accs  = args[kwords.pending_accepts];
+    const auto max_conns  = args[kwords.max_connections];
+    const auto max_rate   = args[kwords.max_accept_rate];
+    const auto max_syncs  = args[kwords.max_syncs];
+    const auto retry_aft  = args[kwords.retry_after];
+    const auto reset_win  = args[kwords.reset_window];
+    const auto ring_name  = args[kwords.shm_ring];
+    const auto ring_size  = args[kwords.shm_ring_size];
+    const auto replica_of = args[kwords.replica_of];
+    const auto hoff_path  = args[kwords.handoff_path];
+    if ( comp_level > Z_BEST_COMPRESSION ) {
+        std::cerr << "command line error: the compression level must be in the range 0-9" << std::endl;
+        return EXIT_FAILURE;
+    }
+    const auto primary_sep = replica_of.rfind(':');
+    if ( !replica_of.empty() && (primary_sep == std::string::npos || primary_sep == 0) ) {
+        std::cerr << "command line error: the primary must be specified as `host:port`" << std::endl;
+        return EXIT_FAILURE;
+    }
 
-    ba::io_context ioctx(threads);
-    ioctx.post([threads]{ std::cout << "server started with " << threads << " threads..." << std::endl; });
+    // the previous process stops serving when the connection is accepted, so nothing is done before
+    handoff_state taken;
+    const bool took_over = !hoff_path.empty() && receive_handoff(hoff_path, taken);
 
-    buffers_pool str_pool{buffers_n};
-    sessions_pool ses_pool{sessions_n};
-    state_storage state{ioctx};
-    session_manager smgr{ioctx, max_size, ina_time, ses_pool, str_pool};
-    acceptor acc{ioctx, ip, port};
-    acc.start(
-         [&state, &smgr] (tcp::socket sock)
-         { on_new_connection(state, smgr, std::move(sock)); }
-        ,error_handler
-    );
+    // the pools and the admission control must outlive the io_context,
+    // because the destroyed handlers can hold the pooled objects and the sync permits
+    buffers_pool str_pool{buffers_n, prealloc};
+    session_table ses_table{sessions_n, prealloc};
+    if ( prealloc == prealloc_mode::hugepages && !ses_table.hugepages() ) {
+        std::cout << "huge pages are not available, the transparent huge pages will be used if enabled" << std::endl;
+    }
 
+    metrics mtr;
+    admission_control admission{mtr, max_conns, max_rate, max_syncs, retry_aft};
+
+    thread_roles roles{threads, roles_cfg, cpus, busy_poll};
+    auto &ioctx = roles.context(thread_role::worker);
+    auto &hk_ioctx = roles.context(thread_role::housekeeping);
+    ioctx.post([&roles] {
+        std::cout << "server started with " << roles.threads(thread_role::worker) << " threads";
+        for ( std::size_t idx = 1; idx < thread_roles_n; ++idx ) {
+            const auto role = static_cast<thread_role>(idx);
+            if ( roles.dedicated(role) ) {
+                std::cout << ", " << thread_role_name(role) << ": " << roles.threads(role);
+            }
+        }
+        std::cout << "..." << std::endl;
+    });
+    if ( so_bpoll ) {
+        // the kernel allows it or not for all the sockets the same way, so it's checked once here
+        tcp::socket probe{ioctx, tcp::v4()};
+        bs::error_code ec;
+        probe.set_option(busy_poll_option{so_bpoll}, ec);
+        if ( ec ) {
+            std::cout << "SO_BUSY_POLL can't be set: " << ec.message() << ", the sockets are not busy polled" << std::endl;
+        }
+    }
+
+    // the ring handed off is published to further if it's the same one,
+    // so its readers don't notice the restart, otherwise its readers are stopped when the takeover is confirmed
+    std::unique_ptr<shm_ring_writer> taken_ring;
+    if ( took_over && taken.ring_fd != -1 ) {
+        taken_ring = std::make_unique<shm_ring_writer>(taken.ring_name, std::exchange(taken.ring_fd, -1));
+    }
+    std::unique_ptr<shm_ring_writer> ring;
+    if ( !ring_name.empty() ) {
+        ring = (taken_ring && taken_ring->name() == ring_name)
+            ? std::move(taken_ring)
+            : std::make_unique<shm_ring_writer>(ring_name, ring_size)
+        ;
+        std::cout << "the broadcasts are published to the shared memory ring " << ring->name()
+                  << " of " << ring->capacity() << " bytes" << std::endl;
+    }
+    state_storage state{roles.context(thread_role::storage), str_pool, mtr, tomb_ttl};
+    session_manager smgr{roles.context(thread_role::fanout), max_size, ina_time, ses_table, str_pool, mtr, ring.get(), sub_all, batch_int, batch_size, error_handler};
+    std::unique_ptr<replica_client> replica;
+    if ( !replica_of.empty() ) {
+        replica = std::make_unique<replica_client>(
+             ioctx
+            ,replica_of.substr(0, primary_sep)
+            ,replica_of.substr(primary_sep + 1)
+            ,state
+            ,smgr
+            ,admission
+            ,str_pool
+            ,retry_aft
+            ,reset_win
+        );
+        if ( took_over && taken.replica ) {
+            replica->resume(taken.repl_since, taken.repl_epoch);
+        }
+        replica->start(error_handler);
+        std::cout << "replicating the upstream " << replica_of << std::endl;
+    }
+    const command_context ctx{state, smgr, admission, comp_level, so_bpoll, str_pool, reset_win, replica.get()};
+    auto &acc_ioctx = roles.context(thread_role::accept);
+    acceptor acc{acc_ioctx, ioctx, tcp::endpoint{ba::ip::make_address(ip), port}, pend_accs};
+    std::unique_ptr<local_acceptor> local_acc;
+    if ( !unix_path.empty() ) {
+        local_acc = std::make_unique<local_acceptor>(
+             acc_ioctx
+            ,ioctx
+            ,ba::local::stream_protocol::endpoint{unix_path}
+            ,pend_accs
+        );
+    }
     // for statistic
-    start_statistics_timer(ioctx, str_pool, ses_pool, smgr);
+    acceptor mtr_acc{hk_ioctx, tcp::endpoint{ba::ip::make_address(ip), mtr_port}};
+    if ( took_over ) {
+        // the listeners not configured here are closed, the restored state is applied before anything else
+        auto adopt = [](auto *acc, int fd) {
+            if ( fd != -1 && acc ) {
+                acc->adopt(fd);
+            } else if ( fd != -1 ) {
+                ::close(fd);
+            }
+        };
+        adopt(std::addressof(acc), taken.tcp_fd);
+        adopt(local_acc.get(), taken.local_fd);
+        adopt(mtr_port ? std::addressof(mtr_acc) : nullptr, taken.metrics_fd);
+        state.restore(
+             std::move(taken.frames)
+            ,taken.seq
+            ,taken.epoch
+            ,taken.horizon
+            ,[](bool ok)
+             { if ( !ok ) CALL_ERROR_HANDLER(error_handler, MAKE_ERROR_INFO_2("handoff", -1, "wrong state received!")); }
+        );
+        for ( const auto &it: taken.sessions ) {
+            on_handed_off_connection(ctx, ioctx, it);
+        }
+        std::cout << "took over " << taken.sessions.size() << " connections from the previous process" << std::endl;
+    }
+    start_listeners(acc, local_acc.get(), ctx, sub_all);
 
-    // LINUX signal handler
-    start_signal_handler(ioctx, acc, smgr, state);
+    auto start_metrics = [&]() {
+        if ( !mtr_port ) {
+            return;
+        }
 
-    std::vector<std::thread> threadsv;
-    threadsv.reserve(threads);
-    for ( auto n = threads-1; n; --n ) {
-        threadsv.emplace_back([&ioctx]{ ioctx.run(); });
+        mtr_acc.start(
+             [&state, &mtr, &admission, &str_pool, &ses_table, &roles, repl=replica.get()] (tcp::socket sock)
+             {
+                metrics_connection::start(
+                     std::move(sock)
+                    ,[&state, &mtr, &admission, &str_pool, &ses_table, &roles, repl]
+                     (auto reply_cb)
+                     {
+                        // read without the storage's strand, so the scrape doesn't wait behind the writes
+                        reply_cb(render_metrics(
+                            mtr, admission, str_pool, ses_table, roles, repl, state.size(), state.seq()));
+                     }
+                );
+             }
+            ,error_handler
+        );
+    };
+    start_metrics();
+    start_trim_timer(hk_ioctx, str_pool);
+
+    // the next process takes over through it
+    std::unique_ptr<local_acceptor> hoff_acc;
+    std::atomic_bool handing_off{false};
+    std::function<void()> serve_again;
+    auto start_handoff = [&, repl=replica.get(), mtr=(mtr_port ? std::addressof(mtr_acc) : nullptr)]() {
+        hoff_acc->start(
+             [&, repl, mtr]
+             (ba::local::stream_protocol::socket sock)
+             {
+                if ( handing_off.exchange(true) ) {
+                    return;
+                }
+
+                hoff_acc->stop([]{});
+                hand_off(std::make_shared<handoff_job>(handoff_job{
+                    roles, acc, local_acc.get(), mtr, repl, ring.get(), ctx, serve_again, std::move(sock), handoff_state{}}));
+             }
+            ,error_handler
+        );
+    };
+    if ( !hoff_path.empty() ) {
+        hoff_acc = std::make_unique<local_acceptor>(hk_ioctx, ba::local::stream_protocol::endpoint{hoff_path});
+        start_handoff();
+    }
+    serve_again = [&]() {
+        start_listeners(acc, local_acc.get(), ctx, sub_all);
+        start_metrics();
+        handing_off = false;
+        start_handoff();
+    };
+
+    if ( took_over ) {
+        // the previous process exits when it's told, and takes everything back if this one fails before.
+        // the ring not published to anymore is removed, its readers are stopped
+        confirm_handoff(taken);
+        if ( ring ) {
+            ring->own();
+        }
+        if ( taken_ring ) {
+            taken_ring->publish(make_stop(str_pool, 0u).get(protocol::binary)->view());
+            taken_ring->own();
+            taken_ring.reset();
+        }
     }
 
+    // LINUX signal handler
+    start_signal_handler(roles, acc, local_acc.get(), ctx, sub_all);
+
     // we will blocked here until SIGINT/SIGTERM
-    ioctx.run();
+    roles.run();
 
-    // wait for all threads to exit
-    for ( auto &it: threadsv ) {
-        it.join();
-    }
+    // the sessions are released through the session manager's strand and destroyed on their own strands,
+    // so they are drained here while the session manager and the session table are still alive
+    smgr.stop_all();
+    roles.poll();
 
     std::cout << "server stopped!" << std::endl;
 